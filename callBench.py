@@ -0,0 +1,54 @@
+#!/usr/bin/env python
+# Measures the per-call overhead of pydsm's entry points, to compare the
+# Python 2 build with the Python 3 (METH_FASTCALL) one.   Run it against
+# the stand-in libdsm (make bench) so the RPCs cost next to nothing
+# and what's left is argument parsing and building the results.
+from __future__ import print_function
+import pydsm, time, sys
+
+nLoops = 100000
+nRepeats = 5
+if len(sys.argv) > 1:
+  nLoops = int(sys.argv[1])
+
+def readScalar():     pydsm.read('hcn', 'DSM_TEST_SHORT_S')
+def readKeywords():   pydsm.read(partner='hcn', name='DSM_TEST_SHORT_S', timeout=None)
+def readString():     pydsm.read('hcn', 'DSM_SOURCE_C24')
+def readArray():      pydsm.read('hcn', 'DSM_CHAN_V8_V4_S')
+def readIndex():      pydsm.read('hcn', 'DSM_CHAN_V8_V4_S', index=3)
+def readStructure():  pydsm.read('crate1', 'CRATE_TO_HAL_X')
+def writeScalar():    pydsm.write('hcn', 'DSM_TEST_DOUBLE_D', 1.5)
+def writeNotify():    pydsm.write('hcn', 'DSM_TEST_FLOAT_F', 2.5, notify=True)
+def writeArray():     pydsm.write('hcn', 'DSM_DELAY_V4_D', (1.0, 2.0, 3.0, 4.0))
+def pollEvents():     pydsm.read_wait_many(timeout=0)
+def readAll():        pydsm.read_all('DSM_TEST_SHORT_S', partners=['crate1', 'crate2'], max_parallel=1)
+
+try:
+  import pydsm_typed   # made by "make bench" from makeTyped.py
+  typedRead = pydsm_typed.hcn.DSM_TEST_SHORT_S.read
+  typedArray = pydsm_typed.hcn.DSM_CHAN_V8_V4_S.read
+  typedWrite = pydsm_typed.hcn.DSM_TEST_DOUBLE_D.write
+  def readTyped():    typedRead()
+  def readTypedArray(): typedArray()
+  def writeTyped():   typedWrite(1.5)
+  typed = [readTyped, readTypedArray, writeTyped]
+except ImportError:
+  typed = []
+
+def perCall(operation):
+  best = None
+  for repeat in range(nRepeats):
+    start = time.time()
+    for i in range(nLoops):
+      operation()
+    elapsed = (time.time()-start)/nLoops
+    if (best is None) or (elapsed < best):
+      best = elapsed
+  return best
+
+pydsm.open(0)
+pydsm.monitor('hcn', 'DSM_TEST_FLOAT_F')
+print('Python %d.%d, best of %d runs of %d calls' % (sys.version_info[0], sys.version_info[1], nRepeats, nLoops))
+for operation in [readScalar, readKeywords, readString, readArray, readIndex, readStructure, writeScalar, writeNotify,
+                  writeArray, pollEvents, readAll] + typed:
+  print('%-14s %7.2f us per call' % (operation.__name__, perCall(operation)*1.0e6))
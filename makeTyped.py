@@ -0,0 +1,637 @@
+#!/usr/bin/env python
+# Generates pydsm_typed.c, a companion module with one accessor per DSM
+# allocation, specialised for its type and shape when it is generated:
+#
+#   python makeTyped.py [-o pydsm_typed.c] [pattern ...]
+#
+#   import pydsm_typed
+#   (value, timestamp) = pydsm_typed.hcn.DSM_AS_SCANS_REMAINING_L.read()
+#   pydsm_typed.hcn.DSM_TEST_SHORT_S.write(3, notify=True, timeout=0.5)
+#   from pydsm_typed.hcn import DSM_AS_SCANS_REMAINING_L   # fails at import if there's no such allocation
+#
+# Each pattern (fnmatch style, on "partner.NAME") picks allocations to
+# include, e.g. 'hcn.DSM_AS_*' or '*.DSM_TEST_SHORT_S'; with none, every
+# allocation is.   Structures are left out.   The catalogue comes from the
+# DSM allocation list, through pydsm.allocations() and pydsm.describe(), so
+# DSM must be running where this is run.   The generated code calls
+# pydsm through its C API (pydsm_capi.h), so reads and writes still go
+# through pydsm's subscription table, snapshot region, latency statistics
+# and circuit breakers, and returns what pydsm.read would.   Build it as
+# pydsm is built, with pydsm_capi.h on the include path.
+from __future__ import print_function
+import fnmatch, re, sys, time
+import pydsm
+
+# code: (C type, element loader, element storer)
+TYPES = {'b': ('signed char', 'fromByte', 'toByte'), 'h': ('short', 'fromShort', 'toShort'),
+         'i': ('int', 'fromLong', 'toLong'), 'f': ('float', 'fromFloat', 'toFloat'),
+         'd': ('double', 'fromDouble', 'toDouble')}
+
+PREAMBLE = r'''/*
+  pydsm_typed: one accessor per DSM allocation, generated by makeTyped.py
+  on %(date)s from the allocation list.   Don't edit it - regenerate it.
+  Each accessor reads and writes its variable as a fixed C type and shape,
+  through pydsm's C API, without decoding its name or looking it up.
+*/
+#define PY_SSIZE_T_CLEAN
+#include "pydsm_capi.h"  /* Python.h first */
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#if PY_MAJOR_VERSION >= 3
+#define PyInt_FromLong   PyLong_FromLong
+#define TEXT(s, n)       PyUnicode_DecodeUTF8((s), (n), "surrogateescape")
+#if PY_VERSION_HEX >= 0x03070000
+#define TYPED_FASTCALL
+#endif
+#else
+#define TEXT(s, n)       PyString_FromStringAndSize((s), (n))
+#endif
+
+static pydsmCAPI *dsmAPI;
+static PyObject *rangeError;  /* pydsm.DSM_RangeError */
+
+/* Not every conversion is needed by every set of allocations */
+#define CONVERSION static __attribute__((unused))
+
+typedef PyObject *(*loader)(const char *element, int size);
+typedef int (*storer)(PyObject *item, char *element, int size);
+
+CONVERSION PyObject *fromByte(const char *element, int size)   { return PyInt_FromLong((long)*(const signed char *)element); }
+CONVERSION PyObject *fromShort(const char *element, int size)  { return PyInt_FromLong((long)*(const short *)element); }
+CONVERSION PyObject *fromLong(const char *element, int size)   { return PyInt_FromLong((long)*(const int *)element); }
+CONVERSION PyObject *fromFloat(const char *element, int size)  { return PyFloat_FromDouble((double)*(const float *)element); }
+CONVERSION PyObject *fromDouble(const char *element, int size) { return PyFloat_FromDouble(*(const double *)element); }
+CONVERSION PyObject *fromString(const char *element, int size) { return TEXT(element, strnlen(element, size)); }
+
+static int toInteger(PyObject *item, long *value, long low, long high)
+{
+  *value = PyLong_AsLong(item);
+  if ((*value == -1) && PyErr_Occurred())
+    return -1;
+  if ((*value < low) || (*value > high)) {
+    PyErr_SetString(rangeError, "DSM error: Value to be written is out of range");
+    return -1;
+  }
+  return 0;
+}
+
+CONVERSION int toByte(PyObject *item, char *element, int size)
+{
+  long value;
+
+  if (toInteger(item, &value, SCHAR_MIN, SCHAR_MAX) != 0)
+    return -1;
+  *(signed char *)element = (signed char)value;
+  return 0;
+}
+
+CONVERSION int toShort(PyObject *item, char *element, int size)
+{
+  long value;
+
+  if (toInteger(item, &value, SHRT_MIN, SHRT_MAX) != 0)
+    return -1;
+  *(short *)element = (short)value;
+  return 0;
+}
+
+CONVERSION int toLong(PyObject *item, char *element, int size)
+{
+  long value;
+
+  if (toInteger(item, &value, INT_MIN, INT_MAX) != 0)
+    return -1;
+  *(int *)element = (int)value;
+  return 0;
+}
+
+CONVERSION int toFloat(PyObject *item, char *element, int size)
+{
+  double value = PyFloat_AsDouble(item);
+
+  if ((value == -1.0) && PyErr_Occurred())
+    return -1;
+  *(float *)element = (float)value;
+  return 0;
+}
+
+CONVERSION int toDouble(PyObject *item, char *element, int size)
+{
+  double value = PyFloat_AsDouble(item);
+
+  if ((value == -1.0) && PyErr_Occurred())
+    return -1;
+  *(double *)element = value;
+  return 0;
+}
+
+CONVERSION int toString(PyObject *item, char *element, int size)
+{
+  const char *text;
+
+#if PY_MAJOR_VERSION >= 3
+  if (PyBytes_Check(item))
+    text = PyBytes_AS_STRING(item);
+  else if (PyUnicode_Check(item))
+    text = PyUnicode_AsUTF8(item);
+  else {
+    PyErr_Format(PyExc_TypeError, "expected a string, not %%.100s", Py_TYPE(item)->tp_name);
+    return -1;
+  }
+#else
+  text = PyString_AsString(item);
+#endif
+  if (text == NULL)
+    return -1;
+  if (strlen(text) > (size_t)(size-1)) {
+    PyErr_SetString(rangeError, "DSM error: String is too long for the variable");
+    return -1;
+  }
+  strncpy(element, text, size);
+  return 0;
+}
+
+/* Builds nested tuples of shape[0] x ... x shape[nDim-1] elements from *data, advancing it */
+static PyObject *nest(const char **data, int elementSize, loader load, const int *shape, int nDim)
+{
+  int i;
+  PyObject *tuple, *item;
+
+  if (nDim == 0) {
+    item = load(*data, elementSize);
+    *data += elementSize;
+    return item;
+  }
+  if ((tuple = PyTuple_New(shape[0])) == NULL)
+    return NULL;
+  for (i = 0; i < shape[0]; i++) {
+    if ((item = nest(data, elementSize, load, shape+1, nDim-1)) == NULL) {
+      Py_DECREF(tuple);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(tuple, i, item);
+  }
+  return tuple;
+}
+
+/* The reverse of nest.   Every dimension must be given in full */
+static int flatten(PyObject *value, char **data, int elementSize, storer store, const int *shape, int nDim)
+{
+  int i, status = 0;
+  PyObject *sequence;
+
+  if (nDim == 0) {
+    status = store(value, *data, elementSize);
+    *data += elementSize;
+    return status;
+  }
+  if ((sequence = PySequence_Fast(value, "DSM error: expected a sequence for an array variable")) == NULL)
+    return -1;
+  if (PySequence_Fast_GET_SIZE(sequence) != shape[0]) {
+    PyErr_Format(rangeError, "DSM error: expected %%d values, not %%d", shape[0], (int)PySequence_Fast_GET_SIZE(sequence));
+    status = -1;
+  }
+  for (i = 0; (i < shape[0]) && (status == 0); i++)
+    status = flatten(PySequence_Fast_GET_ITEM(sequence, i), data, elementSize, store, shape+1, nDim-1);
+  Py_DECREF(sequence);
+  return status;
+}
+
+/* Returns (value, timestamp), as pydsm.read does, taking the reference to value */
+static PyObject *result(PyObject *value, time_t timestamp)
+{
+  PyObject *tuple;
+
+  if (value == NULL)
+    return NULL;
+  if ((tuple = PyTuple_New(2)) == NULL) {
+    Py_DECREF(value);
+    return NULL;
+  }
+  PyTuple_SET_ITEM(tuple, 0, value);
+  PyTuple_SET_ITEM(tuple, 1, PyInt_FromLong((long)timestamp));
+  return tuple;
+}
+
+static PyObject *failed(int status)
+{
+  dsmAPI->setError(status);
+  return NULL;
+}
+
+static PyObject *written(int status)
+{
+  if (status != DSM_SUCCESS)
+    return failed(status);
+  Py_RETURN_NONE;
+}
+
+'''
+
+ACCESSORS = r'''
+typedef struct {
+  const char *partner;
+  const char *name;
+  const char *code;     /* As pydsm.describe gives it */
+  int size;
+  PyObject *(*read)(double timeout);
+  PyObject *(*write)(PyObject *value, int notify, double timeout);
+} typedAllocation;
+
+typedef struct {
+  PyObject_HEAD
+  const typedAllocation *allocation;
+} accessorObject;
+
+static const typedAllocation allocations[] = {
+%(table)s
+  {NULL, NULL, NULL, 0, NULL, NULL}
+};
+
+static const char *readKeyWords[] = {"timeout", NULL};
+static const char *writeKeyWords[] = {"value", "notify", "timeout", NULL};
+
+/*
+  Sorts positional and keyword arguments into values[], in the order of
+  keyWords.   Returns -1, with TypeError set, if they don't fit.
+*/
+static int unpack(const char *function, PyObject *const *args, Py_ssize_t nArgs, PyObject *keyWordNames,
+		  PyObject *const *keyWordValues, int nKeyWords, int nRequired, const char **keyWords, PyObject **values)
+{
+  int i, j, nParameters;
+  PyObject *keyWord;
+
+  for (nParameters = 0; keyWords[nParameters] != NULL; nParameters++)
+    values[nParameters] = NULL;
+  if (nArgs > nParameters) {
+    PyErr_Format(PyExc_TypeError, "%%s() takes at most %%d arguments (%%d given)", function, nParameters, (int)nArgs);
+    return -1;
+  }
+  for (j = 0; j < nArgs; j++)
+    values[j] = args[j];
+  for (i = 0; i < nKeyWords; i++) {
+    keyWord = PyTuple_GET_ITEM(keyWordNames, i);
+#if PY_MAJOR_VERSION >= 3
+    for (j = 0; (j < nParameters) && PyUnicode_CompareWithASCIIString(keyWord, keyWords[j]); j++);
+#else
+    for (j = 0; (j < nParameters) && (!PyString_Check(keyWord) || strcmp(PyString_AS_STRING(keyWord), keyWords[j])); j++);
+#endif
+    if ((j == nParameters) || (values[j] != NULL)) {
+      PyErr_Format(PyExc_TypeError, "%%s() got an unexpected or repeated keyword argument", function);
+      return -1;
+    }
+    values[j] = keyWordValues[i];
+  }
+  for (j = 0; j < nRequired; j++)
+    if (values[j] == NULL) {
+      PyErr_Format(PyExc_TypeError, "%%s() missing required argument '%%s'", function, keyWords[j]);
+      return -1;
+    }
+  return 0;
+}
+
+/* A timeout argument in seconds, 0 for none, or -1 with an exception set */
+static double timeoutArgument(PyObject *timeoutObject)
+{
+  double timeout;
+
+  if ((timeoutObject == NULL) || (timeoutObject == Py_None))
+    return 0.0;
+  timeout = PyFloat_AsDouble(timeoutObject);
+  if ((timeout == -1.0) && PyErr_Occurred())
+    return -1.0;
+  if (timeout <= 0.0) {
+    PyErr_SetString(PyExc_ValueError, "timeout must be positive");
+    return -1.0;
+  }
+  return timeout;
+}
+
+static PyObject *accessorCall(accessorObject *self, int writing, PyObject *const *args, Py_ssize_t nArgs,
+			      PyObject *keyWordNames, PyObject *const *keyWordValues, int nKeyWords)
+{
+  int notify = 0;
+  double timeout;
+  PyObject *values[3] = {NULL, NULL, NULL};
+
+  if ((nArgs == 0) && (nKeyWords == 0) && !writing)
+    return self->allocation->read(0.0); /* The common case */
+  if (unpack(writing ? "write" : "read", args, nArgs, keyWordNames, keyWordValues, nKeyWords, writing,
+	     writing ? writeKeyWords : readKeyWords, values) != 0)
+    return NULL;
+  if ((timeout = timeoutArgument(values[writing ? 2 : 0])) < 0.0)
+    return NULL;
+  if (!writing)
+    return self->allocation->read(timeout);
+  if ((values[1] != NULL) && ((notify = PyObject_IsTrue(values[1])) < 0))
+    return NULL;
+  return self->allocation->write(values[0], notify, timeout);
+}
+
+#ifdef TYPED_FASTCALL
+static PyObject *accessorRead(accessorObject *self, PyObject *const *args, Py_ssize_t nArgs, PyObject *kwNames)
+{
+  int nKeyWords = (kwNames == NULL) ? 0 : (int)PyTuple_GET_SIZE(kwNames);
+
+  return accessorCall(self, 0, args, nArgs, kwNames, args+nArgs, nKeyWords);
+}
+
+static PyObject *accessorWrite(accessorObject *self, PyObject *const *args, Py_ssize_t nArgs, PyObject *kwNames)
+{
+  int nKeyWords = (kwNames == NULL) ? 0 : (int)PyTuple_GET_SIZE(kwNames);
+
+  return accessorCall(self, 1, args, nArgs, kwNames, args+nArgs, nKeyWords);
+}
+
+#define ACCESSOR_FUNCTION(function) (PyCFunction)(void (*)(void))function
+#define ACCESSOR_FLAGS              (METH_FASTCALL | METH_KEYWORDS)
+#else
+static PyObject *accessorTupleCall(accessorObject *self, int writing, PyObject *args, PyObject *keyWords)
+{
+  int i, nKeyWords = 0;
+  Py_ssize_t position = 0;
+  PyObject *keyWordNames = NULL, *keyWordValues[3], *key, *value, *callResult;
+
+  if (keyWords != NULL) {
+    if ((nKeyWords = (int)PyDict_Size(keyWords)) > 3) {
+      PyErr_SetString(PyExc_TypeError, "too many keyword arguments");
+      return NULL;
+    }
+    if ((keyWordNames = PyTuple_New(nKeyWords)) == NULL)
+      return NULL;
+    for (i = 0; PyDict_Next(keyWords, &position, &key, &value); i++) {
+      Py_INCREF(key);
+      PyTuple_SET_ITEM(keyWordNames, i, key);
+      keyWordValues[i] = value;
+    }
+  }
+  callResult = accessorCall(self, writing, &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args), keyWordNames, keyWordValues,
+			    nKeyWords);
+  Py_XDECREF(keyWordNames);
+  return callResult;
+}
+
+static PyObject *accessorRead(accessorObject *self, PyObject *args, PyObject *keyWords)
+{
+  return accessorTupleCall(self, 0, args, keyWords);
+}
+
+static PyObject *accessorWrite(accessorObject *self, PyObject *args, PyObject *keyWords)
+{
+  return accessorTupleCall(self, 1, args, keyWords);
+}
+
+#define ACCESSOR_FUNCTION(function) (PyCFunction)function
+#define ACCESSOR_FLAGS              (METH_VARARGS | METH_KEYWORDS)
+#endif
+
+static PyObject *accessorRepr(accessorObject *self)
+{
+#if PY_MAJOR_VERSION >= 3
+  return PyUnicode_FromFormat("<pydsm_typed %%s %%s (%%s)>", self->allocation->partner, self->allocation->name,
+			      self->allocation->code);
+#else
+  return PyString_FromFormat("<pydsm_typed %%s %%s (%%s)>", self->allocation->partner, self->allocation->name,
+			     self->allocation->code);
+#endif
+}
+
+static PyObject *accessorDescription(accessorObject *self, void *closure)
+{
+  return Py_BuildValue("(sssi)", self->allocation->partner, self->allocation->name, self->allocation->code,
+		       self->allocation->size);
+}
+
+static PyMethodDef accessorMethods[] = {
+  {"read",  ACCESSOR_FUNCTION(accessorRead),  ACCESSOR_FLAGS, "Return (value, timestamp), giving up after timeout seconds"},
+  {"write", ACCESSOR_FUNCTION(accessorWrite), ACCESSOR_FLAGS, "Write value, with notify if asked, giving up after timeout seconds"},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef accessorGetSets[] = {
+  {"description", (getter)accessorDescription, NULL, "(partner, name, type code, size in bytes)", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject accessorType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "pydsm_typed.accessor",      /* tp_name */
+  sizeof(accessorObject),      /* tp_basicsize */
+};
+
+/* Makes a module per partner, holding an accessor per allocation, checking each against pydsm's decoding */
+static PyObject *makeModule(PyObject *m)
+{
+  int i;
+  char moduleName[DSM_NAME_LENGTH+16];
+  const typedAllocation *allocation;
+  pydsmDescription description;
+  accessorObject *accessor;
+  PyObject *pydsm, *partnerModule, *partnerModules;
+
+  if ((dsmAPI = pydsmImportCAPI()) == NULL)
+    return NULL;
+  if (dsmAPI->version < 2) {
+    PyErr_SetString(PyExc_ImportError, "pydsm_typed needs a newer pydsm");
+    return NULL;
+  }
+  if ((pydsm = PyImport_ImportModule("pydsm")) == NULL)
+    return NULL;
+  rangeError = PyObject_GetAttrString(pydsm, "DSM_RangeError");
+  Py_DECREF(pydsm);
+  if (rangeError == NULL)
+    return NULL;
+  accessorType.tp_flags = Py_TPFLAGS_DEFAULT;
+  accessorType.tp_doc = "Reads and writes one DSM variable";
+  accessorType.tp_methods = accessorMethods;
+  accessorType.tp_getset = accessorGetSets;
+  accessorType.tp_repr = (reprfunc)accessorRepr;
+  if (PyType_Ready(&accessorType) < 0)
+    return NULL;
+  if ((partnerModules = PyDict_New()) == NULL)
+    return NULL;
+  for (allocation = allocations; allocation->name != NULL; allocation++) {
+    if ((dsmAPI->describe(allocation->name, &description) != DSM_SUCCESS) || (description.size != allocation->size)) {
+      PyErr_Format(PyExc_ImportError, "pydsm_typed is out of date for %%s on %%s - regenerate it", allocation->name,
+		   allocation->partner);
+      Py_DECREF(partnerModules);
+      return NULL;
+    }
+    if ((partnerModule = PyDict_GetItemString(partnerModules, allocation->partner)) == NULL) {
+      /* Registered in sys.modules too, so "from pydsm_typed.hcn import ..." works */
+      sprintf(moduleName, "pydsm_typed.%%s", allocation->partner);
+      for (i = 12; moduleName[i]; i++)
+	if (!isalnum((unsigned char)moduleName[i]))
+	  moduleName[i] = '_';
+      if (((partnerModule = PyImport_AddModule(moduleName)) == NULL) ||
+	  (PyDict_SetItemString(partnerModules, allocation->partner, partnerModule) != 0)) {
+	Py_DECREF(partnerModules);
+	return NULL;
+      }
+      Py_INCREF(partnerModule); /* PyImport_AddModule's reference is borrowed, and AddObject steals one */
+      if (PyModule_AddObject(m, &moduleName[12], partnerModule) != 0) {
+	Py_DECREF(partnerModules);
+	return NULL;
+      }
+    }
+    if ((accessor = PyObject_New(accessorObject, &accessorType)) == NULL) {
+      Py_DECREF(partnerModules);
+      return NULL;
+    }
+    accessor->allocation = allocation;
+    if (PyModule_AddObject(partnerModule, allocation->name, (PyObject *)accessor) != 0) {
+      Py_DECREF(partnerModules);
+      return NULL;
+    }
+  }
+  Py_DECREF(partnerModules);
+  return m;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef typedModule = {
+  PyModuleDef_HEAD_INIT, "pydsm_typed", "Typed accessors for DSM allocations, generated by makeTyped.py", -1, NULL
+};
+
+PyMODINIT_FUNC PyInit_pydsm_typed(void)
+{
+  PyObject *m;
+
+  if ((m = PyModule_Create(&typedModule)) == NULL)
+    return NULL;
+  if (makeModule(m) == NULL) {
+    Py_DECREF(m);
+    return NULL;
+  }
+  return m;
+}
+#else
+PyMODINIT_FUNC initpydsm_typed(void)
+{
+  PyObject *m;
+
+  if ((m = Py_InitModule3("pydsm_typed", NULL, "Typed accessors for DSM allocations, generated by makeTyped.py")) != NULL)
+    makeModule(m);
+}
+#endif
+'''
+
+SCALAR = r'''
+/* %(partner)s %(name)s: %(ctype)s */
+static PyObject *read%(n)d(double timeout)
+{
+  %(ctype)s value;
+  time_t timestamp;
+  int status;
+
+  if ((status = dsmAPI->readExact("%(partner)s", "%(name)s", &value, %(size)d, &timestamp, timeout)) != DSM_SUCCESS)
+    return failed(status);
+  return result(%(convert)s, timestamp);
+}
+
+static PyObject *write%(n)d(PyObject *data, int notify, double timeout)
+{
+  %(ctype)s value;
+
+  if (%(store)s(data, (char *)&value, %(size)d) != 0)
+    return NULL;
+  return written(dsmAPI->writeExact("%(partner)s", "%(name)s", &value, %(size)d, notify, timeout));
+}
+'''
+
+ARRAY = r'''
+/* %(partner)s %(name)s: %(ctype)s%(dimensions)s */
+static const int shape%(n)d[] = {%(shape)s};
+
+static PyObject *read%(n)d(double timeout)
+{
+  char value[%(size)d];
+  const char *next = value;
+  time_t timestamp;
+  int status;
+
+  if ((status = dsmAPI->readExact("%(partner)s", "%(name)s", value, %(size)d, &timestamp, timeout)) != DSM_SUCCESS)
+    return failed(status);
+  return result(nest(&next, %(elementSize)d, %(load)s, shape%(n)d, %(nDim)d), timestamp);
+}
+
+static PyObject *write%(n)d(PyObject *data, int notify, double timeout)
+{
+  char value[%(size)d], *next = value;
+
+  memset(value, 0, %(size)d);
+  if (flatten(data, &next, %(elementSize)d, %(store)s, shape%(n)d, %(nDim)d) != 0)
+    return NULL;
+  return written(dsmAPI->writeExact("%(partner)s", "%(name)s", value, %(size)d, notify, timeout));
+}
+'''
+
+SCALAR_CONVERT = {'b': 'PyInt_FromLong((long)value)', 'h': 'PyInt_FromLong((long)value)',
+                  'i': 'PyInt_FromLong((long)value)', 'f': 'PyFloat_FromDouble((double)value)',
+                  'd': 'PyFloat_FromDouble(value)'}
+
+def catalogue(patterns):
+  """Returns [(partner, name, code, shape, size)] for the allocations matching any pattern"""
+  chosen = []
+  allocations = pydsm.allocations()
+  for partner in sorted(allocations):
+    for name in sorted(allocations[partner]):
+      if (':' in name) or name.upper().endswith('X'):
+        continue  # Structures, and their members
+      if patterns and not [p for p in patterns if fnmatch.fnmatchcase('%s.%s' % (partner, name), p)]:
+        continue
+      try:
+        (code, shape, size) = pydsm.describe(name)
+      except Exception as error:
+        print('Skipping %s on %s: %s' % (name, partner, error), file=sys.stderr)
+        continue
+      if not re.match(r'^[A-Za-z_][A-Za-z0-9_]*$', name):
+        print('Skipping %s on %s: not a Python identifier' % (name, partner), file=sys.stderr)
+        continue
+      chosen.append((partner, name, code, tuple(shape), size))
+  return chosen
+
+def accessor(n, partner, name, code, shape, size):
+  fields = {'n': n, 'partner': partner, 'name': name, 'size': size, 'shape': ', '.join(str(d) for d in shape),
+            'nDim': len(shape), 'dimensions': ''.join('[%d]' % (d) for d in shape)}
+  if code.startswith('S'):
+    fields.update(ctype='char', elementSize=int(code[1:]), load='fromString', store='toString')
+    fields['dimensions'] += '[%d]' % (fields['elementSize'])
+    return ARRAY % fields
+  (fields['ctype'], fields['load'], fields['store']) = TYPES[code]
+  fields['elementSize'] = size//elements(shape)
+  if not shape:
+    fields['convert'] = SCALAR_CONVERT[code]
+    return SCALAR % fields
+  return ARRAY % fields
+
+def elements(shape):
+  product = 1
+  for d in shape:
+    product *= d
+  return product
+
+def generate(chosen):
+  pieces = [PREAMBLE % {'date': time.strftime('%Y-%m-%d %H:%M')}]
+  table = []
+  for (n, (partner, name, code, shape, size)) in enumerate(chosen):
+    pieces.append(accessor(n, partner, name, code, shape, size))
+    table.append('  {"%s", "%s", "%s", %d, read%d, write%d},' % (partner, name, code, size, n, n))
+  pieces.append(ACCESSORS % {'table': '\n'.join(table)})
+  return ''.join(pieces)
+
+if __name__ == '__main__':
+  arguments = sys.argv[1:]
+  output = 'pydsm_typed.c'
+  if arguments[:1] == ['-o']:
+    output = arguments[1]
+    arguments = arguments[2:]
+  pydsm.open(0)
+  chosen = catalogue(arguments)
+  if not chosen:
+    sys.exit('makeTyped.py: no allocations match %s' % (' '.join(arguments) or 'anything'))
+  with open(output, 'w') as out:
+    out.write(generate(chosen))
+  print('Wrote %d accessors to %s' % (len(chosen), output))
@@ -1,29 +1,140 @@
-#include "/usr/local/anaconda/include/python2.7/Python.h"
+#define PY_SSIZE_T_CLEAN
+#include "Python.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
 #include <string.h>
-#include "/global/dsm/dsm.h"
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "dsm.h"
+#define PYDSM_MODULE
+#include "pydsm_capi.h"
 
 #define TRUE (1)
 #define FALSE (0)
 
 #define dprintf if (debugMessagesOn) printf
 
+/*
+  Python 2 and 3.   The code is written against the Python 2 API, and
+  under Python 3 these map ints onto longs and strings onto str, with DSM
+  strings decoded as UTF-8 (undecodable bytes survive as surrogates).
+  Raw blocks (history samples, snapshots) are bytes under both.   From
+  3.7 the hot entry points take their arguments with METH_FASTCALL.
+*/
+#if PY_MAJOR_VERSION >= 3
+#define PyInt_FromLong                   PyLong_FromLong
+#define PyInt_AsLong                     PyLong_AsLong
+#define PyInt_AsSsize_t                  PyLong_AsSsize_t
+#define PyString_FromString(s)           PyUnicode_DecodeUTF8((s), strlen(s), "surrogateescape")
+#define PyString_FromStringAndSize(s, n) PyUnicode_DecodeUTF8((s), (n), "surrogateescape")
+#define PyString_InternFromString        PyUnicode_InternFromString
+#define SLICE_OBJECT(o)                  (o)
+#if PY_VERSION_HEX >= 0x03070000
+#define PYDSM_FASTCALL
+#endif
+#else
+#define SLICE_OBJECT(o)                  ((PySliceObject *)(o))
+#endif
+
 int dSMOpen         = FALSE; /* TRUE iff dsm is open */
 int debugMessagesOn = FALSE; /* Print debugging text messages */
 
-#define DSM_BYTE      (1)
-#define DSM_SHORT     (2)
-#define DSM_LONG      (3)
-#define DSM_FLOAT     (4)
-#define DSM_DOUBLE    (5)
-#define DSM_STRING    (6)
-#define DSM_STRUCTURE (7)
+#define DECODE_ERROR  (100) /* The DSM_* types and DSM_TIMED_OUT are in pydsm_capi.h */
+
+/*
+  Every block this module allocates goes through these hooks, so
+  memory_stats() can report how much is live and the high-water mark, and
+  a leak shows up as a number which only grows.   Each block carries a
+  header holding its size.   They use plain malloc underneath, so they may
+  be called with or without the GIL.
+*/
+typedef union {
+  size_t size;
+  long double align; /* Keeps the caller's block aligned for anything */
+} allocationHeader;
+
+static volatile long liveBytes = 0;
+static volatile long peakBytes = 0;
+static volatile long liveBlocks = 0;
+static volatile long totalAllocations = 0;
+
+void accountAllocation(long size, long blocks)
+{
+  long live, peak;
+
+  live = __sync_add_and_fetch(&liveBytes, size);
+  __sync_add_and_fetch(&liveBlocks, blocks);
+  if (blocks > 0)
+    __sync_add_and_fetch(&totalAllocations, blocks);
+  while (live > (peak = peakBytes))
+    if (__sync_bool_compare_and_swap(&peakBytes, peak, live))
+      break;
+}
+
+void *pydsmMalloc(size_t size)
+{
+  allocationHeader *header;
+
+  if ((header = (allocationHeader *)malloc(sizeof(allocationHeader) + size)) == NULL)
+    return NULL;
+  header->size = size;
+  accountAllocation((long)size, 1);
+  return (void *)(header+1);
+}
+
+void *pydsmCalloc(size_t count, size_t size)
+{
+  void *ptr;
+
+  if ((ptr = pydsmMalloc(count*size)) != NULL)
+    bzero(ptr, count*size);
+  return ptr;
+}
+
+void pydsmFree(void *ptr)
+{
+  allocationHeader *header;
+
+  if (ptr == NULL)
+    return;
+  header = ((allocationHeader *)ptr) - 1;
+  accountAllocation(-(long)header->size, -1);
+  free(header);
+}
+
+void *pydsmRealloc(void *ptr, size_t size)
+{
+  size_t oldSize;
+  allocationHeader *header;
 
-#define DECODE_ERROR (100)
+  if (ptr == NULL)
+    return pydsmMalloc(size);
+  header = ((allocationHeader *)ptr) - 1;
+  oldSize = header->size;
+  if ((header = (allocationHeader *)realloc(header, sizeof(allocationHeader) + size)) == NULL)
+    return NULL;
+  header->size = size;
+  accountAllocation((long)size - (long)oldSize, 0);
+  return (void *)(header+1);
+}
+
+char *pydsmStrdup(const char *string)
+{
+  char *copy;
+
+  if ((copy = (char *)pydsmMalloc(strlen(string)+1)) != NULL)
+    strcpy(copy, string);
+  return copy;
+}
 
 static PyObject *dSMNoShare;
 static PyObject *dSMNoResource;
@@ -37,8 +148,25 @@ static PyObject *dSMRangeError;
 static PyObject *dSMDecodeError;
 static PyObject *dSMWrongType;
 static PyObject *dSMNothingMonitored;
+static PyObject *dSMTimeout;
 static PyObject *dSMCatchAll;
 
+/* The C string in a str (or bytes) object, or NULL with an exception set.   It belongs to the object */
+char *pyText(PyObject *object)
+{
+#if PY_MAJOR_VERSION >= 3
+  if (PyBytes_Check(object))
+    return PyBytes_AS_STRING(object);
+  if (!PyUnicode_Check(object)) {
+    PyErr_Format(PyExc_TypeError, "expected a string, not %.100s", Py_TYPE(object)->tp_name);
+    return NULL;
+  }
+  return (char *)PyUnicode_AsUTF8(object);
+#else
+  return PyString_AsString(object);
+#endif
+}
+
 void raiseDSMError(int status, char *message)
 {
   dprintf("%s\n", message);
@@ -61,6 +189,9 @@ void raiseDSMError(int status, char *message)
   case DSM_NO_RESOURCE:
     PyErr_SetString(dSMNoResource, "DSM error: Can't open shared memory");
     break;
+  case DSM_TIMED_OUT:
+    PyErr_SetString(dSMTimeout, "DSM error: call timed out");
+    break;
   default:
     PyErr_SetString(dSMCatchAll, "DSM error: catchall error");
     dsm_error_message(status, "Unhandled DSM error");
@@ -117,9 +248,9 @@ int decodeObject(char *name, int *type, int *nDim, int **dimensions)
 	return DSM_ERROR;
       }
     *nDim = 1;
-    *dimensions = PyMem_Malloc(sizeof(int));
+    *dimensions = pydsmMalloc(sizeof(int));
     if (*dimensions == NULL) {
-      fprintf(stderr, "PyMem_Malloc failure for dimensions of \"%s\"\n", name);
+      fprintf(stderr, "pydsmMalloc failure for dimensions of \"%s\"\n", name);
       PyErr_NoMemory();
       return DSM_ERROR;
     }
@@ -144,9 +275,9 @@ int decodeObject(char *name, int *type, int *nDim, int **dimensions)
 	  temp[endPtr-ptr-2] = (char)0;
 	  size = atoi(temp);
 	  *nDim += 1;
-	  *dimensions = PyMem_Realloc(*dimensions, (*nDim)*sizeof(int));
+	  *dimensions = pydsmRealloc(*dimensions, (*nDim)*sizeof(int));
 	  if (*dimensions == NULL) {
-	    fprintf(stderr, "PyMem_Realloc failure(%d) for dimensions of \"%s\"\n", *nDim, name);
+	    fprintf(stderr, "pydsmRealloc failure(%d) for dimensions of \"%s\"\n", *nDim, name);
 	    PyErr_NoMemory();
 	    return DSM_ERROR;
 	  }
@@ -163,6 +294,169 @@ int decodeObject(char *name, int *type, int *nDim, int **dimensions)
   return DSM_SUCCESS;
 }
 
+/*
+  Decoded names are cached, since the type and shape of a variable follow
+  from its name alone.   For strings, elementSize is the string length and
+  dimensions holds only the array dimensions (if any).
+*/
+#define DESCRIPTOR_HASH_SIZE (1024)
+
+typedef struct dsmDescriptor {
+  char *name;
+  int type;
+  int nDim;
+  int *dimensions;
+  int elementSize;
+  int nElements;
+  int size;
+  struct dsmDescriptor *next;
+} dsmDescriptor;
+
+static dsmDescriptor *descriptors[DESCRIPTOR_HASH_SIZE];
+
+unsigned int stringHash(char *string)
+{
+  unsigned int hash = 2166136261U; /* FNV-1a */
+
+  while (*string)
+    hash = (hash ^ (unsigned char)*string++) * 16777619U;
+  return hash;
+}
+
+/*
+  Partner, variable and member names handed back in results.   Each one is
+  made and interned once, and after that the same object is handed back,
+  rather than a new string being built for every event or structure
+  member.   Must be called with the GIL held.
+*/
+#define INTERNED_HASH_SIZE (1024)
+
+typedef struct internedEntry {
+  PyObject *object;
+  struct internedEntry *nextInBucket;
+  char text[1];      /* Really as long as the name */
+} internedEntry;
+
+static internedEntry *internedNames[INTERNED_HASH_SIZE];
+
+/* Returns a new reference */
+PyObject *internedName(char *text)
+{
+  unsigned int bucket;
+  internedEntry *entry;
+  PyObject *object;
+
+  bucket = stringHash(text) % INTERNED_HASH_SIZE;
+  for (entry = internedNames[bucket]; entry != NULL; entry = entry->nextInBucket)
+    if (!strcmp(entry->text, text)) {
+      Py_INCREF(entry->object);
+      return entry->object;
+    }
+  if ((object = PyString_InternFromString(text)) == NULL)
+    return NULL;
+  if ((entry = (internedEntry *)pydsmMalloc(sizeof(internedEntry) + strlen(text))) != NULL) {
+    strcpy(entry->text, text);
+    Py_INCREF(object);
+    entry->object = object;
+    entry->nextInBucket = internedNames[bucket];
+    internedNames[bucket] = entry;
+  }
+  return object;
+}
+
+/* Returns the cached description of "name", or NULL (with a Python exception set) */
+dsmDescriptor *lookupDescriptor(char *name)
+{
+  int i, type, nDim;
+  int *dimensions = NULL;
+  unsigned int bucket;
+  dsmDescriptor *descriptor;
+
+  bucket = stringHash(name) % DESCRIPTOR_HASH_SIZE;
+  for (descriptor = descriptors[bucket]; descriptor != NULL; descriptor = descriptor->next)
+    if (!strcmp(descriptor->name, name))
+      return descriptor;
+  if (decodeObject(name, &type, &nDim, &dimensions) != DSM_SUCCESS) {
+    if (dimensions != NULL)
+      pydsmFree(dimensions);
+    return NULL;
+  }
+  descriptor = (dsmDescriptor *)pydsmMalloc(sizeof(dsmDescriptor));
+  if (descriptor == NULL) {
+    if (dimensions != NULL)
+      pydsmFree(dimensions);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  descriptor->name = pydsmMalloc(strlen(name)+1);
+  if (descriptor->name == NULL) {
+    if (dimensions != NULL)
+      pydsmFree(dimensions);
+    pydsmFree(descriptor);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  strcpy(descriptor->name, name);
+  descriptor->type = type;
+  switch (type) {
+  case DSM_BYTE:
+    descriptor->elementSize = 1; break;
+  case DSM_SHORT:
+    descriptor->elementSize = 2; break;
+  case DSM_LONG:
+  case DSM_FLOAT:
+    descriptor->elementSize = 4; break;
+  case DSM_DOUBLE:
+    descriptor->elementSize = 8; break;
+  case DSM_STRING:
+    descriptor->elementSize = dimensions[0];
+    for (i = 0; i < nDim-1; i++)
+      dimensions[i] = dimensions[i+1];
+    nDim--;
+    break;
+  default:
+    descriptor->elementSize = 0; /* Structures */
+  }
+  descriptor->nDim = nDim;
+  descriptor->dimensions = dimensions;
+  descriptor->nElements = 1;
+  for (i = 0; i < nDim; i++)
+    descriptor->nElements *= dimensions[i];
+  descriptor->size = descriptor->elementSize * descriptor->nElements;
+  descriptor->next = descriptors[bucket];
+  descriptors[bucket] = descriptor;
+  return descriptor;
+}
+
+/* Returns the number of bytes needed to hold the (non-structure) variable "name", or -1 on error */
+int objectSize(char *name)
+{
+  dsmDescriptor *descriptor;
+
+  if ((descriptor = lookupDescriptor(name)) == NULL)
+    return -1;
+  if (descriptor->type == DSM_STRUCTURE) {
+    PyErr_SetString(dSMNotImplemented, "DSM error: structures do not have a fixed size");
+    return -1;
+  }
+  return descriptor->size;
+}
+
+void getAllocationList(int *nhosts, struct dsm_allocation_list **alp)
+{
+  static int firstCall = TRUE;
+  static int savedNHosts;
+  static struct dsm_allocation_list *savedAlp;
+
+  if (firstCall) {
+    dprintf("Reading DSM allocation list\n");
+    dsm_get_allocation_list(&savedNHosts, &savedAlp);
+    firstCall = FALSE;
+  }
+  *nhosts = savedNHosts;
+  *alp = savedAlp;
+}
+
 int open_dsm(void)
 {
   int status = DSM_SUCCESS;
@@ -232,510 +526,5184 @@ PyObject *buildTuples(PyObject **tuples, int dim, int nDim, int *dimensions, int
   return tuples[localCounter];
 }
 
-void close_dsm(void)
+/*
+  Host-local snapshot region.   One process (the writer) maps a file under
+  /dev/shm and publishes the latest raw value and timestamp of selected
+  variables into fixed-size slots, each protected by a sequence lock.   Any
+  other process can map the same file read-only, and pydsm.read will then
+  serve those variables from it, without an RPC, as long as they are no
+  older than max_age seconds.   Readers never block the writer: a reader
+  which sees the sequence number change under it just retries, and gives up
+  and calls dsm_read after a few attempts.
+*/
+#define SHM_MAGIC        (0x4d534450) /* "PDSM" */
+#define SHM_VERSION      (1)
+#define SHM_DEFAULT_PATH "/dev/shm/pydsm_snapshot"
+#define SHM_MAX_RETRIES  (16)
+
+typedef struct {
+  unsigned int magic;
+  unsigned int version;
+  int nSlots;
+  int slotSize;
+  int nameLength;
+  int slotStride;
+  pid_t writerPid;
+} shmHeader;
+
+typedef struct {
+  volatile unsigned int sequence; /* Odd while the writer is updating the slot */
+  volatile int inUse;
+  int size;
+  char partner[DSM_NAME_LENGTH];
+  char name[DSM_NAME_LENGTH];
+  time_t timestamp;
+  double updated; /* Wall clock time of the last update */
+} shmSlot;
+
+static char *shmRegion = NULL;
+static size_t shmRegionSize = 0;
+static int shmWriter = FALSE;
+static double shmMaxAge = 1.0;
+
+double wallClock(void)
 {
-  if (dSMOpen) {
-    dsm_close();
-    dSMOpen = FALSE;
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (double)now.tv_sec + 1.0e-6*(double)now.tv_usec;
+}
+
+unsigned int nameHash(char *partner, char *name)
+{
+  unsigned int hash = 2166136261U; /* FNV-1a */
+
+  while (*partner)
+    hash = (hash ^ (unsigned char)*partner++) * 16777619U;
+  hash = (hash ^ (unsigned char)'/') * 16777619U;
+  while (*name)
+    hash = (hash ^ (unsigned char)*name++) * 16777619U;
+  return hash;
+}
+
+shmSlot *shmSlotAt(int i)
+{
+  shmHeader *header = (shmHeader *)shmRegion;
+
+  return (shmSlot *)&shmRegion[sizeof(shmHeader) + (size_t)i*header->slotStride];
+}
+
+/* Finds the slot for partner/name, optionally claiming a free one (only the writer may do that) */
+shmSlot *shmFindSlot(char *partner, char *name, int claim)
+{
+  int i, index;
+  shmHeader *header = (shmHeader *)shmRegion;
+  shmSlot *slot;
+
+  index = nameHash(partner, name) % header->nSlots;
+  for (i = 0; i < header->nSlots; i++) {
+    slot = shmSlotAt((index + i) % header->nSlots);
+    if (!slot->inUse) {
+      if (!claim)
+	return NULL;
+      strcpy(slot->partner, partner);
+      strcpy(slot->name, name);
+      slot->size = 0;
+      slot->updated = 0.0;
+      __sync_synchronize();
+      slot->inUse = TRUE;
+      return slot;
+    }
+    if (!strcmp(slot->name, name) && !strcmp(slot->partner, partner))
+      return slot;
   }
+  return NULL;
 }
 
-static PyObject *pydsm_close(PyObject *self)
+/* Called by the writer process, with or without the GIL */
+void shmPublish(char *partner, char *name, char *buf, int size, time_t timestamp)
 {
-  int status;
+  shmSlot *slot;
 
-  if (dSMOpen) {
-    dprintf("Closing dsm\n");
-    close_dsm();
-  } else
-    status = DSM_SUCCESS;
-  return Py_BuildValue("i", status);
+  if ((shmRegion == NULL) || !shmWriter)
+    return;
+  slot = shmFindSlot(partner, name, FALSE);
+  if ((slot == NULL) || (size > ((shmHeader *)shmRegion)->slotSize))
+    return;
+  slot->sequence++;
+  __sync_synchronize();
+  bcopy(buf, (char *)(slot+1), size);
+  slot->size = size;
+  slot->timestamp = timestamp;
+  slot->updated = wallClock();
+  __sync_synchronize();
+  slot->sequence++;
 }
 
-static PyObject *pydsm_clear_monitor(PyObject *self)
+/* Returns TRUE, with buf and timestamp filled in, if the region holds a fresh copy of the variable */
+int shmLookup(char *partner, char *name, char *buf, int size, time_t *timestamp)
 {
-  int status;
+  int try;
+  unsigned int before;
+  double updated;
+  shmSlot *slot;
 
-  dprintf("Clearing all monitored variables\n");
-  status = open_dsm();
-  if (status == DSM_SUCCESS) {
-    status = dsm_clear_monitor();
-    if (status != DSM_SUCCESS) {
-      raiseDSMError(status, "pydsm_clear_monitor: dsm_clear_monitor");
-      return NULL;
+  if ((shmRegion == NULL) || shmWriter)
+    return FALSE;
+  if ((slot = shmFindSlot(partner, name, FALSE)) == NULL)
+    return FALSE;
+  for (try = 0; try < SHM_MAX_RETRIES; try++) {
+    before = slot->sequence;
+    __sync_synchronize();
+    if (before & 1)
+      continue;
+    if (slot->size != size)
+      return FALSE;
+    bcopy((char *)(slot+1), buf, size);
+    *timestamp = slot->timestamp;
+    updated = slot->updated;
+    __sync_synchronize();
+    if (slot->sequence == before)
+      return ((wallClock() - updated) <= shmMaxAge);
+  }
+  dprintf("Gave up on snapshot slot for \"%s\" on \"%s\"\n", name, partner);
+  return FALSE;
+}
+
+void shmUnmap(void)
+{
+  if (shmRegion != NULL) {
+    munmap(shmRegion, shmRegionSize);
+    shmRegion = NULL;
+  }
+}
+
+int shmMap(char *path, int writer, int nSlots, int slotSize)
+{
+  int fd;
+  int stride = (sizeof(shmSlot) + slotSize + 63) & ~63; /* Keep each slot cache-line aligned */
+  shmHeader header, *existing;
+  struct stat info;
+
+  shmUnmap();
+  fd = open(path, writer ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+  if (fd < 0) {
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    return DSM_ERROR;
+  }
+  if (writer) {
+    shmRegionSize = sizeof(shmHeader) + (size_t)nSlots*stride;
+    if (ftruncate(fd, shmRegionSize) != 0) {
+      PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+      close(fd);
+      return DSM_ERROR;
     }
   } else {
-    raiseDSMError(status, "pydsm_clear_monitor: dsm_open");
-    return NULL;
+    if ((fstat(fd, &info) != 0) || (info.st_size < sizeof(shmHeader)) ||
+	(read(fd, &header, sizeof(header)) != sizeof(header)) || (header.magic != SHM_MAGIC) ||
+	(header.version != SHM_VERSION) || (header.nameLength != DSM_NAME_LENGTH)) {
+      close(fd);
+      PyErr_SetString(dSMNoResource, "DSM error: not a pydsm snapshot region");
+      return DSM_ERROR;
+    }
+    shmRegionSize = info.st_size;
   }
-  return Py_BuildValue("i", status);
+  shmRegion = mmap(NULL, shmRegionSize, writer ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shmRegion == MAP_FAILED) {
+    shmRegion = NULL;
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    return DSM_ERROR;
+  }
+  existing = (shmHeader *)shmRegion;
+  if (writer) {
+    /* A restarted writer keeps the old contents if the layout hasn't changed */
+    if ((existing->magic != SHM_MAGIC) || (existing->version != SHM_VERSION) || (existing->nSlots != nSlots) ||
+	(existing->slotSize != slotSize) || (existing->nameLength != DSM_NAME_LENGTH) || (existing->slotStride != stride)) {
+      bzero(shmRegion, shmRegionSize);
+      existing->version = SHM_VERSION;
+      existing->nSlots = nSlots;
+      existing->slotSize = slotSize;
+      existing->nameLength = DSM_NAME_LENGTH;
+      existing->slotStride = stride;
+      __sync_synchronize();
+      existing->magic = SHM_MAGIC;
+    }
+    existing->writerPid = getpid();
+  } else if (shmRegionSize < sizeof(shmHeader) + (size_t)existing->nSlots*existing->slotStride) {
+    shmUnmap();
+    PyErr_SetString(dSMNoResource, "DSM error: truncated pydsm snapshot region");
+    return DSM_ERROR;
+  }
+  shmWriter = writer;
+  return DSM_SUCCESS;
+}
+
+/*
+  Per-variable history.   history() gives a variable a ring buffer holding
+  its last depth raw samples, which is filled from monitor events and from
+  reads which went to the partner (not those served from the subscription
+  table or snapshot region, which would only repeat a sample).   Each is
+  stamped with the wallClock() time it arrived, as the DSM timestamps are
+  only whole seconds.   history_get() hands the samples back as one
+  contiguous string in time order, plus the numpy/array type code and
+  shape needed to view it, e.g.
+    samples, times, code, shape = pydsm.history_get('hcn', 'DSM_POWER_V128_F')
+    power = numpy.frombuffer(samples, dtype=code).reshape(shape)
+*/
+#define HISTORY_HASH_SIZE (256)
+
+typedef struct historyBuffer {
+  char partner[DSM_NAME_LENGTH];
+  char name[DSM_NAME_LENGTH];
+  int size;   /* Bytes per sample */
+  int depth;
+  int count;  /* Number of valid samples */
+  int next;   /* Where the next sample goes */
+  char *samples;
+  double *times;
+  struct historyBuffer *nextInBucket;
+} historyBuffer;
+
+static pthread_mutex_t historyMutex = PTHREAD_MUTEX_INITIALIZER; /* Protects the history table */
+static historyBuffer *histories[HISTORY_HASH_SIZE];
+static int nHistories = 0;
+
+/* Must be called with historyMutex held */
+historyBuffer *findHistory(char *partner, char *name)
+{
+  historyBuffer *history;
+
+  for (history = histories[nameHash(partner, name) % HISTORY_HASH_SIZE]; history != NULL; history = history->nextInBucket)
+    if (!strcmp(history->name, name) && !strcmp(history->partner, partner))
+      return history;
+  return NULL;
 }
 
-void fixNames(char *partner, char *name)
+/* Called for every monitor event and read, with or without the GIL */
+void historyRecord(char *partner, char *name, char *buf, int size, double timestamp)
 {
-  int i;
+  historyBuffer *history;
 
-  /* Convert computer name (partner) to lower case, and variable name (name) to uppercase */
-  for (i = 0; i < strlen(name); i++)
-    name[i] = toupper(name[i]);
-  if (name != NULL)
-    for (i = 0; i < strlen(partner); i++)
-      partner[i] = tolower(partner[i]);
+  if (nHistories == 0)
+    return;
+  pthread_mutex_lock(&historyMutex);
+  history = findHistory(partner, name);
+  if ((history != NULL) && (history->size == size)) {
+    bcopy(buf, &history->samples[(size_t)history->next*size], size);
+    history->times[history->next] = timestamp;
+    history->next = (history->next + 1) % history->depth;
+    if (history->count < history->depth)
+      history->count++;
+  }
+  pthread_mutex_unlock(&historyMutex);
 }
 
-static int monitorMaxSize = 0; /* This variable holds the size of the largest variable monitored */
+void freeHistory(historyBuffer *history)
+{
+  pydsmFree(history->samples);
+  pydsmFree(history->times);
+  pydsmFree(history);
+}
 
-static PyObject *pydsm_monitor(PyObject *self, PyObject *args)
+/* Creates, resizes (discarding old samples) or, with depth 0, removes a history buffer */
+int setHistory(char *partner, char *name, int size, int depth)
 {
-  int status, type, nDim, fullSize;
-  int elementSize = 0;
-  int *dimensions = NULL;
-  char *partner, *name;
-  
-  status = open_dsm();
-  if (status == DSM_SUCCESS) {
-    if (!PyArg_ParseTuple(args, "ss", &partner, &name))
-      return NULL;
-    fixNames(partner, name);
-    dprintf("pydsm_monitor: request for \"%s\" on \"%s\"\n", name, partner);
-    if (toupper(name[strlen(name)-1]) == 'X') {
-      PyErr_SetString(dSMNotImplemented, "DSM error: Monitoring structures not yet implemented in the pydsm module");
-      return NULL;
+  unsigned int bucket;
+  historyBuffer *history = NULL, **link;
+
+  if (depth > 0) {
+    history = (historyBuffer *)pydsmCalloc(1, sizeof(historyBuffer));
+    if (history != NULL) {
+      history->samples = (char *)pydsmMalloc((size_t)depth*size);
+      history->times = (double *)pydsmMalloc(depth*sizeof(double));
     }
-    if ((status = decodeObject(name, &type, &nDim, &dimensions)) != DSM_SUCCESS) {
-      fprintf(stderr, "Error %d returned by decodeObject (%s)\n", status, name);
-      if (dimensions != NULL)
-	PyMem_Free(dimensions);
-      return NULL;
-    } else {
-      int i;
+    if ((history == NULL) || (history->samples == NULL) || (history->times == NULL)) {
+      if (history != NULL)
+	freeHistory(history);
+      fprintf(stderr, "malloc failure for history of \"%s\" (%d samples of %d bytes)\n", name, depth, size);
+      PyErr_NoMemory();
+      return DSM_ERROR;
+    }
+    strcpy(history->partner, partner);
+    strcpy(history->name, name);
+    history->size = size;
+    history->depth = depth;
+  }
+  bucket = nameHash(partner, name) % HISTORY_HASH_SIZE;
+  pthread_mutex_lock(&historyMutex);
+  for (link = &histories[bucket]; *link != NULL; link = &(*link)->nextInBucket)
+    if (!strcmp((*link)->name, name) && !strcmp((*link)->partner, partner)) {
+      historyBuffer *old = *link;
 
-      switch (type) {
-      case DSM_BYTE:
-	elementSize = 1; break;
-      case DSM_SHORT:
-	elementSize = 2; break;
-      case DSM_LONG:
-      case DSM_FLOAT:
-	elementSize = 4; break;
-      case DSM_DOUBLE:
-	elementSize = 8; break;
-      case DSM_STRING:
-	elementSize = dimensions[nDim-1];
-	nDim--; break;
-      default:
-	/* This code should not be reached, because decodeObject will trap error */
-	fprintf(stderr, "pydsm.monitor: Unknown type (%d)\n", type);
-	return NULL;
-      }
-      fullSize = elementSize;
-      for (i = 0; i < nDim; i++)
-	fullSize *= dimensions[i];
-      dprintf("Element size %d, full size = %d\n", elementSize, fullSize);
-      if (fullSize > monitorMaxSize) {
-	dprintf("Changing monitorMaxSize from %d to %d\n", monitorMaxSize, fullSize);
-	monitorMaxSize = fullSize;
-      }
-      PyMem_Free(dimensions);
-      status = dsm_monitor(partner, name);
-      if (status != DSM_SUCCESS) {
-	raiseDSMError(status, "dsm_monitor()");
-	return NULL;
-      }
+      *link = old->nextInBucket;
+      freeHistory(old);
+      nHistories--;
+      break;
     }
+  if (history != NULL) {
+    history->nextInBucket = histories[bucket];
+    histories[bucket] = history;
+    nHistories++;
   }
-  Py_RETURN_NONE;
+  pthread_mutex_unlock(&historyMutex);
+  return DSM_SUCCESS;
 }
 
-static PyObject *pydsm_no_monitor(PyObject *self, PyObject *args)
+/*
+  Subscriptions.   subscribe() monitors a variable just to keep its latest
+  value and timestamp in this table, updated by the reader thread from
+  monitor events, and readRaw serves reads of it from here instead of
+  calling dsm_read.   The first read after subscribing, or after a write
+  from this process, still goes to dsm_read, and fills the table unless a
+  newer monitor event beat it there.   Events for variables which are only
+  subscribed to, not monitored, are not passed on to read_wait.   This is
+  only coherent for variables which are always written with notify.
+  The poll scheduler keeps the values it reads in this table too, so an
+  entry is held by subscribe(), poll_every() or both.
+*/
+#define SUBSCRIPTION_HASH_SIZE (256)
+#define CACHE_SUBSCRIBED       (1)
+#define CACHE_POLLED           (2)
+
+typedef struct subscription {
+  char partner[DSM_NAME_LENGTH];
+  char name[DSM_NAME_LENGTH];
+  int size;
+  int holders;                 /* CACHE_SUBSCRIBED and/or CACHE_POLLED */
+  int valid;                   /* data holds the latest value */
+  unsigned long generation;    /* Bumped by every update or invalidation */
+  time_t timestamp;
+  char *data;
+  long served;                 /* Reads answered from the table */
+  long fetched;                /* Reads which had to call dsm_read */
+  long updates;                /* Monitor events which refreshed the table */
+  struct subscription *nextInBucket;
+} subscription;
+
+static pthread_mutex_t subscriptionMutex = PTHREAD_MUTEX_INITIALIZER; /* Protects the subscription table */
+static subscription *subscriptions[SUBSCRIPTION_HASH_SIZE];
+static int nSubscriptions = 0;
+
+/* Must be called with subscriptionMutex held */
+subscription *findSubscription(char *partner, char *name)
 {
-  int status, type, nDim;
-  int *dimensions = NULL;
-  char *partner, *name;
-  
-  status = open_dsm();
-  if (status == DSM_SUCCESS) {
-    if (!PyArg_ParseTuple(args, "ss", &partner, &name))
-      return NULL;
-    fixNames(partner, name);
-    dprintf("pydsm_no_monitor: request for \"%s\" on \"%s\"\n", name, partner);
-    if (toupper(name[strlen(name)-1]) == 'X') {
-      PyErr_SetString(dSMNotImplemented, "DSM error: Monitoring structures not yet implemented in the pydsm module");
-      return NULL;
-    }
-    if ((status = decodeObject(name, &type, &nDim, &dimensions)) != DSM_SUCCESS) { /* Just doing this for error checking in the name */
-      fprintf(stderr, "Error %d returned by decodeObject (%s)\n", status, name);
-      if (dimensions != NULL)
-	PyMem_Free(dimensions);
-      return NULL;
+  subscription *entry;
+
+  for (entry = subscriptions[nameHash(partner, name) % SUBSCRIPTION_HASH_SIZE]; entry != NULL; entry = entry->nextInBucket)
+    if (!strcmp(entry->name, name) && !strcmp(entry->partner, partner))
+      return entry;
+  return NULL;
+}
+
+/*
+  Returns 1 and copies the value if it can be served from the table, 0 if the
+  variable is subscribed but must be fetched (with *generation to hand back
+  to cacheStore), and -1 if it isn't subscribed.   Safe without the GIL.
+*/
+int cacheLookup(char *partner, char *name, char *buf, int size, time_t *timestamp, unsigned long *generation)
+{
+  int result = -1;
+  subscription *entry;
+
+  if (nSubscriptions == 0)
+    return -1;
+  pthread_mutex_lock(&subscriptionMutex);
+  if (((entry = findSubscription(partner, name)) != NULL) && (entry->size == size)) {
+    if (entry->valid) {
+      bcopy(entry->data, buf, size);
+      *timestamp = entry->timestamp;
+      entry->served++;
+      result = 1;
     } else {
-      PyMem_Free(dimensions);
-      status = dsm_no_monitor(partner, name);
-      if (status != DSM_SUCCESS) {
-	raiseDSMError(status, "dsm_no_monitor()");
-	return NULL;
-      }
+      *generation = entry->generation;
+      entry->fetched++;
+      result = 0;
     }
   }
-  Py_RETURN_NONE;
+  pthread_mutex_unlock(&subscriptionMutex);
+  return result;
 }
 
-PyObject *makePyObject(char *partner, dsm_structure *structure, char *name, char *buf, time_t theTime, int rM)
+/* Fills the table from a dsm_read, unless a monitor event or a write has come along since cacheLookup */
+void cacheStore(char *partner, char *name, char *buf, int size, time_t timestamp, unsigned long generation)
 {
-  int status, type, nDim;
-  int *dimensions = NULL;
-  time_t timestamp;
-  static PyObject **containerTupleBase = NULL;
-  PyObject *readTime, *makePyObjectTuple;
+  subscription *entry;
 
-  timestamp = theTime; /* Overwritten later, if dsm_read is actually called  */
-  if ((status = decodeObject(name, &type, &nDim, &dimensions)) != DSM_SUCCESS) {
-    fprintf(stderr, "Error %d returned by decodeObject (%s)\n", status, name);
-    if (dimensions != NULL)
-      PyMem_Free(dimensions);
-    return NULL;
-  } else {
-    int size = 0;
+  pthread_mutex_lock(&subscriptionMutex);
+  entry = findSubscription(partner, name);
+  if ((entry != NULL) && (entry->size == size) && !entry->valid && (entry->generation == generation)) {
+    bcopy(buf, entry->data, size);
+    entry->timestamp = timestamp;
+    entry->valid = TRUE;
+    entry->generation++;
+  }
+  pthread_mutex_unlock(&subscriptionMutex);
+}
 
-    /* OK we've successfully decoded the name. */
-    if (nDim == 0) {
-      int retInt;
+/* Called for every monitor event.   buf == NULL just invalidates the entry, after a write from this process */
+void cacheUpdate(char *partner, char *name, char *buf, int size, time_t timestamp)
+{
+  subscription *entry;
+
+  if (nSubscriptions == 0)
+    return;
+  pthread_mutex_lock(&subscriptionMutex);
+  if ((entry = findSubscription(partner, name)) != NULL) {
+    if (buf == NULL)
+      entry->valid = FALSE;
+    else if (entry->size == size) {
+      bcopy(buf, entry->data, size);
+      entry->timestamp = timestamp;
+      entry->valid = TRUE;
+      entry->updates++;
+    }
+    entry->generation++;
+  }
+  pthread_mutex_unlock(&subscriptionMutex);
+}
+
+/*
+  Adds holder to a table entry, or with size 0 takes it away, removing the
+  entry once it has no holders left.   Returns DSM_ERROR, with an exception
+  set, if out of memory.
+*/
+int setSubscription(char *partner, char *name, int size, int holder)
+{
+  unsigned int bucket;
+  subscription *entry = NULL, **link;
+
+  if (size > 0) {
+    entry = (subscription *)pydsmCalloc(1, sizeof(subscription));
+    if ((entry == NULL) || ((entry->data = pydsmMalloc(size)) == NULL)) {
+      pydsmFree(entry);
+      fprintf(stderr, "malloc failure for subscription to \"%s\" (%d bytes)\n", name, size);
+      PyErr_NoMemory();
+      return DSM_ERROR;
+    }
+    strcpy(entry->partner, partner);
+    strcpy(entry->name, name);
+    entry->size = size;
+  }
+  bucket = nameHash(partner, name) % SUBSCRIPTION_HASH_SIZE;
+  pthread_mutex_lock(&subscriptionMutex);
+  for (link = &subscriptions[bucket]; *link != NULL; link = &(*link)->nextInBucket)
+    if (!strcmp((*link)->name, name) && !strcmp((*link)->partner, partner)) {
+      subscription *old = *link;
+
+      if (entry != NULL) {
+	/* Already in the table - keep the existing entry and its counters */
+	old->holders |= holder;
+	pthread_mutex_unlock(&subscriptionMutex);
+	pydsmFree(entry->data);
+	pydsmFree(entry);
+	return DSM_SUCCESS;
+      }
+      if ((old->holders &= ~holder) != 0)
+	break;
+      *link = old->nextInBucket;
+      pydsmFree(old->data);
+      pydsmFree(old);
+      nSubscriptions--;
+      break;
+    }
+  if (entry != NULL) {
+    entry->holders = holder;
+    entry->nextInBucket = subscriptions[bucket];
+    subscriptions[bucket] = entry;
+    nSubscriptions++;
+  }
+  pthread_mutex_unlock(&subscriptionMutex);
+  return DSM_SUCCESS;
+}
+
+/* Drops every subscription, leaving the entries which are still polled */
+void clearSubscriptions(void)
+{
+  int i;
+  subscription *entry, **link;
+
+  pthread_mutex_lock(&subscriptionMutex);
+  for (i = 0; i < SUBSCRIPTION_HASH_SIZE; i++)
+    for (link = &subscriptions[i]; (entry = *link) != NULL; )
+      if ((entry->holders &= ~CACHE_SUBSCRIBED) != 0)
+	link = &entry->nextInBucket;
+      else {
+	*link = entry->nextInBucket;
+	pydsmFree(entry->data);
+	pydsmFree(entry);
+	nSubscriptions--;
+      }
+  pthread_mutex_unlock(&subscriptionMutex);
+}
+
+/*
+  Recording of monitor events.   record() starts appending every monitor
+  event which arrives (host, name id, raw bytes, arrival time in ns) to a
+  binary log.   The first time a host/name pair is seen, a name record
+  assigning it an id is written ahead of its first event, so the name
+  dictionary is built up as the file is read and the file can be strictly
+  append-only.   Records are gathered into blocks in memory, and a writer
+  thread compresses (optionally) and writes full blocks, so the thread
+  receiving the events never waits on the disk.   If the writer thread
+  falls RECORD_QUEUE_LIMIT bytes behind, events are dropped and counted.
+
+  File layout (native byte order):
+    "PYDSMLOG", unsigned int version, unsigned int flags (RECORD_COMPRESSED)
+    blocks of:  unsigned int rawLength, unsigned int storedLength, storedLength bytes
+  where each (uncompressed) block holds recordHeaders, each followed by size bytes.
+*/
+#define RECORD_MAGIC       "PYDSMLOG"
+#define RECORD_VERSION     (1)
+#define RECORD_COMPRESSED  (1)
+#define RECORD_NAME        (1) /* Payload is "partner\0name\0", assigning it the id */
+#define RECORD_EVENT       (2) /* Payload is the raw value */
+#define RECORD_BLOCK_SIZE  (1 << 20)
+#define RECORD_QUEUE_LIMIT (64 << 20)
+#define RECORD_HASH_SIZE   (1024)
+
+typedef struct {
+  unsigned int type;
+  unsigned int id;
+  unsigned int size;  /* Number of payload bytes following this header */
+  unsigned int spare;
+  long long nanoseconds; /* Arrival time, for events */
+} recordHeader;
+
+typedef struct recordBlock {
+  size_t used;
+  size_t capacity;
+  char *data;
+  struct recordBlock *next;
+} recordBlock;
+
+typedef struct recordName {
+  unsigned int id;
+  char *partner;
+  char *name;
+  struct recordName *next;
+} recordName;
+
+static pthread_mutex_t recordMutex = PTHREAD_MUTEX_INITIALIZER; /* Protects everything below */
+static pthread_cond_t recordCond = PTHREAD_COND_INITIALIZER;
+static FILE *recordFile = NULL;
+static int recordFlags = 0;
+static int recordStopping = FALSE;
+static pthread_t recordThread;
+static recordBlock *recordCurrent = NULL;
+static recordBlock *recordQueueHead = NULL;
+static recordBlock *recordQueueTail = NULL;
+static size_t recordQueuedBytes = 0;
+static recordName *recordNames[RECORD_HASH_SIZE];
+static unsigned int recordNextId = 0;
+static long recordedEvents = 0;
+static long recordDropped = 0;
+static long long recordWrittenBytes = 0;
+
+long long nanoClock(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (long long)now.tv_sec*1000000000LL + (long long)now.tv_nsec;
+}
+
+recordBlock *newRecordBlock(size_t capacity)
+{
+  recordBlock *block;
+
+  block = (recordBlock *)pydsmMalloc(sizeof(recordBlock));
+  if (block == NULL)
+    return NULL;
+  block->data = (char *)pydsmMalloc(capacity);
+  if (block->data == NULL) {
+    pydsmFree(block);
+    return NULL;
+  }
+  block->used = 0;
+  block->capacity = capacity;
+  block->next = NULL;
+  return block;
+}
+
+void freeRecordBlock(recordBlock *block)
+{
+  pydsmFree(block->data);
+  pydsmFree(block);
+}
+
+/* Must be called with recordMutex held */
+void queueRecordBlock(void)
+{
+  if ((recordCurrent == NULL) || (recordCurrent->used == 0))
+    return;
+  if (recordQueueHead == NULL)
+    recordQueueHead = recordCurrent;
+  else
+    recordQueueTail->next = recordCurrent;
+  recordQueueTail = recordCurrent;
+  recordQueuedBytes += recordCurrent->used;
+  recordCurrent = NULL;
+  pthread_cond_signal(&recordCond);
+}
+
+/* Must be called with recordMutex held.   Returns FALSE if there's no room for the record */
+int appendRecord(unsigned int type, unsigned int id, long long nanoseconds, char *payload1, size_t size1,
+		 char *payload2, size_t size2)
+{
+  size_t needed = sizeof(recordHeader) + size1 + size2;
+  recordHeader header;
+
+  if ((recordCurrent != NULL) && (recordCurrent->used + needed > recordCurrent->capacity))
+    queueRecordBlock();
+  if (recordQueuedBytes + needed > RECORD_QUEUE_LIMIT)
+    return FALSE;
+  if (recordCurrent == NULL) {
+    recordCurrent = newRecordBlock((needed > RECORD_BLOCK_SIZE) ? needed : RECORD_BLOCK_SIZE);
+    if (recordCurrent == NULL)
+      return FALSE;
+  }
+  header.type = type;
+  header.id = id;
+  header.size = size1 + size2;
+  header.spare = 0;
+  header.nanoseconds = nanoseconds;
+  bcopy((char *)&header, &recordCurrent->data[recordCurrent->used], sizeof(header));
+  recordCurrent->used += sizeof(header);
+  bcopy(payload1, &recordCurrent->data[recordCurrent->used], size1);
+  recordCurrent->used += size1;
+  if (size2 > 0) {
+    bcopy(payload2, &recordCurrent->data[recordCurrent->used], size2);
+    recordCurrent->used += size2;
+  }
+  return TRUE;
+}
+
+/* Must be called with recordMutex held.   Returns the name's id, or -1 if it couldn't be recorded */
+long recordNameId(char *partner, char *name)
+{
+  unsigned int bucket;
+  recordName *entry;
+
+  bucket = nameHash(partner, name) % RECORD_HASH_SIZE;
+  for (entry = recordNames[bucket]; entry != NULL; entry = entry->next)
+    if (!strcmp(entry->name, name) && !strcmp(entry->partner, partner))
+      return (long)entry->id;
+  entry = (recordName *)pydsmMalloc(sizeof(recordName));
+  if (entry == NULL)
+    return -1;
+  entry->partner = pydsmStrdup(partner);
+  entry->name = pydsmStrdup(name);
+  if ((entry->partner == NULL) || (entry->name == NULL) ||
+      !appendRecord(RECORD_NAME, recordNextId, 0LL, partner, strlen(partner)+1, name, strlen(name)+1)) {
+    pydsmFree(entry->partner);
+    pydsmFree(entry->name);
+    pydsmFree(entry);
+    return -1;
+  }
+  entry->id = recordNextId++;
+  entry->next = recordNames[bucket];
+  recordNames[bucket] = entry;
+  return (long)entry->id;
+}
+
+/* Called for every monitor event, with or without the GIL */
+void recordMonitorEvent(char *partner, char *name, char *buf, int size)
+{
+  long id;
+  long long now;
+
+  if (recordFile == NULL)
+    return;
+  now = nanoClock();
+  pthread_mutex_lock(&recordMutex);
+  if (recordFile != NULL) {
+    id = recordNameId(partner, name);
+    if ((id >= 0) && appendRecord(RECORD_EVENT, (unsigned int)id, now, buf, size, NULL, 0))
+      recordedEvents++;
+    else
+      recordDropped++;
+  }
+  pthread_mutex_unlock(&recordMutex);
+}
+
+void *recordWriter(void *arg)
+{
+  int ok = TRUE;
+  unsigned int lengths[2];
+  uLongf storedLength;
+  char *stored = NULL;
+  size_t storedCapacity = 0;
+  recordBlock *block;
+
+  pthread_mutex_lock(&recordMutex);
+  while (TRUE) {
+    while ((recordQueueHead == NULL) && !recordStopping)
+      pthread_cond_wait(&recordCond, &recordMutex);
+    if ((block = recordQueueHead) == NULL)
+      break;
+    recordQueueHead = block->next;
+    if (recordQueueHead == NULL)
+      recordQueueTail = NULL;
+    pthread_mutex_unlock(&recordMutex);
+    lengths[0] = lengths[1] = block->used;
+    if (ok && (recordFlags & RECORD_COMPRESSED)) {
+      storedLength = compressBound(block->used);
+      if (storedLength > storedCapacity) {
+	pydsmFree(stored);
+	storedCapacity = storedLength;
+	stored = (char *)pydsmMalloc(storedCapacity);
+      }
+      if ((stored == NULL) || (compress2((Bytef *)stored, &storedLength, (Bytef *)block->data, block->used, 1) != Z_OK)) {
+	fprintf(stderr, "pydsm record: block compression failed\n");
+	ok = FALSE;
+      }
+      lengths[1] = storedLength;
+    }
+    if (ok && ((fwrite(lengths, sizeof(lengths), 1, recordFile) != 1) ||
+	       (fwrite((recordFlags & RECORD_COMPRESSED) ? stored : block->data, lengths[1], 1, recordFile) != 1))) {
+      fprintf(stderr, "pydsm record: write failed (errno %d), recording abandoned\n", errno);
+      ok = FALSE;
+    }
+    pthread_mutex_lock(&recordMutex);
+    recordQueuedBytes -= block->used;
+    if (ok)
+      recordWrittenBytes += sizeof(lengths) + lengths[1];
+    freeRecordBlock(block);
+  }
+  pthread_mutex_unlock(&recordMutex);
+  pydsmFree(stored);
+  return NULL;
+}
+
+/* Flushes everything still buffered, and closes the log.   Pure C, so it can also run at exit */
+void finishRecording(void)
+{
+  int i;
+  recordName *entry;
+
+  if (recordFile == NULL)
+    return;
+  pthread_mutex_lock(&recordMutex);
+  queueRecordBlock();
+  recordStopping = TRUE;
+  pthread_cond_signal(&recordCond);
+  pthread_mutex_unlock(&recordMutex);
+  pthread_join(recordThread, NULL);
+  pthread_mutex_lock(&recordMutex);
+  fclose(recordFile);
+  recordFile = NULL;
+  recordStopping = FALSE;
+  for (i = 0; i < RECORD_HASH_SIZE; i++)
+    while ((entry = recordNames[i]) != NULL) {
+      recordNames[i] = entry->next;
+      pydsmFree(entry->partner);
+      pydsmFree(entry->name);
+      pydsmFree(entry);
+    }
+  recordNextId = 0;
+  pthread_mutex_unlock(&recordMutex);
+}
+
+void stopRecording(void)
+{
+  Py_BEGIN_ALLOW_THREADS
+  finishRecording();
+  Py_END_ALLOW_THREADS
+}
+
+int startRecording(char *path, int compress)
+{
+  unsigned int header[2];
+  FILE *file;
+
+  stopRecording();
+  file = fopen(path, "wb");
+  if (file == NULL) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    return DSM_ERROR;
+  }
+  setvbuf(file, NULL, _IOFBF, RECORD_BLOCK_SIZE);
+  header[0] = RECORD_VERSION;
+  header[1] = compress ? RECORD_COMPRESSED : 0;
+  if ((fwrite(RECORD_MAGIC, 8, 1, file) != 1) || (fwrite(header, sizeof(header), 1, file) != 1)) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    fclose(file);
+    return DSM_ERROR;
+  }
+  pthread_mutex_lock(&recordMutex);
+  recordFlags = header[1];
+  recordedEvents = recordDropped = 0;
+  recordWrittenBytes = 8 + sizeof(header);
+  if (pthread_create(&recordThread, NULL, recordWriter, NULL) != 0) {
+    pthread_mutex_unlock(&recordMutex);
+    fclose(file);
+    PyErr_SetString(dSMInternalError, "DSM error: could not start the record writer thread");
+    return DSM_ERROR;
+  }
+  recordFile = file;
+  pthread_mutex_unlock(&recordMutex);
+  return DSM_SUCCESS;
+}
+
+static int monitorMaxSize = 0; /* This variable holds the size of the largest variable monitored */
+
+/*
+  Monitor events are normally fetched by read_wait, which blocks in
+  dsm_read_wait.   Once monitor_fd() or read_wait_many() has been called,
+  a background reader thread takes over the dsm_read_wait calls instead,
+  and puts each event on a queue.   The read end of a pipe is readable
+  whenever that queue is not empty, so it can be handed to select, epoll
+  or asyncio's add_reader, and the events drained with read_wait_many.
+
+  A monitor may also be given a deadband and a minimum interval.   Each
+  incoming raw value is then compared with the last one delivered, and
+  events which are within the deadband, or arrive too soon, are dropped
+  here before any Python object is made.   Dropped events still update
+  the shared memory snapshot, history and recording.
+
+  A monitor with a max_rate is never queued.   Its newest event waits in
+  a single slot in the monitor entry, overwriting (coalescing) any older
+  one, and read_wait hands the slot out no more often than max_rate per
+  second.   This needs the reader thread, and a pacer thread which makes
+  the pipe readable when a waiting slot becomes due.
+*/
+#define MONITOR_QUEUE_LIMIT (65536) /* Beyond this many queued events, the oldest are dropped */
+
+typedef struct monitorEntry {
+  char partner[DSM_NAME_LENGTH];
+  char name[DSM_NAME_LENGTH];
+  int monitored;         /* Events go to read_wait */
+  int subscribed;        /* Events just update the subscription table */
+  int size;
+  int type;
+  int elementSize;
+  int nElements;
+  double deadband;       /* < 0 if there is none */
+  double minInterval;    /* Seconds, <= 0 if there is none */
+  int haveLast;
+  double lastTime;       /* When the last delivered event arrived */
+  char *last;            /* The last delivered value, only kept if filtering */
+  double period;         /* 1/max_rate, or 0 if not rate limited */
+  double nextDue;        /* When the slot may next be handed out */
+  int hasPending;
+  int pendingSignalled;  /* The pacer has already announced the pending slot */
+  time_t pendingTimestamp;
+  char *pending;         /* The newest undelivered value, only kept if rate limited */
+  long delivered;
+  long deadbandDropped;
+  long intervalDropped;
+  long queueDropped;
+  long coalesced;
+  struct monitorEntry *next;
+} monitorEntry;
+
+typedef struct monitorEvent {
+  char partner[DSM_NAME_LENGTH];
+  char name[DSM_NAME_LENGTH];
+  time_t timestamp;
+  int size;
+  char *data;
+  struct monitorEvent *next;
+} monitorEvent;
+
+static pthread_mutex_t monitorMutex = PTHREAD_MUTEX_INITIALIZER; /* Protects everything below */
+static pthread_cond_t eventCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t slotCond = PTHREAD_COND_INITIALIZER;    /* Wakes the pacer thread */
+static pthread_cond_t readerExitCond = PTHREAD_COND_INITIALIZER;
+static monitorEntry *monitorList = NULL;
+static monitorEvent *eventHead = NULL;
+static monitorEvent *eventTail = NULL;
+static int nQueuedEvents = 0;
+static long droppedEvents = 0;
+static int readerRunning = FALSE;
+static int pacerRunning = FALSE;
+static int monitorStopping = FALSE; /* Tells the reader and pacer to exit */
+static pthread_t pacerThread;
+static int readerBufSize = 0;
+static int monitorPipe[2] = {-1, -1};
+
+/* Must be called with monitorMutex held */
+monitorEntry *findMonitorEntry(char *partner, char *name)
+{
+  monitorEntry *entry;
+
+  for (entry = monitorList; entry != NULL; entry = entry->next)
+    if (!strcmp(entry->name, name) && !strcmp(entry->partner, partner))
+      return entry;
+  return NULL;
+}
+
+/* Monitoring something already monitored just replaces its filter settings */
+/* With subscribing TRUE, an existing entry is just marked as subscribed too, keeping its settings */
+int addMonitorEntry(char *partner, char *name, dsmDescriptor *descriptor, double deadband, double minInterval,
+		    double maxRate, int subscribing)
+{
+  char *last = NULL, *pending = NULL;
+  monitorEntry *entry;
+
+  if ((deadband >= 0.0) || (minInterval > 0.0))
+    if ((last = (char *)pydsmMalloc(descriptor->size)) == NULL) {
+      fprintf(stderr, "pydsmMalloc failure for monitor filter of \"%s\"\n", name);
+      PyErr_NoMemory();
+      return DSM_ERROR;
+    }
+  if (maxRate > 0.0)
+    if ((pending = (char *)pydsmMalloc(descriptor->size)) == NULL) {
+      fprintf(stderr, "pydsmMalloc failure for monitor slot of \"%s\"\n", name);
+      pydsmFree(last);
+      PyErr_NoMemory();
+      return DSM_ERROR;
+    }
+  pthread_mutex_lock(&monitorMutex);
+  if ((entry = findMonitorEntry(partner, name)) == NULL) {
+    entry = (monitorEntry *)pydsmMalloc(sizeof(monitorEntry));
+    if (entry == NULL) {
+      pthread_mutex_unlock(&monitorMutex);
+      fprintf(stderr, "pydsmMalloc failure for monitor entry of \"%s\"\n", name);
+      pydsmFree(last);
+      pydsmFree(pending);
+      PyErr_NoMemory();
+      return DSM_ERROR;
+    }
+    strncpy(entry->partner, partner, DSM_NAME_LENGTH-1);
+    entry->partner[DSM_NAME_LENGTH-1] = (char)0;
+    strncpy(entry->name, name, DSM_NAME_LENGTH-1);
+    entry->name[DSM_NAME_LENGTH-1] = (char)0;
+    entry->last = entry->pending = NULL;
+    entry->delivered = entry->deadbandDropped = entry->intervalDropped = 0;
+    entry->queueDropped = entry->coalesced = 0;
+    entry->monitored = entry->subscribed = FALSE;
+    entry->next = monitorList;
+    monitorList = entry;
+  } else if (subscribing) {
+    entry->subscribed = TRUE;
+    pthread_mutex_unlock(&monitorMutex);
+    pydsmFree(last);
+    pydsmFree(pending);
+    return DSM_SUCCESS;
+  }
+  if (subscribing)
+    entry->subscribed = TRUE;
+  else
+    entry->monitored = TRUE;
+  entry->size = descriptor->size;
+  entry->type = descriptor->type;
+  entry->elementSize = descriptor->elementSize;
+  entry->nElements = descriptor->nElements;
+  entry->deadband = deadband;
+  entry->minInterval = minInterval;
+  entry->haveLast = FALSE;
+  pydsmFree(entry->last);
+  entry->last = last;
+  entry->period = (maxRate > 0.0) ? 1.0/maxRate : 0.0;
+  entry->nextDue = 0.0;
+  entry->hasPending = FALSE;
+  pydsmFree(entry->pending);
+  entry->pending = pending;
+  pthread_mutex_unlock(&monitorMutex);
+  return DSM_SUCCESS;
+}
+
+/*
+  Drops the monitoring (or with subscription TRUE, the subscribing) of a
+  variable, and the entry once neither is left.   Returns TRUE if the
+  variable is still wanted for the other, so dsm_no_monitor mustn't be called.
+*/
+int removeMonitorEntry(char *partner, char *name, int subscription)
+{
+  int inUse = FALSE;
+  monitorEntry *entry, **link;
+
+  pthread_mutex_lock(&monitorMutex);
+  for (link = &monitorList; (entry = *link) != NULL; link = &entry->next)
+    if (!strcmp(entry->name, name) && !strcmp(entry->partner, partner)) {
+      if (subscription)
+	entry->subscribed = FALSE;
+      else
+	entry->monitored = FALSE;
+      if ((inUse = (entry->monitored || entry->subscribed)))
+	break;
+      *link = entry->next;
+      pydsmFree(entry->last);
+      pydsmFree(entry->pending);
+      pydsmFree(entry);
+      break;
+    }
+  pthread_mutex_unlock(&monitorMutex);
+  return inUse;
+}
+
+/* Must be called with monitorMutex held */
+void drainMonitorPipe(void)
+{
+  char junk[64];
+
+  if (monitorPipe[0] >= 0)
+    while (read(monitorPipe[0], junk, sizeof(junk)) > 0)
+      ;
+}
+
+void clearMonitorEntries(void)
+{
+  monitorEntry *entry;
+  monitorEvent *event;
+
+  pthread_mutex_lock(&monitorMutex);
+  while ((entry = monitorList) != NULL) {
+    monitorList = entry->next;
+    pydsmFree(entry->last);
+    pydsmFree(entry->pending);
+    pydsmFree(entry);
+  }
+  while ((event = eventHead) != NULL) {
+    eventHead = event->next;
+    pydsmFree(event);
+  }
+  eventTail = NULL;
+  nQueuedEvents = 0;
+  drainMonitorPipe();
+  pthread_mutex_unlock(&monitorMutex);
+}
+
+/* Work done for every monitor event as it arrives, whether or not the GIL is held */
+void monitorEventArrived(char *partner, char *name, char *buf, int size, time_t timestamp)
+{
+  cacheUpdate(partner, name, buf, size, timestamp);
+  shmPublish(partner, name, buf, size, timestamp);
+  historyRecord(partner, name, buf, size, wallClock());
+  recordMonitorEvent(partner, name, buf, size);
+}
+
+/* TRUE if no element of value differs from the last delivered one by more than the deadband */
+int withinDeadband(monitorEntry *entry, char *value)
+{
+  int i;
+  double difference = 0.0;
+  char *last = entry->last;
+
+  if (entry->type == DSM_STRING)
+    return !strncmp(last, value, entry->size); /* Any deadband just drops repeats */
+  for (i = 0; i < entry->nElements; i++) {
+    switch (entry->type) {
+    case DSM_BYTE:
+      difference = (double)value[i] - (double)last[i];
+      break;
+    case DSM_SHORT:
+      difference = (double)((short *)value)[i] - (double)((short *)last)[i];
+      break;
+    case DSM_LONG:
+      difference = (double)((int *)value)[i] - (double)((int *)last)[i];
+      break;
+    case DSM_FLOAT:
+      difference = (double)((float *)value)[i] - (double)((float *)last)[i];
+      break;
+    default:
+      difference = ((double *)value)[i] - ((double *)last)[i];
+    }
+    if (!(fabs(difference) <= entry->deadband)) /* NaNs always count as a change */
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+  Decides whether a monitor event should be passed on to Python, keeping
+  the counters shown by monitor_stats.   Safe to call without the GIL.
+*/
+int monitorFilter(char *partner, char *name, char *buf)
+{
+  int deliver = TRUE;
+  double now;
+  monitorEntry *entry;
+
+  pthread_mutex_lock(&monitorMutex);
+  if ((entry = findMonitorEntry(partner, name)) != NULL) {
+    if (entry->last != NULL) {
+      now = wallClock();
+      if (entry->haveLast && (entry->minInterval > 0.0) && ((now - entry->lastTime) < entry->minInterval)) {
+	entry->intervalDropped++;
+	deliver = FALSE;
+      } else if (entry->haveLast && (entry->deadband >= 0.0) && withinDeadband(entry, buf)) {
+	entry->deadbandDropped++;
+	deliver = FALSE;
+      } else {
+	bcopy(buf, entry->last, entry->size);
+	entry->lastTime = now;
+	entry->haveLast = TRUE;
+      }
+    }
+    if (deliver && (entry->period <= 0.0))
+      entry->delivered++; /* Rate limited slots are counted as they're handed out */
+  }
+  pthread_mutex_unlock(&monitorMutex);
+  return deliver;
+}
+
+/* Passes an event which has arrived on to read_wait, through its monitor's filters and rate limit slot */
+void deliverMonitorEvent(char *partner, char *name, char *buf, int size, time_t timestamp)
+{
+  monitorEntry *entry;
+  monitorEvent *event, *oldest;
+
+  if (!monitorFilter(partner, name, buf))
+    return;
+  pthread_mutex_lock(&monitorMutex);
+  entry = findMonitorEntry(partner, name);
+  if ((entry != NULL) && (entry->pending != NULL)) {
+    /* Rate limited - just keep the newest value in the entry's slot */
+    if (entry->hasPending)
+      entry->coalesced++;
+    bcopy(buf, entry->pending, entry->size);
+    entry->pendingTimestamp = timestamp;
+    entry->hasPending = TRUE;
+    entry->pendingSignalled = FALSE;
+    pthread_cond_signal(&slotCond);
+    pthread_mutex_unlock(&monitorMutex);
+    return;
+  }
+  pthread_mutex_unlock(&monitorMutex);
+  event = (monitorEvent *)pydsmMalloc(sizeof(monitorEvent) + size);
+  if (event == NULL) {
+    fprintf(stderr, "malloc failure for monitor event of \"%s\" on \"%s\"\n", name, partner);
+    return;
+  }
+  strcpy(event->partner, partner);
+  strcpy(event->name, name);
+  event->timestamp = timestamp;
+  event->size = size;
+  event->data = (char *)(event+1);
+  bcopy(buf, event->data, size);
+  event->next = NULL;
+  pthread_mutex_lock(&monitorMutex);
+  if (nQueuedEvents >= MONITOR_QUEUE_LIMIT) {
+    oldest = eventHead;
+    eventHead = oldest->next;
+    if ((entry = findMonitorEntry(oldest->partner, oldest->name)) != NULL)
+      entry->queueDropped++;
+    pydsmFree(oldest);
+    nQueuedEvents--;
+    droppedEvents++;
+  }
+  if (eventHead == NULL)
+    eventHead = event;
+  else
+    eventTail->next = event;
+  eventTail = event;
+  if ((++nQueuedEvents == 1) && (monitorPipe[1] >= 0))
+    if (write(monitorPipe[1], "E", 1) < 0)
+      dprintf("Could not signal the monitor pipe (errno %d)\n", errno);
+  pthread_cond_broadcast(&eventCond);
+  pthread_mutex_unlock(&monitorMutex);
+}
+
+/* Called by the reader thread, without the GIL */
+void queueMonitorEvent(char *partner, char *name, char *buf, time_t timestamp)
+{
+  int size, monitored;
+  monitorEntry *entry;
+
+  pthread_mutex_lock(&monitorMutex);
+  entry = findMonitorEntry(partner, name);
+  size = (entry != NULL) ? entry->size : monitorMaxSize;
+  monitored = (entry == NULL) || entry->monitored;
+  pthread_mutex_unlock(&monitorMutex);
+  monitorEventArrived(partner, name, buf, size, timestamp);
+  if (monitored) /* Not just subscribed to */
+    deliverMonitorEvent(partner, name, buf, size, timestamp);
+}
+
+/* Must be called with monitorMutex held */
+void waitForEvents(pthread_cond_t *condition, double until)
+{
+  struct timespec deadline;
+
+  if (until <= 0.0)
+    pthread_cond_wait(condition, &monitorMutex);
+  else {
+    deadline.tv_sec = (time_t)until;
+    deadline.tv_nsec = (long)((until - (double)deadline.tv_sec)*1.0e9);
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(condition, &monitorMutex, &deadline);
+  }
+}
+
+/*
+  Turns up to maxEvents (all, if maxEvents <= 0) rate limited slots which
+  are due into events, appending them to the list *first ... *last.   Sets
+  *earliest to when the next waiting slot falls due (0 if none are
+  waiting) and returns the number taken.   Must be called with
+  monitorMutex held, and without the GIL.
+*/
+int takeDueSlots(double now, int maxEvents, monitorEvent **first, monitorEvent **last, double *earliest)
+{
+  int nTaken = 0;
+  monitorEntry *entry;
+  monitorEvent *event;
+
+  *earliest = 0.0;
+  for (entry = monitorList; entry != NULL; entry = entry->next) {
+    if (!entry->hasPending)
+      continue;
+    if ((entry->nextDue > now) || ((maxEvents > 0) && (nTaken >= maxEvents))) {
+      if ((*earliest == 0.0) || (entry->nextDue < *earliest))
+	*earliest = (entry->nextDue > now) ? entry->nextDue : now;
+      continue;
+    }
+    event = (monitorEvent *)pydsmMalloc(sizeof(monitorEvent) + entry->size);
+    if (event == NULL) {
+      fprintf(stderr, "malloc failure for monitor event of \"%s\" on \"%s\"\n", entry->name, entry->partner);
+      break;
+    }
+    strcpy(event->partner, entry->partner);
+    strcpy(event->name, entry->name);
+    event->timestamp = entry->pendingTimestamp;
+    event->size = entry->size;
+    event->data = (char *)(event+1);
+    bcopy(entry->pending, event->data, entry->size);
+    event->next = NULL;
+    if (*first == NULL)
+      *first = event;
+    else
+      (*last)->next = event;
+    *last = event;
+    entry->hasPending = FALSE;
+    entry->nextDue = now + entry->period;
+    entry->delivered++;
+    nTaken++;
+  }
+  return nTaken;
+}
+
+/*
+  Remove up to maxEvents (all, if maxEvents <= 0) events, from rate limited
+  slots which are due and then from the queue, waiting up to timeout seconds
+  (forever, if timeout < 0) for the first one.   Returns a linked list of
+  events which the caller must free, or NULL if none arrived.
+  Must be called without the GIL.
+*/
+monitorEvent *takeMonitorEvents(int maxEvents, double timeout)
+{
+  int nTaken = 0;
+  double now, earliest, until, deadline = 0.0;
+  monitorEvent *first = NULL, *last = NULL;
+
+  if (timeout > 0.0)
+    deadline = wallClock() + timeout;
+  pthread_mutex_lock(&monitorMutex);
+  while (TRUE) {
+    now = wallClock();
+    nTaken = takeDueSlots(now, maxEvents, &first, &last, &earliest);
+    if ((nTaken > 0) || (eventHead != NULL) || (timeout == 0.0) || ((timeout > 0.0) && (now >= deadline)))
+      break;
+    until = deadline;
+    if ((earliest > 0.0) && ((until == 0.0) || (earliest < until)))
+      until = earliest;
+    waitForEvents(&eventCond, until);
+  }
+  while ((eventHead != NULL) && ((maxEvents <= 0) || (nTaken < maxEvents))) {
+    if (first == NULL)
+      first = eventHead;
+    else
+      last->next = eventHead;
+    last = eventHead;
+    eventHead = eventHead->next;
+    nQueuedEvents--;
+    nTaken++;
+  }
+  if (last != NULL)
+    last->next = NULL;
+  if (eventHead == NULL) {
+    eventTail = NULL;
+    if ((earliest == 0.0) || (earliest > now))
+      drainMonitorPipe();
+  }
+  pthread_mutex_unlock(&monitorMutex);
+  return first;
+}
+
+/* Makes the monitor pipe readable, and wakes read_wait, as rate limited slots fall due */
+void *monitorPacer(void *arg)
+{
+  int announce;
+  double now, earliest;
+  monitorEntry *entry;
+
+  pthread_mutex_lock(&monitorMutex);
+  while (!monitorStopping) {
+    announce = FALSE;
+    earliest = 0.0;
+    now = wallClock();
+    for (entry = monitorList; entry != NULL; entry = entry->next)
+      if (entry->hasPending && !entry->pendingSignalled) {
+	if (entry->nextDue <= now) {
+	  entry->pendingSignalled = TRUE;
+	  announce = TRUE;
+	} else if ((earliest == 0.0) || (entry->nextDue < earliest))
+	  earliest = entry->nextDue;
+      }
+    if (announce) {
+      if (write(monitorPipe[1], "S", 1) < 0)
+	dprintf("Could not signal the monitor pipe (errno %d)\n", errno);
+      pthread_cond_broadcast(&eventCond);
+    }
+    waitForEvents(&slotCond, earliest);
+  }
+  pthread_mutex_unlock(&monitorMutex);
+  return NULL;
+}
+
+void *monitorReader(void *arg)
+{
+  int status;
+  char partner[DSM_NAME_LENGTH], allocName[DSM_NAME_LENGTH], *buf;
+
+  buf = (char *)pydsmMalloc(readerBufSize);
+  if (buf == NULL) {
+    fprintf(stderr, "malloc failure for monitor reader buffer (%d bytes)\n", readerBufSize);
+    pthread_mutex_lock(&monitorMutex);
+    readerRunning = FALSE;
+    pthread_cond_broadcast(&readerExitCond);
+    pthread_mutex_unlock(&monitorMutex);
+    return NULL;
+  }
+  while (TRUE) {
+    status = dsm_read_wait(partner, allocName, buf);
+    pthread_mutex_lock(&monitorMutex);
+    if (monitorStopping)
+      break;
+    pthread_mutex_unlock(&monitorMutex);
+    if (status == DSM_SUCCESS)
+      queueMonitorEvent(partner, allocName, buf, time(NULL));
+    else {
+      /* Most likely nothing is monitored yet - don't spin */
+      dprintf("Monitor reader: dsm_read_wait returned %d\n", status);
+      usleep(100000);
+    }
+  }
+  dprintf("Monitor reader thread stopping\n");
+  readerRunning = FALSE;
+  pthread_cond_broadcast(&readerExitCond);
+  pthread_mutex_unlock(&monitorMutex);
+  pydsmFree(buf);
+  return NULL;
+}
+
+/*
+  The reader thread may be blocked in dsm_read_wait when a new variable is
+  monitored, so its buffer must be big enough for anything in the allocation list.
+*/
+int largestAllocation(void)
+{
+  int nhosts, i, j, size;
+  int largest = monitorMaxSize;
+  struct dsm_allocation_list *alp;
+
+  getAllocationList(&nhosts, &alp);
+  for (i = 0; i < nhosts; i++)
+    for (j = 0; j < alp[i].n_entries; j++) {
+      size = objectSize(alp[i].alloc_list[j]);
+      if (size < 0)
+	PyErr_Clear(); /* Structures can't be monitored, so just skip them */
+      else if (size > largest)
+	largest = size;
+    }
+  return largest;
+}
+
+int startMonitorReader(void)
+{
+  int i, running;
+  pthread_t thread;
+
+  /* A reader told to stop which is still waiting in dsm_read_wait just carries on */
+  pthread_mutex_lock(&monitorMutex);
+  monitorStopping = FALSE;
+  running = readerRunning;
+  pthread_mutex_unlock(&monitorMutex);
+  if (monitorPipe[0] < 0) {
+    if (pipe(monitorPipe) != 0) {
+      PyErr_SetFromErrno(PyExc_OSError);
+      return DSM_ERROR;
+    }
+    for (i = 0; i < 2; i++) {
+      fcntl(monitorPipe[i], F_SETFL, fcntl(monitorPipe[i], F_GETFL) | O_NONBLOCK);
+      fcntl(monitorPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+  }
+  /* The pacer is harmless on its own, so start it first */
+  if (!pacerRunning) {
+    if (pthread_create(&pacerThread, NULL, monitorPacer, NULL) == 0)
+      pacerRunning = TRUE;
+    else
+      fprintf(stderr, "Could not start the monitor pacer thread - monitor_fd won't report rate limited events\n");
+  }
+  if (running)
+    return DSM_SUCCESS;
+  readerBufSize = largestAllocation();
+  readerRunning = TRUE;
+  if (pthread_create(&thread, NULL, monitorReader, NULL) != 0) {
+    readerRunning = FALSE;
+    PyErr_SetString(dSMInternalError, "DSM error: could not start the monitor reader thread");
+    return DSM_ERROR;
+  }
+  pthread_detach(thread);
+  dprintf("Monitor reader thread started, buffer size %d\n", readerBufSize);
+  return DSM_SUCCESS;
+}
+
+/*
+  Asks the monitor reader and pacer threads to exit, and waits up to wait
+  seconds for the reader.   The pacer goes at once, but the reader only
+  sees the request when dsm_read_wait next returns, so it may be left
+  waiting in libdsm; if anything is monitored again before then it just
+  carries on.   Returns TRUE if the reader has gone.   Call without the GIL.
+*/
+int stopMonitorThreads(double wait)
+{
+  int stopped;
+  double until = wallClock() + wait;
+
+  pthread_mutex_lock(&monitorMutex);
+  monitorStopping = TRUE;
+  pthread_cond_broadcast(&slotCond);
+  pthread_mutex_unlock(&monitorMutex);
+  if (pacerRunning) {
+    pthread_join(pacerThread, NULL);
+    pacerRunning = FALSE;
+  }
+  pthread_mutex_lock(&monitorMutex);
+  while (readerRunning && (wallClock() < until))
+    waitForEvents(&readerExitCond, until);
+  stopped = !readerRunning;
+  pthread_mutex_unlock(&monitorMutex);
+  return stopped;
+}
+
+static PyObject *pydsm_clear_monitor(PyObject *self)
+{
+  int status;
+
+  dprintf("Clearing all monitored variables\n");
+  status = open_dsm();
+  if (status == DSM_SUCCESS) {
+    status = dsm_clear_monitor();
+    if (status != DSM_SUCCESS) {
+      raiseDSMError(status, "pydsm_clear_monitor: dsm_clear_monitor");
+      return NULL;
+    }
+    clearMonitorEntries();
+    clearSubscriptions();
+    /* With nothing monitored the reader may never see this, but it goes if it's woken */
+    Py_BEGIN_ALLOW_THREADS
+    stopMonitorThreads(0.0);
+    Py_END_ALLOW_THREADS
+  } else {
+    raiseDSMError(status, "pydsm_clear_monitor: dsm_open");
+    return NULL;
+  }
+  return Py_BuildValue("i", status);
+}
+
+/*
+  PyArg "O&" converters, which copy a computer name (partner) in lower case
+  or a variable name in upper case into a DSM_NAME_LENGTH buffer.   They
+  used to be case-fixed in place, which changes the caller's string.
+*/
+int copyName(PyObject *object, char *dest, int upper)
+{
+  int i;
+  char *source;
+
+  if ((source = pyText(object)) == NULL)
+    return FALSE;
+  if (strlen(source) >= DSM_NAME_LENGTH) {
+    PyErr_SetString(dSMIllegalName, "DSM error: Illegal Name");
+    return FALSE;
+  }
+  for (i = 0; source[i]; i++)
+    dest[i] = upper ? toupper(source[i]) : tolower(source[i]);
+  dest[i] = (char)0;
+  return TRUE;
+}
+
+int partnerConverter(PyObject *object, void *dest)
+{
+  return copyName(object, (char *)dest, FALSE);
+}
+
+int nameConverter(PyObject *object, void *dest)
+{
+  return copyName(object, (char *)dest, TRUE);
+}
+
+/* The numpy dtype / array module type code for a descriptor's elements */
+void typeCode(dsmDescriptor *descriptor, char *code)
+{
+  switch (descriptor->type) {
+  case DSM_BYTE:
+    strcpy(code, "b"); break;
+  case DSM_SHORT:
+    strcpy(code, "h"); break;
+  case DSM_LONG:
+    strcpy(code, "i"); break;
+  case DSM_FLOAT:
+    strcpy(code, "f"); break;
+  case DSM_DOUBLE:
+    strcpy(code, "d"); break;
+  case DSM_STRING:
+    sprintf(code, "S%d", descriptor->elementSize); break;
+  default:
+    strcpy(code, "V");
+  }
+}
+
+/*
+  The allocation catalogue, for tools like makeTyped.py which generate
+  code from it.   allocations() returns {partner: (name, ...)}, with
+  structure members named "STRUCTURE_X:MEMBER" as in the allocation list,
+  and describe(name) returns (type code, shape, size in bytes) as the name
+  decodes, with code "V" and size 0 for structures.
+*/
+static PyObject *pydsm_allocations(PyObject *self)
+{
+  int nhosts, i, j;
+  struct dsm_allocation_list *alp;
+  PyObject *allocationDict, *names, *name;
+
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  getAllocationList(&nhosts, &alp);
+  if ((allocationDict = PyDict_New()) == NULL)
+    return NULL;
+  for (i = 0; i < nhosts; i++) {
+    if ((names = PyTuple_New(alp[i].n_entries)) == NULL) {
+      Py_DECREF(allocationDict);
+      return NULL;
+    }
+    for (j = 0; j < alp[i].n_entries; j++) {
+      if ((name = PyString_FromString(alp[i].alloc_list[j])) == NULL) {
+	Py_DECREF(names);
+	Py_DECREF(allocationDict);
+	return NULL;
+      }
+      PyTuple_SET_ITEM(names, j, name);
+    }
+    if (PyDict_SetItemString(allocationDict, alp[i].host_name, names) != 0) {
+      Py_DECREF(names);
+      Py_DECREF(allocationDict);
+      return NULL;
+    }
+    Py_DECREF(names);
+  }
+  return allocationDict;
+}
+
+static PyObject *pydsm_describe(PyObject *self, PyObject *args)
+{
+  int i;
+  char name[DSM_NAME_LENGTH], code[16];
+  dsmDescriptor *descriptor;
+  PyObject *shape;
+
+  if (!PyArg_ParseTuple(args, "O&", nameConverter, name))
+    return NULL;
+  if ((descriptor = lookupDescriptor(name)) == NULL)
+    return NULL;
+  if ((shape = PyTuple_New(descriptor->nDim)) == NULL)
+    return NULL;
+  for (i = 0; i < descriptor->nDim; i++)
+    PyTuple_SET_ITEM(shape, i, PyInt_FromLong((long)descriptor->dimensions[i]));
+  typeCode(descriptor, code);
+  return Py_BuildValue("(sNi)", code, shape, descriptor->size);
+}
+
+static PyObject *pydsm_history(PyObject *self, PyObject *args)
+{
+  int depth;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  dsmDescriptor *descriptor;
+
+  if (!PyArg_ParseTuple(args, "O&O&i", partnerConverter, partner, nameConverter, name, &depth))
+    return NULL;
+  if (depth < 0) {
+    PyErr_SetString(dSMRangeError, "DSM error: history depth can't be negative");
+    return NULL;
+  }
+  if ((descriptor = lookupDescriptor(name)) == NULL)
+    return NULL;
+  if (descriptor->type == DSM_STRUCTURE) {
+    PyErr_SetString(dSMNotImplemented, "DSM error: History of structures not implemented in the pydsm module");
+    return NULL;
+  }
+  dprintf("Keeping %d samples of \"%s\" on \"%s\"\n", depth, name, partner);
+  if (setHistory(partner, name, descriptor->size, depth) != DSM_SUCCESS)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+/* Returns (samples, timestamps, type code, shape), oldest sample first, or None if there's no history */
+static PyObject *pydsm_history_get(PyObject *self, PyObject *args)
+{
+  int i, count, first, size;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH], *samplePtr, code[16];
+  double *timePtr;
+  dsmDescriptor *descriptor;
+  historyBuffer *history;
+  PyObject *samples, *times, *shape;
+
+  if (!PyArg_ParseTuple(args, "O&O&", partnerConverter, partner, nameConverter, name))
+    return NULL;
+  if ((descriptor = lookupDescriptor(name)) == NULL)
+    return NULL;
+  pthread_mutex_lock(&historyMutex);
+  if ((history = findHistory(partner, name)) == NULL) {
+    pthread_mutex_unlock(&historyMutex);
+    Py_RETURN_NONE;
+  }
+  count = history->count;
+  size = history->size;
+  first = (history->next - count + history->depth) % history->depth;
+  samples = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)count*size);
+  times = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)count*sizeof(double));
+  if ((samples == NULL) || (times == NULL)) {
+    pthread_mutex_unlock(&historyMutex);
+    Py_XDECREF(samples);
+    Py_XDECREF(times);
+    return NULL;
+  }
+  samplePtr = PyBytes_AS_STRING(samples);
+  timePtr = (double *)PyBytes_AS_STRING(times);
+  /* The ring may wrap, so copy it out in (at most) two pieces */
+  i = (first + count > history->depth) ? history->depth - first : count;
+  bcopy(&history->samples[(size_t)first*size], samplePtr, (size_t)i*size);
+  bcopy(history->samples, &samplePtr[(size_t)i*size], (size_t)(count-i)*size);
+  bcopy(&history->times[first], timePtr, i*sizeof(double));
+  bcopy(history->times, &timePtr[i], (count-i)*sizeof(double));
+  pthread_mutex_unlock(&historyMutex);
+  shape = PyTuple_New(descriptor->nDim + 1);
+  if (shape == NULL) {
+    Py_DECREF(samples);
+    Py_DECREF(times);
+    return NULL;
+  }
+  PyTuple_SET_ITEM(shape, 0, PyInt_FromLong((long)count));
+  for (i = 0; i < descriptor->nDim; i++)
+    PyTuple_SET_ITEM(shape, i+1, PyInt_FromLong((long)descriptor->dimensions[i]));
+  typeCode(descriptor, code);
+  return Py_BuildValue("(NNsN)", samples, times, code, shape);
+}
+
+static PyObject *pydsm_monitor(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  int status, fullSize;
+  double deadband = -1.0, minInterval = 0.0, maxRate = 0.0;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  static char *keyWordList[] = {"partner", "name", "deadband", "min_interval", "max_rate", NULL};
+  PyObject *deadbandObject = Py_None;
+  dsmDescriptor *descriptor;
+  
+  status = open_dsm();
+  if (status == DSM_SUCCESS) {
+    if (!PyArg_ParseTupleAndKeywords(args, keyWords, "O&O&|Odd", keyWordList, partnerConverter, partner, nameConverter, name, &deadbandObject,
+				     &minInterval, &maxRate))
+      return NULL;
+    if (maxRate < 0.0) {
+      PyErr_SetString(PyExc_ValueError, "max_rate must not be negative");
+      return NULL;
+    }
+    if (deadbandObject != Py_None) {
+      deadband = PyFloat_AsDouble(deadbandObject);
+      if (PyErr_Occurred())
+	return NULL;
+      if (deadband < 0.0) {
+	PyErr_SetString(PyExc_ValueError, "deadband must not be negative");
+	return NULL;
+      }
+    }
+    dprintf("pydsm_monitor: request for \"%s\" on \"%s\"\n", name, partner);
+    if (toupper(name[strlen(name)-1]) == 'X') {
+      PyErr_SetString(dSMNotImplemented, "DSM error: Monitoring structures not yet implemented in the pydsm module");
+      return NULL;
+    }
+    if ((descriptor = lookupDescriptor(name)) == NULL) {
+      fprintf(stderr, "Error returned by decodeObject (%s)\n", name);
+      return NULL;
+    }
+    fullSize = descriptor->size;
+    dprintf("Full size = %d\n", fullSize);
+    if ((maxRate > 0.0) && (startMonitorReader() != DSM_SUCCESS)) /* Only the reader thread fills rate limited slots */
+      return NULL;
+    if (readerRunning && (fullSize > readerBufSize)) {
+      PyErr_SetString(dSMRangeError, "DSM error: variable is too large for the monitor reader thread's buffer");
+      return NULL;
+    }
+    if (fullSize > monitorMaxSize) {
+      dprintf("Changing monitorMaxSize from %d to %d\n", monitorMaxSize, fullSize);
+      monitorMaxSize = fullSize;
+    }
+    if (addMonitorEntry(partner, name, descriptor, deadband, minInterval, maxRate, FALSE) != DSM_SUCCESS)
+      return NULL;
+    status = dsm_monitor(partner, name);
+    if (status != DSM_SUCCESS) {
+      removeMonitorEntry(partner, name, FALSE);
+      raiseDSMError(status, "dsm_monitor()");
+      return NULL;
+    }
+  } else
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *pydsm_no_monitor(PyObject *self, PyObject *args)
+{
+  int status, type, nDim;
+  int *dimensions = NULL;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  
+  status = open_dsm();
+  if (status == DSM_SUCCESS) {
+    if (!PyArg_ParseTuple(args, "O&O&", partnerConverter, partner, nameConverter, name))
+      return NULL;
+    dprintf("pydsm_no_monitor: request for \"%s\" on \"%s\"\n", name, partner);
+    if (toupper(name[strlen(name)-1]) == 'X') {
+      PyErr_SetString(dSMNotImplemented, "DSM error: Monitoring structures not yet implemented in the pydsm module");
+      return NULL;
+    }
+    if ((status = decodeObject(name, &type, &nDim, &dimensions)) != DSM_SUCCESS) { /* Just doing this for error checking in the name */
+      fprintf(stderr, "Error %d returned by decodeObject (%s)\n", status, name);
+      if (dimensions != NULL)
+	pydsmFree(dimensions);
+      return NULL;
+    } else {
+      pydsmFree(dimensions);
+      if (!removeMonitorEntry(partner, name, FALSE)) { /* A subscription still needs the monitor */
+	status = dsm_no_monitor(partner, name);
+	if (status != DSM_SUCCESS) {
+	  raiseDSMError(status, "dsm_no_monitor()");
+	  return NULL;
+	}
+      }
+    }
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *pydsm_subscribe(PyObject *self, PyObject *args)
+{
+  int status;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  dsmDescriptor *descriptor;
+
+  if (!PyArg_ParseTuple(args, "O&O&", partnerConverter, partner, nameConverter, name))
+    return NULL;
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  dprintf("pydsm_subscribe: request for \"%s\" on \"%s\"\n", name, partner);
+  if (toupper(name[strlen(name)-1]) == 'X') {
+    PyErr_SetString(dSMNotImplemented, "DSM error: Subscribing to structures not yet implemented in the pydsm module");
+    return NULL;
+  }
+  if (((descriptor = lookupDescriptor(name)) == NULL) || (startMonitorReader() != DSM_SUCCESS))
+    return NULL;
+  if (descriptor->size > readerBufSize) {
+    PyErr_SetString(dSMRangeError, "DSM error: variable is too large for the monitor reader thread's buffer");
+    return NULL;
+  }
+  if (setSubscription(partner, name, descriptor->size, CACHE_SUBSCRIBED) != DSM_SUCCESS)
+    return NULL;
+  if (addMonitorEntry(partner, name, descriptor, -1.0, 0.0, 0.0, TRUE) != DSM_SUCCESS) {
+    setSubscription(partner, name, 0, CACHE_SUBSCRIBED);
+    return NULL;
+  }
+  status = dsm_monitor(partner, name);
+  if (status != DSM_SUCCESS) {
+    removeMonitorEntry(partner, name, TRUE);
+    setSubscription(partner, name, 0, CACHE_SUBSCRIBED);
+    raiseDSMError(status, "dsm_monitor()");
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *pydsm_unsubscribe(PyObject *self, PyObject *args)
+{
+  int status;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+
+  if (!PyArg_ParseTuple(args, "O&O&", partnerConverter, partner, nameConverter, name))
+    return NULL;
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  dprintf("pydsm_unsubscribe: request for \"%s\" on \"%s\"\n", name, partner);
+  setSubscription(partner, name, 0, CACHE_SUBSCRIBED);
+  if (!removeMonitorEntry(partner, name, TRUE)) { /* Unless it's also monitored */
+    status = dsm_no_monitor(partner, name);
+    if (status != DSM_SUCCESS) {
+      raiseDSMError(status, "dsm_no_monitor()");
+      return NULL;
+    }
+  }
+  Py_RETURN_NONE;
+}
+
+/* Returns {(partner, name): {'served': n, 'fetched': n, 'updates': n, 'valid': bool}} for every subscription */
+static PyObject *pydsm_cache_stats(PyObject *self)
+{
+  int i;
+  PyObject *statsDict, *key, *counts;
+  subscription *entry;
+
+  if ((statsDict = PyDict_New()) == NULL)
+    return NULL;
+  pthread_mutex_lock(&subscriptionMutex);
+  for (i = 0; (i < SUBSCRIPTION_HASH_SIZE) && (statsDict != NULL); i++)
+    for (entry = subscriptions[i]; (entry != NULL) && (statsDict != NULL); entry = entry->nextInBucket) {
+      key = Py_BuildValue("(ss)", entry->partner, entry->name);
+      counts = Py_BuildValue("{s:l,s:l,s:l,s:N}", "served", entry->served, "fetched", entry->fetched,
+			     "updates", entry->updates, "valid", PyBool_FromLong((long)entry->valid));
+      if ((key == NULL) || (counts == NULL) || (PyDict_SetItem(statsDict, key, counts) != 0))
+	Py_CLEAR(statsDict);
+      Py_XDECREF(key);
+      Py_XDECREF(counts);
+    }
+  pthread_mutex_unlock(&subscriptionMutex);
+  return statsDict;
+}
+
+/*
+  Remote calls.   Every dsm_read and dsm_write of a partner goes through
+  remoteCall, which times it and keeps a latency histogram per partner for
+  partner_stats().   Given a deadline (a wallClock() time, 0 for none),
+  remoteCallWithin makes the call on a thread of its own and gives up at
+  the deadline with DSM_TIMED_OUT.   The call then owns copies of
+  everything it needs, so when it finally finishes it just records its
+  latency and frees itself.   A structure passed in is handed over to the
+  call, and after DSM_TIMED_OUT the caller mustn't destroy it.   Once
+  MAX_LATE_CALLS abandoned calls to a partner are still waiting in libdsm,
+  further calls to it with a deadline fail at once with DSM_TIMED_OUT, so
+  a hung partner polled quickly can't pile up threads.
+
+  The partner table is also a circuit breaker.   breakerThreshold calls in
+  a row failing with DSM_RPC_ERROR, DSM_TARGET_INVALID or DSM_TIMED_OUT
+  open a partner's breaker, and from then on calls to it fail at once
+  with DSM_RPC_ERROR, without contacting it.   The prober thread reads
+  the variable which last failed every probeInterval seconds, and closes
+  the breaker when that works again.   It exits once no breaker is open.
+*/
+#define REMOTE_READ   (0)
+#define REMOTE_WRITE  (1)
+#define REMOTE_NOTIFY (2)
+
+#define LATENCY_BUCKETS    (128) /* Quarter octaves, from 1 us up to about 4 hours */
+#define PARTNER_HASH_SIZE  (64)
+#define DEFAULT_BREAKER_THRESHOLD (5)
+#define DEFAULT_PROBE_INTERVAL    (1.0)
+#define MAX_LATE_CALLS            (4)
+
+typedef struct {
+  long calls;
+  long errors;
+  long timeouts;
+  double maxLatency;
+  long histogram[LATENCY_BUCKETS];
+} latencyStats;
+
+typedef struct partnerEntry {
+  char partner[DSM_NAME_LENGTH];
+  latencyStats read;
+  latencyStats write;
+  int consecutiveFailures;
+  int open;                /* The breaker, TRUE while calls fail fast */
+  long failures;           /* Of the kinds which count towards opening it */
+  long trips;
+  long fastFails;
+  long probes;
+  double openedAt;
+  double nextProbe;
+  int lastProbeStatus;
+  char probeName[DSM_NAME_LENGTH]; /* The last variable whose call failed, which probes read */
+  int probeSize;
+  int probeIsStructure;
+  int lateCalls;           /* Abandoned calls still waiting in libdsm */
+  long lateRefused;        /* Calls failed at once because of them */
+  struct partnerEntry *nextInBucket;
+} partnerEntry;
+
+typedef struct {
+  int operation;
+  char partner[DSM_NAME_LENGTH];
+  char name[DSM_NAME_LENGTH];
+  int size;                /* Of data, for everything but structures */
+  int isStructure;
+  dsm_structure structure;
+  time_t timestamp;
+  int status;
+  int finished;
+  int abandoned;
+  pthread_cond_t done;
+  char *data;              /* Follows this struct */
+} deadlineCall;
+
+static pthread_mutex_t partnerMutex = PTHREAD_MUTEX_INITIALIZER;  /* Protects the partner table and breaker settings */
+static pthread_mutex_t deadlineMutex = PTHREAD_MUTEX_INITIALIZER; /* Protects finished, abandoned and nDeadlineWorkers */
+static pthread_cond_t deadlineIdleCond = PTHREAD_COND_INITIALIZER; /* Signalled when the last deadline worker exits */
+static pthread_cond_t proberCond = PTHREAD_COND_INITIALIZER;
+static int nDeadlineWorkers = 0;
+static partnerEntry *partners[PARTNER_HASH_SIZE];
+static int breakerThreshold = DEFAULT_BREAKER_THRESHOLD; /* 0 turns breaking off */
+static double probeInterval = DEFAULT_PROBE_INTERVAL;
+static int proberRunning = FALSE;
+static int proberStopping = FALSE;
+
+/* Must be called with partnerMutex held.   Returns NULL only if out of memory */
+partnerEntry *findPartner(char *partner, int create)
+{
+  unsigned int bucket;
+  partnerEntry *entry;
+
+  bucket = stringHash(partner) % PARTNER_HASH_SIZE;
+  for (entry = partners[bucket]; entry != NULL; entry = entry->nextInBucket)
+    if (!strcmp(entry->partner, partner))
+      return entry;
+  if (!create || (strlen(partner) >= DSM_NAME_LENGTH) ||
+      ((entry = (partnerEntry *)pydsmCalloc(1, sizeof(partnerEntry))) == NULL))
+    return NULL;
+  strcpy(entry->partner, partner);
+  entry->nextInBucket = partners[bucket];
+  partners[bucket] = entry;
+  return entry;
+}
+
+/* latency < 0 records a timeout */
+void recordLatency(char *partner, int operation, int status, double latency)
+{
+  int bucket = 0;
+  double micro;
+  partnerEntry *entry;
+  latencyStats *stats;
+
+  pthread_mutex_lock(&partnerMutex);
+  if ((entry = findPartner(partner, TRUE)) != NULL) {
+    stats = (operation == REMOTE_READ) ? &entry->read : &entry->write;
+    if (latency < 0.0)
+      stats->timeouts++;
+    else {
+      if ((micro = latency*1.0e6) >= 1.0)
+	bucket = 1 + (int)(4.0*log2(micro));
+      if (bucket >= LATENCY_BUCKETS)
+	bucket = LATENCY_BUCKETS-1;
+      stats->histogram[bucket]++;
+      stats->calls++;
+      if (status != DSM_SUCCESS)
+	stats->errors++;
+      if (latency > stats->maxLatency)
+	stats->maxLatency = latency;
+    }
+  }
+  pthread_mutex_unlock(&partnerMutex);
+}
+
+/* The latency (seconds) below which the fraction q of calls finished, to within a quarter octave */
+double latencyPercentile(latencyStats *stats, double q)
+{
+  int i;
+  long total = 0, wanted;
+
+  if (stats->calls == 0)
+    return 0.0;
+  wanted = (long)ceil(q*stats->calls);
+  for (i = 0; i < LATENCY_BUCKETS; i++)
+    if ((total += stats->histogram[i]) >= wanted)
+      break;
+  return fmin(pow(2.0, i/4.0)*1.0e-6, stats->maxLatency);
+}
+
+/* The libdsm call itself, timed */
+int timedCall(int operation, char *partner, char *name, void *buf, time_t *timestamp)
+{
+  int status;
+  double start;
+
+  start = wallClock();
+  if (operation == REMOTE_READ)
+    status = dsm_read(partner, name, buf, timestamp);
+  else if (operation == REMOTE_NOTIFY)
+    status = dsm_write_notify(partner, name, buf);
+  else
+    status = dsm_write(partner, name, buf);
+  recordLatency(partner, operation, status, wallClock() - start);
+  return status;
+}
+
+void freeDeadlineCall(deadlineCall *call)
+{
+  if (call->isStructure)
+    dsm_structure_destroy(&call->structure);
+  pthread_cond_destroy(&call->done);
+  pydsmFree(call);
+}
+
+void *deadlineWorker(void *arg)
+{
+  int abandoned;
+  deadlineCall *call = (deadlineCall *)arg;
+  partnerEntry *entry;
+
+  call->status = timedCall(call->operation, call->partner, call->name,
+			    call->isStructure ? (void *)&call->structure : (void *)call->data, &call->timestamp);
+  pthread_mutex_lock(&deadlineMutex);
+  call->finished = TRUE;
+  if (!(abandoned = call->abandoned))
+    pthread_cond_signal(&call->done);
+  pthread_mutex_unlock(&deadlineMutex);
+  if (abandoned) {
+    dprintf("Late %s of \"%s\" on \"%s\" discarded\n", (call->operation == REMOTE_READ) ? "read" : "write",
+	    call->name, call->partner);
+    pthread_mutex_lock(&partnerMutex);
+    if ((entry = findPartner(call->partner, FALSE)) != NULL)
+      entry->lateCalls--;
+    pthread_mutex_unlock(&partnerMutex);
+    freeDeadlineCall(call);
+  }
+  pthread_mutex_lock(&deadlineMutex);
+  if (--nDeadlineWorkers == 0)
+    pthread_cond_broadcast(&deadlineIdleCond);
+  pthread_mutex_unlock(&deadlineMutex);
+  return NULL;
+}
+
+int callWithin(int operation, char *partner, char *name, void *buf, int size, int isStructure,
+	       time_t *timestamp, double deadline)
+{
+  int status;
+  pthread_t thread;
+  pthread_attr_t attributes;
+  int refused = FALSE;
+  struct timespec until;
+  deadlineCall *call;
+  partnerEntry *entry;
+
+  if (deadline <= 0.0)
+    return timedCall(operation, partner, name, buf, timestamp);
+  pthread_mutex_lock(&partnerMutex);
+  if (((entry = findPartner(partner, FALSE)) != NULL) && (entry->lateCalls >= MAX_LATE_CALLS)) {
+    entry->lateRefused++;
+    refused = TRUE;
+  }
+  pthread_mutex_unlock(&partnerMutex);
+  if (refused || (wallClock() >= deadline)) {
+    if (isStructure) /* Callers leave a structure to the late call after DSM_TIMED_OUT, and there isn't one */
+      dsm_structure_destroy((dsm_structure *)buf);
+    recordLatency(partner, operation, DSM_TIMED_OUT, -1.0);
+    return DSM_TIMED_OUT;
+  }
+  if ((call = (deadlineCall *)pydsmCalloc(1, sizeof(deadlineCall) + (isStructure ? 0 : size))) == NULL)
+    return timedCall(operation, partner, name, buf, timestamp); /* Can't do better than that */
+  call->operation = operation;
+  strncpy(call->partner, partner, DSM_NAME_LENGTH-1);
+  strncpy(call->name, name, DSM_NAME_LENGTH-1);
+  call->size = size;
+  call->isStructure = isStructure;
+  call->data = (char *)(call+1);
+  if (isStructure)
+    call->structure = *(dsm_structure *)buf;
+  else if (operation != REMOTE_READ)
+    bcopy(buf, call->data, size);
+  pthread_cond_init(&call->done, NULL);
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  pthread_mutex_lock(&deadlineMutex);
+  nDeadlineWorkers++;
+  pthread_mutex_unlock(&deadlineMutex);
+  status = pthread_create(&thread, &attributes, deadlineWorker, call);
+  pthread_attr_destroy(&attributes);
+  if (status != 0) {
+    pthread_mutex_lock(&deadlineMutex);
+    if (--nDeadlineWorkers == 0)
+      pthread_cond_broadcast(&deadlineIdleCond);
+    pthread_mutex_unlock(&deadlineMutex);
+    pthread_cond_destroy(&call->done);
+    pydsmFree(call);
+    return timedCall(operation, partner, name, buf, timestamp);
+  }
+  until.tv_sec = (time_t)deadline;
+  until.tv_nsec = (long)((deadline - (double)until.tv_sec)*1.0e9);
+  pthread_mutex_lock(&deadlineMutex);
+  while (!call->finished)
+    if (pthread_cond_timedwait(&call->done, &deadlineMutex, &until) == ETIMEDOUT) {
+      if (!call->finished) {
+	call->abandoned = TRUE;
+	pthread_mutex_lock(&partnerMutex); /* Before the worker can see abandoned, and count it down */
+	if ((entry = findPartner(partner, TRUE)) != NULL)
+	  entry->lateCalls++;
+	pthread_mutex_unlock(&partnerMutex);
+	pthread_mutex_unlock(&deadlineMutex);
+	recordLatency(partner, operation, DSM_TIMED_OUT, -1.0);
+	return DSM_TIMED_OUT;
+      }
+    }
+  pthread_mutex_unlock(&deadlineMutex);
+  if ((status = call->status) == DSM_SUCCESS) {
+    if (operation == REMOTE_READ) {
+      *timestamp = call->timestamp;
+      if (!isStructure)
+	bcopy(call->data, buf, size);
+    }
+  }
+  if (isStructure) {
+    *(dsm_structure *)buf = call->structure; /* The caller owns it again */
+    call->isStructure = FALSE;
+  }
+  freeDeadlineCall(call);
+  return status;
+}
+
+/* Reads the variable which opened a partner's breaker */
+int probePartner(char *partner, char *name, int size, int isStructure)
+{
+  int status;
+  char *buf;
+  time_t timestamp;
+  dsm_structure structure;
+
+  if (isStructure) {
+    if ((status = dsm_structure_init(&structure, name)) != DSM_SUCCESS)
+      return status;
+    status = timedCall(REMOTE_READ, partner, name, &structure, &timestamp);
+    dsm_structure_destroy(&structure);
+  } else {
+    if ((buf = pydsmMalloc(size)) == NULL)
+      return DSM_NO_RESOURCE;
+    status = timedCall(REMOTE_READ, partner, name, buf, &timestamp);
+    pydsmFree(buf);
+  }
+  return status;
+}
+
+void *partnerProber(void *arg)
+{
+  int i, nOpen, status, size, isStructure;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  double now, wake;
+  struct timespec until;
+  partnerEntry *entry, *due;
+
+  pthread_mutex_lock(&partnerMutex);
+  while (!proberStopping) {
+    nOpen = 0;
+    due = NULL;
+    now = wallClock();
+    wake = now + probeInterval;
+    for (i = 0; i < PARTNER_HASH_SIZE; i++)
+      for (entry = partners[i]; entry != NULL; entry = entry->nextInBucket)
+	if (entry->open) {
+	  nOpen++;
+	  if ((due == NULL) && (entry->nextProbe <= now))
+	    due = entry;
+	  else if (entry->nextProbe < wake)
+	    wake = entry->nextProbe;
+	}
+    if ((nOpen == 0) || (breakerThreshold == 0))
+      break;
+    if (due == NULL) {
+      until.tv_sec = (time_t)wake;
+      until.tv_nsec = (long)((wake - (double)until.tv_sec)*1.0e9);
+      pthread_cond_timedwait(&proberCond, &partnerMutex, &until);
+      continue;
+    }
+    /* Entries are never freed, so due stays valid while the mutex is released */
+    strcpy(partner, due->partner);
+    strcpy(name, due->probeName);
+    size = due->probeSize;
+    isStructure = due->probeIsStructure;
+    due->probes++;
+    due->nextProbe = now + probeInterval;
+    pthread_mutex_unlock(&partnerMutex);
+    status = probePartner(partner, name, size, isStructure);
+    dprintf("Probe of \"%s\" on \"%s\" returned %d\n", name, partner, status);
+    pthread_mutex_lock(&partnerMutex);
+    due->lastProbeStatus = status;
+    if (status == DSM_SUCCESS) {
+      due->open = FALSE;
+      due->consecutiveFailures = 0;
+    }
+  }
+  proberRunning = FALSE;
+  pthread_cond_broadcast(&proberCond);
+  pthread_mutex_unlock(&partnerMutex);
+  return NULL;
+}
+
+/*
+  Waits for the breaker prober and any abandoned deadline calls to come
+  out of libdsm, which they do within its own RPC timeout, and closes every
+  breaker, so that a new connection starts afresh.   Call without the GIL.
+*/
+void stopPartnerThreads(void)
+{
+  int i;
+  partnerEntry *entry;
+
+  pthread_mutex_lock(&partnerMutex);
+  proberStopping = TRUE;
+  pthread_cond_broadcast(&proberCond);
+  while (proberRunning)
+    pthread_cond_wait(&proberCond, &partnerMutex);
+  proberStopping = FALSE;
+  for (i = 0; i < PARTNER_HASH_SIZE; i++)
+    for (entry = partners[i]; entry != NULL; entry = entry->nextInBucket) {
+      entry->open = FALSE;
+      entry->consecutiveFailures = 0;
+    }
+  pthread_mutex_unlock(&partnerMutex);
+  pthread_mutex_lock(&deadlineMutex);
+  while (nDeadlineWorkers > 0)
+    pthread_cond_wait(&deadlineIdleCond, &deadlineMutex);
+  pthread_mutex_unlock(&deadlineMutex);
+}
+
+/* Returns TRUE, counting a fast failure, if partner's breaker is open */
+int breakerOpen(char *partner)
+{
+  int open = FALSE;
+  partnerEntry *entry;
+
+  pthread_mutex_lock(&partnerMutex);
+  if ((breakerThreshold > 0) && ((entry = findPartner(partner, FALSE)) != NULL) && entry->open) {
+    entry->fastFails++;
+    open = TRUE;
+  }
+  pthread_mutex_unlock(&partnerMutex);
+  return open;
+}
+
+/* Counts the outcome of a call towards partner's breaker, opening it if need be */
+void recordOutcome(char *partner, char *name, int size, int isStructure, int status)
+{
+  pthread_t thread;
+  partnerEntry *entry;
+
+  if ((status != DSM_RPC_ERROR) && (status != DSM_TARGET_INVALID) && (status != DSM_TIMED_OUT)) {
+    pthread_mutex_lock(&partnerMutex);
+    if (((entry = findPartner(partner, FALSE)) != NULL) && !entry->open)
+      entry->consecutiveFailures = 0;
+    pthread_mutex_unlock(&partnerMutex);
+    return;
+  }
+  pthread_mutex_lock(&partnerMutex);
+  if ((entry = findPartner(partner, TRUE)) != NULL) {
+    entry->failures++;
+    if ((size > 0) || isStructure) {
+      strncpy(entry->probeName, name, DSM_NAME_LENGTH-1);
+      entry->probeSize = size;
+      entry->probeIsStructure = isStructure;
+    }
+    if ((++entry->consecutiveFailures >= breakerThreshold) && (breakerThreshold > 0) && !entry->open &&
+	(entry->probeName[0] != (char)0)) {
+      dprintf("Opening the breaker for \"%s\" after %d failures\n", partner, entry->consecutiveFailures);
+      entry->open = TRUE;
+      entry->trips++;
+      entry->openedAt = wallClock();
+      entry->nextProbe = entry->openedAt + probeInterval;
+      if (!proberRunning) {
+	if (pthread_create(&thread, NULL, partnerProber, NULL) == 0) {
+	  pthread_detach(thread);
+	  proberRunning = TRUE;
+	} else {
+	  fprintf(stderr, "Could not start the partner prober thread - leaving \"%s\" closed\n", partner);
+	  entry->open = FALSE;
+	}
+      }
+    }
+  }
+  pthread_mutex_unlock(&partnerMutex);
+}
+
+/* Safe with or without the GIL.   buf is a dsm_structure for structures, otherwise size bytes */
+int remoteCallWithin(int operation, char *partner, char *name, void *buf, int size, int isStructure,
+		     time_t *timestamp, double deadline)
+{
+  int status;
+
+  if (breakerOpen(partner))
+    return DSM_RPC_ERROR;
+  status = callWithin(operation, partner, name, buf, size, isStructure, timestamp, deadline);
+  recordOutcome(partner, name, size, isStructure, status);
+  return status;
+}
+
+int remoteCall(int operation, char *partner, char *name, void *buf, time_t *timestamp)
+{
+  return remoteCallWithin(operation, partner, name, buf, 0, FALSE, timestamp, 0.0);
+}
+
+/* Converts a timeout argument (None or seconds) to a deadline, returning -1 with an exception set if it's bad */
+double deadlineFor(PyObject *timeoutObject)
+{
+  double timeout;
+
+  if ((timeoutObject == NULL) || (timeoutObject == Py_None))
+    return 0.0;
+  timeout = PyFloat_AsDouble(timeoutObject);
+  if (PyErr_Occurred())
+    return -1.0;
+  if (timeout <= 0.0) {
+    PyErr_SetString(PyExc_ValueError, "timeout must be positive");
+    return -1.0;
+  }
+  return wallClock() + timeout;
+}
+
+PyObject *latencyDict(latencyStats *stats)
+{
+  return Py_BuildValue("{s:l,s:l,s:l,s:d,s:d,s:d,s:d}", "calls", stats->calls, "errors", stats->errors,
+		       "timeouts", stats->timeouts, "p50", latencyPercentile(stats, 0.5),
+		       "p99", latencyPercentile(stats, 0.99), "p999", latencyPercentile(stats, 0.999),
+		       "max", stats->maxLatency);
+}
+
+/* Returns {partner: {'read': {...}, 'write': {...}}} with call counts and latency percentiles in seconds */
+static PyObject *pydsm_partner_stats(PyObject *self)
+{
+  int i;
+  PyObject *statsDict, *item;
+  partnerEntry *entry;
+
+  if ((statsDict = PyDict_New()) == NULL)
+    return NULL;
+  pthread_mutex_lock(&partnerMutex);
+  for (i = 0; (i < PARTNER_HASH_SIZE) && (statsDict != NULL); i++)
+    for (entry = partners[i]; (entry != NULL) && (statsDict != NULL); entry = entry->nextInBucket) {
+      item = Py_BuildValue("{s:N,s:N}", "read", latencyDict(&entry->read), "write", latencyDict(&entry->write));
+      if ((item == NULL) || (PyDict_SetItemString(statsDict, entry->partner, item) != 0))
+	Py_CLEAR(statsDict);
+      Py_XDECREF(item);
+    }
+  pthread_mutex_unlock(&partnerMutex);
+  return statsDict;
+}
+
+/* Returns {partner: {...}} describing each partner's breaker */
+static PyObject *pydsm_partner_health(PyObject *self)
+{
+  int i;
+  PyObject *healthDict, *item;
+  partnerEntry *entry;
+
+  if ((healthDict = PyDict_New()) == NULL)
+    return NULL;
+  pthread_mutex_lock(&partnerMutex);
+  for (i = 0; (i < PARTNER_HASH_SIZE) && (healthDict != NULL); i++)
+    for (entry = partners[i]; (entry != NULL) && (healthDict != NULL); entry = entry->nextInBucket) {
+      item = Py_BuildValue("{s:s,s:i,s:l,s:l,s:l,s:l,s:d,s:i,s:i,s:l}", "state", entry->open ? "open" : "closed",
+			   "consecutive_failures", entry->consecutiveFailures, "failures", entry->failures,
+			   "trips", entry->trips, "fast_fails", entry->fastFails, "probes", entry->probes,
+			   "opened", entry->openedAt, "last_probe_status", entry->lastProbeStatus,
+			   "late_calls", entry->lateCalls, "late_refused", entry->lateRefused);
+      if ((item == NULL) || (PyDict_SetItemString(healthDict, entry->partner, item) != 0))
+	Py_CLEAR(healthDict);
+      Py_XDECREF(item);
+    }
+  pthread_mutex_unlock(&partnerMutex);
+  return healthDict;
+}
+
+/* Sets how many failures in a row open a breaker (0 for never) and how often an open one is probed */
+static PyObject *pydsm_breaker(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  int i, threshold;
+  double interval;
+  static char *keyWordList[] = {"threshold", "probe_interval", NULL};
+  partnerEntry *entry;
+
+  threshold = breakerThreshold;
+  interval = probeInterval;
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "|id", keyWordList, &threshold, &interval))
+    return NULL;
+  if ((threshold < 0) || (interval <= 0.0)) {
+    PyErr_SetString(PyExc_ValueError, "threshold must not be negative, and probe_interval must be positive");
+    return NULL;
+  }
+  pthread_mutex_lock(&partnerMutex);
+  breakerThreshold = threshold;
+  probeInterval = interval;
+  for (i = 0; i < PARTNER_HASH_SIZE; i++)
+    for (entry = partners[i]; entry != NULL; entry = entry->nextInBucket)
+      if (threshold == 0) {
+	entry->open = FALSE;
+	entry->consecutiveFailures = 0;
+      } else if (entry->nextProbe > wallClock() + interval)
+	entry->nextProbe = wallClock() + interval;
+  pthread_cond_signal(&proberCond);
+  pthread_mutex_unlock(&partnerMutex);
+  Py_RETURN_NONE;
+}
+
+PyObject *makePyObject(char *partner, dsm_structure *structure, char *name, char *buf, time_t theTime, int rM)
+{
+  int status, type, nDim;
+  int *dimensions = NULL;
+  time_t timestamp;
+  static PyObject **containerTupleBase = NULL;
+  PyObject *readTime, *makePyObjectTuple;
+
+  timestamp = theTime; /* Overwritten later, if dsm_read is actually called  */
+  if ((status = decodeObject(name, &type, &nDim, &dimensions)) != DSM_SUCCESS) {
+    fprintf(stderr, "Error %d returned by decodeObject (%s)\n", status, name);
+    if (dimensions != NULL)
+      pydsmFree(dimensions);
+    return NULL;
+  } else {
+    int size = 0;
+
+    /* OK we've successfully decoded the name. */
+    if (nDim == 0) {
+      int retInt;
       double retDouble;
       char *value = NULL;
       PyObject *retIntObject, *retDoubleObject;
 
-      if (dimensions != NULL) {
-	fprintf(stderr, "pydsm logic error: dimesion array has space, but nDim == 0\n");
-	exit(-1);
+      if (dimensions != NULL) {
+	fprintf(stderr, "pydsm logic error: dimesion array has space, but nDim == 0\n");
+	exit(-1);
+      }
+      /* It's a single variable */
+      switch (type) {
+      case DSM_BYTE:
+	size = sizeof(char);   break;
+      case DSM_SHORT:
+	size = sizeof(short);  break;
+      case DSM_LONG:
+	size = sizeof(int);    break;
+      case DSM_FLOAT:
+	size = sizeof(float);  break;
+      case DSM_DOUBLE:
+	size = sizeof(double); break;
+      default:
+	fprintf(stderr, "Could not handle type %d\n", type);
+	return NULL;
+      }
+      value = (char *)pydsmMalloc(size);
+      if (value == NULL) {
+	fprintf(stderr, "value pydsmMalloc");
+	PyErr_NoMemory();
+	return NULL;
+      }
+      if (buf != NULL) {
+	bcopy(buf, value, size);
+	status = DSM_SUCCESS;
+      } else if (structure != NULL)
+	status = dsm_structure_get_element(structure, name, &value[0]);
+      else
+	status = remoteCall(REMOTE_READ, partner, name, &value[0], &timestamp);
+      if (status != DSM_SUCCESS) {
+	pydsmFree(value);	
+	raiseDSMError(status, "read or get_element");
+	return NULL;
+      }
+      dprintf("dsm_read completed successfully, with a timestamp of %d\n", (int)timestamp);
+      makePyObjectTuple = PyTuple_New(2);
+      readTime = PyInt_FromLong((long)timestamp);
+      PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)1, readTime);
+      switch (type) {
+      case DSM_BYTE:
+	retInt = value[0];
+	pydsmFree(value);
+	dprintf("Got the byte 0x%x\n", retInt);
+	retIntObject = PyInt_FromLong((long)retInt);
+	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retIntObject);
+	return makePyObjectTuple;
+      case DSM_SHORT:
+	retInt = ((short *)value)[0];
+	pydsmFree(value);
+	dprintf("Got the short %d\n", retInt);
+	retIntObject = PyInt_FromLong((long)retInt);
+	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retIntObject);
+	return makePyObjectTuple;
+      case DSM_LONG:
+	retInt = ((int *)value)[0];
+	pydsmFree(value);
+	dprintf("Got the long %d\n", retInt);
+	retIntObject = PyInt_FromLong((long)retInt);
+	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retIntObject);
+	return makePyObjectTuple;
+      case DSM_FLOAT:
+	retDouble = ((float *)value)[0];
+	pydsmFree(value);
+	dprintf("Got the float %f\n", retDouble);
+	retDoubleObject = PyFloat_FromDouble(retDouble);
+	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retDoubleObject);
+	return makePyObjectTuple;
+      case DSM_DOUBLE:
+	retDouble = ((double *)value)[0];
+	pydsmFree(value);
+	dprintf("Got the double %f\n", retDouble);
+	retDoubleObject = PyFloat_FromDouble(retDouble);
+	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retDoubleObject);
+	return makePyObjectTuple;
+      }
+    } else {
+      /* Oh crap, it's an array */
+      if ((type == DSM_STRING) && (nDim == 1)) {
+	char *value;
+	PyObject *retStringObject;
+	
+	/* OK, this is the easiest case: a simple string of length dimensions[0] */
+	value = pydsmMalloc(dimensions[0]*sizeof(char));
+	if (value == NULL) {
+	  pydsmFree(dimensions);
+	  fprintf(stderr,"pydsmMalloc for string type");
+	  PyErr_NoMemory();
+	  return NULL;
+	}
+	if (buf != NULL) {
+	  bcopy(buf, value, dimensions[0]*sizeof(char));
+	} else if (structure != NULL)
+	  status = dsm_structure_get_element(structure, name, &value[0]);
+	else
+	  status = remoteCall(REMOTE_READ, partner, name, &value[0], &timestamp);
+	pydsmFree(dimensions);
+	if (status != DSM_SUCCESS) {
+	  pydsmFree(value);	
+	  raiseDSMError(status, "string DSM read or get_element");
+	  return NULL;
+	}
+	dprintf("dsm_read of string (%s) completed successfully, with a timestamp of %d\n", value, (int)timestamp);
+	makePyObjectTuple = PyTuple_New(2);
+	readTime = PyInt_FromLong((long)timestamp);
+	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)1, readTime);
+	retStringObject = PyString_FromString(value);
+	pydsmFree(value);
+	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retStringObject);
+	return makePyObjectTuple;
+      } else {
+	int i, arraySize, baseSize;
+	int nContainerTuples;
+	int stringSize = 0;
+	int j, offset;
+	char *arrayBase = NULL;
+	PyObject *myTuple;
+	
+	/* Here we handle nontrivial arrays - arrays other than simple character strings */
+	if (type == DSM_STRING) {
+	  stringSize = dimensions[0];
+	  for (i = 0; i < nDim-1; i++)
+	    dimensions[i] = dimensions[i+1];
+	  nDim -= 1;
+	}
+	dprintf("Nontrivial array of %d dimensions\n", nDim);
+	arraySize = 1;
+	for (i = 0; i < nDim; i++)
+	  arraySize *= dimensions[i];
+	dprintf("Full array size: %d\n", arraySize);
+	switch (type) {
+	case (DSM_BYTE):
+	  baseSize = 1; break;
+	case DSM_SHORT:
+	  baseSize = 2; break;
+	case DSM_LONG:
+	case DSM_FLOAT:
+	  baseSize = 4; break;
+	case DSM_STRING:
+	  baseSize = stringSize; break;
+	default:
+	  baseSize = 8;
+	}
+	arrayBase = pydsmMalloc(arraySize * baseSize);
+	if (arrayBase == NULL) {
+	  fprintf(stderr, "pydsmMalloc of arrayBase");
+	  pydsmFree(dimensions);
+	  PyErr_NoMemory();
+	  return NULL;
+	}
+	if (buf != NULL)
+	  bcopy(buf, &arrayBase[0], arraySize * baseSize);
+	else if (structure != NULL)
+	  status = dsm_structure_get_element(structure, name, &arrayBase[0]);
+	else
+	  status = remoteCall(REMOTE_READ, partner, name, &arrayBase[0], &timestamp);
+	if (status != DSM_SUCCESS) {
+	  pydsmFree(dimensions);
+	  pydsmFree(arrayBase);
+	  raiseDSMError(status, "array DSM read or get_element");
+	  return NULL;
+	}
+	dprintf("dsm_read of array completed successfully, with a timestamp of %d\n", (int)timestamp);
+	makePyObjectTuple = PyTuple_New(2);
+	readTime = PyInt_FromLong((long)timestamp);
+	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)1, readTime);
+
+	/* More than one dimension, so we need container tuples to contain the data tuples */
+	nContainerTuples = 0;
+	for (i = 0; i < nDim-1; i++) {
+	  offset = 1;
+	  for (j = 0; j < nDim - i - 1; j++)
+	    offset *= dimensions[j];
+	  nContainerTuples += offset;
+	}
+	nContainerTuples++;
+	dprintf("I will need %d container tuples\n", nContainerTuples);
+	containerTupleBase = (PyObject **)pydsmMalloc(nContainerTuples*sizeof(PyObject *));
+	if (containerTupleBase == NULL) {
+	  fprintf(stderr, "pydsmMalloc of container tuples");
+	  pydsmFree(dimensions);
+	  pydsmFree(arrayBase);
+	  Py_DECREF(makePyObjectTuple);
+	  PyErr_NoMemory();
+	  return NULL;
+	}
+	myTuple = buildTuples(containerTupleBase, 0, nDim, dimensions, type, baseSize, arrayBase);
+	pydsmFree(dimensions);
+	pydsmFree(arrayBase);
+	pydsmFree(containerTupleBase);
+	containerTupleBase = NULL;
+	if (myTuple == NULL) {
+	  Py_DECREF(makePyObjectTuple);
+	  return NULL;
+	}
+	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, myTuple);
+	return makePyObjectTuple;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Builds the {member: (value, timestamp)} dictionary for a structure which has been read */
+PyObject *structureToDict(char *partner, char *name, dsm_structure *structure, time_t timestamp)
+{
+  int i;
+  int nhosts;
+  char *member = NULL;
+  struct dsm_allocation_list *alp;
+  PyObject *item, *readTime, *key;
+  PyObject *handleStructureDict;
+
+  getAllocationList(&nhosts, &alp);
+  handleStructureDict = PyDict_New();
+  dprintf("nhosts = %d\n", nhosts);
+  for (i = 0; i < nhosts; i++) {
+    if (!strcmp(partner, alp[i].host_name)) {
+      int nEntries, j;
+
+      nEntries = alp[i].n_entries;
+      dprintf("Found my partner, with %d entries\n", nEntries);
+      for (j = 0; j < nEntries; j++) {
+	if (strstr(alp[i].alloc_list[j], name) == alp[i].alloc_list[j]) {
+	  member = &alp[i].alloc_list[j][strlen(name)+1];
+	  dprintf("Found member \"%s\"\n", member);
+	  if ((item = makePyObject(partner, structure, member, NULL, (time_t)0, FALSE)) == NULL) {
+	    Py_DECREF(handleStructureDict);
+	    return NULL;
+	  }
+	  else {
+	    readTime = PyInt_FromLong((long)timestamp);
+	    PyTuple_SetItem(item, (Py_ssize_t)1, readTime);
+	    if ((key = internedName(member)) == NULL) {
+	      Py_DECREF(item);
+	      Py_DECREF(handleStructureDict);
+	      return NULL;
+	    }
+	    PyDict_SetItem(handleStructureDict, key, item);
+	    Py_DECREF(key);
+	    Py_DECREF(item);
+	  }
+	}
+      }
+      break;
+    }
+  }
+  return handleStructureDict;
+}
+
+PyObject *handleStructure(char *partner, char *name, double deadline)
+{
+  int status;
+  dsm_structure structure;
+  PyObject *handleStructureDict;
+  time_t timestamp;
+
+  dprintf("in handleStructure(%s, %s)\n", partner, name);
+  status = dsm_structure_init(&structure, name);
+  if (status != DSM_SUCCESS) {
+    raiseDSMError(status, "init of structure");
+    return NULL;
+  }
+  status = remoteCallWithin(REMOTE_READ, partner, name, &structure, 0, TRUE, &timestamp, deadline);
+  if (status != DSM_SUCCESS) {
+    if (status != DSM_TIMED_OUT) /* Otherwise the late read still owns it */
+      dsm_structure_destroy(&structure);
+    raiseDSMError(status, "Read of structure");
+    return NULL;
+  }
+  handleStructureDict = structureToDict(partner, name, &structure, timestamp);
+  dsm_structure_destroy(&structure);
+  return handleStructureDict;
+}
+
+/*
+  Structure change tracking.   read_changes() keeps the raw image of each
+  structure it has read, its members laid end to end, and compares each
+  member's bytes with the previous image, e.g.
+    changes = pydsm.read_changes('crate1', 'CRATE_TO_HAL_X')
+  returns {member: (value, timestamp)} for only the members which differ,
+  so only those are converted to Python objects.   The first read of a
+  structure returns every member, as does the next one after a failed read.
+  Images are only touched with the GIL held.
+*/
+#define CHANGE_HASH_SIZE (64)
+
+typedef struct changeImage {
+  char partner[DSM_NAME_LENGTH];
+  char name[DSM_NAME_LENGTH];
+  int nMembers;
+  int size;
+  char **members;     /* Names from the allocation list, after the ':' */
+  int *offsets;       /* Member i is offsets[i] up to offsets[i+1] */
+  char *image;        /* The last value read */
+  char *scratch;      /* Where the next one is read to */
+  int valid;          /* image holds a value */
+  struct changeImage *nextInBucket;
+} changeImage;
+
+static changeImage *changeImages[CHANGE_HASH_SIZE];
+
+void freeChangeImage(changeImage *entry)
+{
+  pydsmFree(entry->members);
+  pydsmFree(entry->offsets);
+  pydsmFree(entry->image);
+  pydsmFree(entry->scratch);
+  pydsmFree(entry);
+}
+
+/* Returns the image kept for a structure, making it on first use, or NULL with an exception set */
+changeImage *findChangeImage(char *partner, char *name)
+{
+  int i, j, k, nhosts, length = strlen(name);
+  unsigned int bucket;
+  struct dsm_allocation_list *alp;
+  dsmDescriptor *descriptor;
+  changeImage *entry;
+
+  bucket = nameHash(partner, name) % CHANGE_HASH_SIZE;
+  for (entry = changeImages[bucket]; entry != NULL; entry = entry->nextInBucket)
+    if (!strcmp(entry->name, name) && !strcmp(entry->partner, partner))
+      return entry;
+  if ((entry = (changeImage *)pydsmCalloc(1, sizeof(changeImage))) == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  strcpy(entry->partner, partner);
+  strcpy(entry->name, name);
+  getAllocationList(&nhosts, &alp);
+  for (i = 0; i < nhosts; i++)
+    if (!strcmp(partner, alp[i].host_name))
+      break;
+  if (i < nhosts)
+    for (j = 0; j < alp[i].n_entries; j++)
+      if (!strncmp(alp[i].alloc_list[j], name, length) && (alp[i].alloc_list[j][length] == ':'))
+	entry->nMembers++;
+  if (entry->nMembers == 0) {
+    pydsmFree(entry);
+    raiseDSMError((i < nhosts) ? DSM_NAME_INVALID : DSM_TARGET_INVALID, "pydsm.read_changes()");
+    return NULL;
+  }
+  entry->members = (char **)pydsmMalloc(entry->nMembers*sizeof(char *));
+  entry->offsets = (int *)pydsmMalloc((entry->nMembers+1)*sizeof(int));
+  if ((entry->members == NULL) || (entry->offsets == NULL)) {
+    freeChangeImage(entry);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  for (j = k = 0; j < alp[i].n_entries; j++)
+    if (!strncmp(alp[i].alloc_list[j], name, length) && (alp[i].alloc_list[j][length] == ':')) {
+      entry->members[k] = &alp[i].alloc_list[j][length+1];
+      if ((descriptor = lookupDescriptor(entry->members[k])) == NULL) {
+	freeChangeImage(entry);
+	return NULL;
+      }
+      entry->offsets[k++] = entry->size;
+      entry->size += descriptor->size;
+    }
+  entry->offsets[k] = entry->size;
+  entry->image = pydsmMalloc(entry->size);
+  entry->scratch = pydsmMalloc(entry->size);
+  if ((entry->image == NULL) || (entry->scratch == NULL)) {
+    fprintf(stderr, "pydsmMalloc failure for the change image of \"%s\" (%d bytes)\n", name, entry->size);
+    freeChangeImage(entry);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  entry->nextInBucket = changeImages[bucket];
+  changeImages[bucket] = entry;
+  return entry;
+}
+
+PyObject *readChanges(char *partner, char *name, double deadline)
+{
+  int i, status;
+  char *swap;
+  time_t timestamp;
+  dsm_structure structure;
+  changeImage *entry;
+  PyObject *changesDict, *item, *key;
+
+  if ((entry = findChangeImage(partner, name)) == NULL)
+    return NULL;
+  if ((status = dsm_structure_init(&structure, name)) != DSM_SUCCESS) {
+    raiseDSMError(status, "init of structure");
+    return NULL;
+  }
+  status = remoteCallWithin(REMOTE_READ, partner, name, &structure, 0, TRUE, &timestamp, deadline);
+  if (status != DSM_SUCCESS) {
+    if (status != DSM_TIMED_OUT) /* Otherwise the late read still owns it */
+      dsm_structure_destroy(&structure);
+    entry->valid = FALSE;
+    raiseDSMError(status, "Read of structure");
+    return NULL;
+  }
+  for (i = 0; (i < entry->nMembers) && (status == DSM_SUCCESS); i++)
+    status = dsm_structure_get_element(&structure, entry->members[i], &entry->scratch[entry->offsets[i]]);
+  dsm_structure_destroy(&structure);
+  if (status != DSM_SUCCESS) {
+    entry->valid = FALSE;
+    raiseDSMError(status, "get_element");
+    return NULL;
+  }
+  if ((changesDict = PyDict_New()) == NULL)
+    return NULL;
+  for (i = 0; i < entry->nMembers; i++) {
+    if (entry->valid && !memcmp(&entry->image[entry->offsets[i]], &entry->scratch[entry->offsets[i]],
+				entry->offsets[i+1] - entry->offsets[i]))
+      continue;
+    item = makePyObject(partner, NULL, entry->members[i], &entry->scratch[entry->offsets[i]], timestamp, FALSE);
+    if ((item == NULL) || ((key = internedName(entry->members[i])) == NULL)) {
+      Py_XDECREF(item);
+      Py_DECREF(changesDict);
+      return NULL; /* The old image is kept, so these changes are returned next time */
+    }
+    PyDict_SetItem(changesDict, key, item);
+    Py_DECREF(key);
+    Py_DECREF(item);
+  }
+  swap = entry->image;
+  entry->image = entry->scratch;
+  entry->scratch = swap;
+  entry->valid = TRUE;
+  dprintf("read_changes(%s, %s) found %d of %d members changed\n", partner, name, (int)PyDict_Size(changesDict),
+	  entry->nMembers);
+  return changesDict;
+}
+
+static PyObject *pydsm_read_changes(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  double deadline;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  static char *keyWordList[] = {"partner", "name", "timeout", NULL};
+  PyObject *timeoutObject = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "O&O&|O", keyWordList, partnerConverter, partner,
+				   nameConverter, name, &timeoutObject))
+    return NULL;
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  if ((deadline = deadlineFor(timeoutObject)) < 0.0)
+    return NULL;
+  if ((name[0] == (char)0) || (name[strlen(name)-1] != 'X')) {
+    PyErr_SetString(dSMNotImplemented, "DSM error: read_changes only reads structures");
+    return NULL;
+  }
+  return readChanges(partner, name, deadline);
+}
+
+/*
+  Reductions over array variables, computed straight from the raw buffer
+  instead of from the tuples buildTuples would make.   Each kernel keeps
+  REDUCE_LANES independent partial results, which lets the compiler turn
+  the loops into SSE/AVX (or NEON) code without having to reorder any
+  floating point sums; the leftover elements go through the same code one
+  at a time.   On x86-64 an AVX2 clone of each kernel is built as well and
+  picked at load time if the CPU supports it.   NaNs are counted, and
+  otherwise ignored by min, max, sum, mean and std.   The sums are taken
+  of each element's difference from the first valid one, so that std keeps
+  its precision when the spread is small next to the values themselves.
+*/
+#define REDUCE_LANES (8)
+
+#define REDUCE_MIN       (1)
+#define REDUCE_MAX       (2)
+#define REDUCE_SUM       (4)
+#define REDUCE_MEAN      (8)
+#define REDUCE_STD       (16)
+#define REDUCE_NAN_COUNT (32)
+
+#if defined(__x86_64__) && defined(__GNUC__) && (__GNUC__ >= 6) && !defined(__clang__)
+#define REDUCE_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define REDUCE_CLONES
+#endif
+
+typedef struct {
+  double min;
+  double max;
+  double shift;       /* Subtracted from each element before it's summed */
+  double sum;
+  double sumSquares;
+  long nNaN;
+  long nValid;
+} reduction;
+
+/* Reduces n contiguous elements */
+#define CONTIGUOUS_KERNEL(kernelName, cType)					\
+REDUCE_CLONES void kernelName(const cType *data, long n, reduction *result)	\
+{										\
+  long i, j;									\
+  double minLane[REDUCE_LANES], maxLane[REDUCE_LANES];				\
+  double sumLane[REDUCE_LANES], squareLane[REDUCE_LANES];			\
+  long nanLane[REDUCE_LANES];							\
+  double shift;									\
+										\
+  for (i = 0; (i < n) && (data[i] != data[i]); i++)				\
+    ;										\
+  shift = (i < n) ? (double)data[i] : 0.0;					\
+  for (j = 0; j < REDUCE_LANES; j++) {						\
+    minLane[j] = HUGE_VAL;							\
+    maxLane[j] = -HUGE_VAL;							\
+    sumLane[j] = squareLane[j] = 0.0;						\
+    nanLane[j] = 0;								\
+  }										\
+  for (i = 0; i + REDUCE_LANES <= n; i += REDUCE_LANES)				\
+    for (j = 0; j < REDUCE_LANES; j++) {					\
+      double x = (double)data[i+j];						\
+      int isNaN = (x != x);							\
+										\
+      minLane[j] = (x < minLane[j]) ? x : minLane[j];				\
+      maxLane[j] = (x > maxLane[j]) ? x : maxLane[j];				\
+      x = isNaN ? 0.0 : x - shift;						\
+      sumLane[j] += x;								\
+      squareLane[j] += x*x;							\
+      nanLane[j] += isNaN;							\
+    }										\
+  for (j = 0; i < n; i++, j++) {						\
+    double x = (double)data[i];							\
+    int isNaN = (x != x);							\
+										\
+    minLane[j] = (x < minLane[j]) ? x : minLane[j];				\
+    maxLane[j] = (x > maxLane[j]) ? x : maxLane[j];				\
+    x = isNaN ? 0.0 : x - shift;						\
+    sumLane[j] += x;								\
+    squareLane[j] += x*x;							\
+    nanLane[j] += isNaN;							\
+  }										\
+  result->min = HUGE_VAL;							\
+  result->max = -HUGE_VAL;							\
+  result->shift = shift;							\
+  result->sum = result->sumSquares = 0.0;					\
+  result->nNaN = 0;								\
+  for (j = 0; j < REDUCE_LANES; j++) {						\
+    if (minLane[j] < result->min)						\
+      result->min = minLane[j];							\
+    if (maxLane[j] > result->max)						\
+      result->max = maxLane[j];							\
+    result->sum += sumLane[j];							\
+    result->sumSquares += squareLane[j];					\
+    result->nNaN += nanLane[j];							\
+  }										\
+  result->nValid = n - result->nNaN;						\
+}
+
+/*
+  Reduces along an axis which isn't the last one: data holds length rows
+  of inner contiguous elements, and each of the inner columns is reduced
+  into results[column].   The loop over columns is the vectorised one.
+*/
+#define COLUMN_KERNEL(kernelName, cType)						\
+REDUCE_CLONES void kernelName(const cType *data, long length, long inner,	\
+			      double *minimum, double *maximum, double *shift,		\
+			      double *sum, double *sumSquares, long *nNaN)		\
+{										\
+  long row, k;									\
+										\
+  for (k = 0; k < inner; k++) {							\
+    for (row = 0; (row < length) && (data[row*inner+k] != data[row*inner+k]); row++) \
+      ;										\
+    shift[k] = (row < length) ? (double)data[row*inner+k] : 0.0;		\
+    minimum[k] = HUGE_VAL;							\
+    maximum[k] = -HUGE_VAL;							\
+    sum[k] = sumSquares[k] = 0.0;						\
+    nNaN[k] = 0;								\
+  }										\
+  for (row = 0; row < length; row++) {						\
+    const cType *rowData = &data[row*inner];					\
+										\
+    for (k = 0; k < inner; k++) {						\
+      double x = (double)rowData[k];						\
+      int isNaN = (x != x);							\
+										\
+      minimum[k] = (x < minimum[k]) ? x : minimum[k];				\
+      maximum[k] = (x > maximum[k]) ? x : maximum[k];				\
+      x = isNaN ? 0.0 : x - shift[k];						\
+      sum[k] += x;								\
+      sumSquares[k] += x*x;							\
+      nNaN[k] += isNaN;								\
+    }										\
+  }										\
+}
+
+CONTIGUOUS_KERNEL(reduceBytes, signed char)
+CONTIGUOUS_KERNEL(reduceShorts, short)
+CONTIGUOUS_KERNEL(reduceLongs, int)
+CONTIGUOUS_KERNEL(reduceFloats, float)
+CONTIGUOUS_KERNEL(reduceDoubles, double)
+COLUMN_KERNEL(reduceByteColumns, signed char)
+COLUMN_KERNEL(reduceShortColumns, short)
+COLUMN_KERNEL(reduceLongColumns, int)
+COLUMN_KERNEL(reduceFloatColumns, float)
+COLUMN_KERNEL(reduceDoubleColumns, double)
+
+void reduceContiguous(int type, char *data, long n, reduction *result)
+{
+  switch (type) {
+  case DSM_BYTE:
+    reduceBytes((signed char *)data, n, result); break;
+  case DSM_SHORT:
+    reduceShorts((short *)data, n, result); break;
+  case DSM_LONG:
+    reduceLongs((int *)data, n, result); break;
+  case DSM_FLOAT:
+    reduceFloats((float *)data, n, result); break;
+  default:
+    reduceDoubles((double *)data, n, result);
+  }
+}
+
+void reduceColumns(int type, char *data, long length, long inner, reduction *results, double *scratch, long *nanScratch)
+{
+  long k;
+  double *minimum = scratch, *maximum = &scratch[inner], *shift = &scratch[2*inner];
+  double *sum = &scratch[3*inner], *sumSquares = &scratch[4*inner];
+
+  switch (type) {
+  case DSM_BYTE:
+    reduceByteColumns((signed char *)data, length, inner, minimum, maximum, shift, sum, sumSquares, nanScratch); break;
+  case DSM_SHORT:
+    reduceShortColumns((short *)data, length, inner, minimum, maximum, shift, sum, sumSquares, nanScratch); break;
+  case DSM_LONG:
+    reduceLongColumns((int *)data, length, inner, minimum, maximum, shift, sum, sumSquares, nanScratch); break;
+  case DSM_FLOAT:
+    reduceFloatColumns((float *)data, length, inner, minimum, maximum, shift, sum, sumSquares, nanScratch); break;
+  default:
+    reduceDoubleColumns((double *)data, length, inner, minimum, maximum, shift, sum, sumSquares, nanScratch);
+  }
+  for (k = 0; k < inner; k++) {
+    results[k].min = minimum[k];
+    results[k].max = maximum[k];
+    results[k].shift = shift[k];
+    results[k].sum = sum[k];
+    results[k].sumSquares = sumSquares[k];
+    results[k].nNaN = nanScratch[k];
+    results[k].nValid = length - nanScratch[k];
+  }
+}
+
+/* One statistic from a reduction, NaN if there were no valid elements */
+double reductionValue(reduction *result, int op)
+{
+  double offset, variance;
+
+  if ((result->nValid == 0) && (op != REDUCE_SUM))
+    return NAN;
+  switch (op) {
+  case REDUCE_MIN:
+    return result->min;
+  case REDUCE_MAX:
+    return result->max;
+  case REDUCE_SUM:
+    return result->sum + result->shift*(double)result->nValid;
+  case REDUCE_MEAN:
+    return result->shift + result->sum / (double)result->nValid;
+  default:
+    offset = result->sum / (double)result->nValid; /* The mean's difference from shift */
+    variance = result->sumSquares / (double)result->nValid - offset*offset;
+    return (variance > 0.0) ? sqrt(variance) : 0.0;
+  }
+}
+
+/* Builds nested tuples, shaped by dimensions, from a flat array of elements of type */
+PyObject *arrayToTuples(char *array, int type, int baseSize, int nDim, int *dimensions)
+{
+  int i, j, offset, nContainerTuples;
+  PyObject **containerTupleBase, *tuples;
+
+  nContainerTuples = 1;
+  for (i = 0; i < nDim-1; i++) {
+    offset = 1;
+    for (j = 0; j < nDim - i - 1; j++)
+      offset *= dimensions[j];
+    nContainerTuples += offset;
+  }
+  containerTupleBase = (PyObject **)pydsmMalloc(nContainerTuples*sizeof(PyObject *));
+  if (containerTupleBase == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  tuples = buildTuples(containerTupleBase, 0, nDim, dimensions, type, baseSize, array);
+  pydsmFree(containerTupleBase);
+  return tuples;
+}
+
+/*
+  Reads the raw value of a non-structure variable.   Every plain read goes
+  through here, so that it can be served from the snapshot region.
+*/
+int readRawWithin(char *partner, char *name, char *buf, int size, time_t *timestamp, double deadline)
+{
+  int status, subscribed;
+  unsigned long generation = 0;
+
+  if ((subscribed = cacheLookup(partner, name, buf, size, timestamp, &generation)) > 0) {
+    dprintf("Read \"%s\" on \"%s\" from the subscription table\n", name, partner);
+    status = DSM_SUCCESS;
+  } else if (shmLookup(partner, name, buf, size, timestamp)) {
+    dprintf("Read \"%s\" on \"%s\" from the snapshot region\n", name, partner);
+    status = DSM_SUCCESS;
+  } else {
+    status = remoteCallWithin(REMOTE_READ, partner, name, buf, size, FALSE, timestamp, deadline);
+    if (status == DSM_SUCCESS) {
+      shmPublish(partner, name, buf, size, *timestamp);
+      if (subscribed == 0)
+	cacheStore(partner, name, buf, size, *timestamp, generation);
+      historyRecord(partner, name, buf, size, wallClock());
+    }
+  }
+  return status;
+}
+
+int readRaw(char *partner, char *name, char *buf, int size, time_t *timestamp)
+{
+  return readRawWithin(partner, name, buf, size, timestamp, 0.0);
+}
+
+PyObject *readPyObject(char *partner, char *name, double deadline)
+{
+  int status, size;
+  char *buf;
+  time_t timestamp;
+  PyObject *readTuple;
+
+  if ((size = objectSize(name)) < 0)
+    return NULL;
+  buf = pydsmMalloc(size);
+  if (buf == NULL) {
+    fprintf(stderr, "pydsmMalloc failure for read buffer of \"%s\"\n", name);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  status = readRawWithin(partner, name, buf, size, &timestamp, deadline);
+  if (status != DSM_SUCCESS) {
+    pydsmFree(buf);
+    raiseDSMError(status, "dsm_read()");
+    return NULL;
+  }
+  readTuple = makePyObject(partner, NULL, name, buf, timestamp, FALSE);
+  pydsmFree(buf);
+  return readTuple;
+}
+
+/* Converts a single raw element to a Python object */
+PyObject *elementObject(int type, int elementSize, char *element)
+{
+  switch (type) {
+  case DSM_BYTE:
+    return PyInt_FromLong((long)element[0]);
+  case DSM_SHORT:
+    return PyInt_FromLong((long)*((short *)element));
+  case DSM_LONG:
+    return PyInt_FromLong((long)*((int *)element));
+  case DSM_FLOAT:
+    return PyFloat_FromDouble((double)*((float *)element));
+  case DSM_STRING:
+    return PyString_FromStringAndSize(element, strnlen(element, elementSize));
+  default:
+    return PyFloat_FromDouble(*((double *)element));
+  }
+}
+
+/*
+  Reads part of an array variable.   index is an int, a slice, or a tuple
+  of them, applied to the leading dimensions (a string's length is not a
+  dimension).   Ints drop their dimension from the result.   The whole
+  variable still has to be fetched, but only the selected elements are
+  gathered from the raw buffer and converted.
+*/
+PyObject *readSelection(char *partner, char *name, PyObject *indexObject, double deadline)
+{
+  int i, nIndices, nSelected = 0, status;
+  int selectedDims[16];
+  char *buf, *gathered, *out;
+  long nGathered, element, run, offset;
+  Py_ssize_t start[16], step[16], count[16], position[16], stride[16];
+  Py_ssize_t stop, length;
+  time_t timestamp;
+  dsmDescriptor *descriptor;
+  PyObject *item, *value;
+
+  if ((descriptor = lookupDescriptor(name)) == NULL)
+    return NULL;
+  if (descriptor->type == DSM_STRUCTURE) {
+    PyErr_SetString(dSMNotImplemented, "DSM error: index can't be used when reading a structure");
+    return NULL;
+  }
+  nIndices = PyTuple_Check(indexObject) ? (int)PyTuple_GET_SIZE(indexObject) : 1;
+  if ((nIndices > descriptor->nDim) || (descriptor->nDim > 16)) {
+    PyErr_SetString(dSMRangeError, "DSM error: too many indices for variable");
+    return NULL;
+  }
+  for (i = descriptor->nDim-1; i >= 0; i--)
+    stride[i] = (i == descriptor->nDim-1) ? 1 : stride[i+1]*descriptor->dimensions[i+1];
+  nGathered = 1;
+  for (i = 0; i < descriptor->nDim; i++) {
+    length = descriptor->dimensions[i];
+    item = (i >= nIndices) ? NULL : (PyTuple_Check(indexObject) ? PyTuple_GET_ITEM(indexObject, i) : indexObject);
+    if ((item == NULL) || PySlice_Check(item)) {
+      if (item == NULL) {
+	start[i] = 0;
+	step[i] = 1;
+	count[i] = length;
+      } else if (PySlice_GetIndicesEx(SLICE_OBJECT(item), length, &start[i], &stop, &step[i], &count[i]) != 0)
+	return NULL;
+      selectedDims[nSelected++] = (int)count[i];
+    } else {
+      start[i] = PyInt_AsSsize_t(item);
+      if ((start[i] == -1) && PyErr_Occurred())
+	return NULL;
+      if (start[i] < 0)
+	start[i] += length;
+      if ((start[i] < 0) || (start[i] >= length)) {
+	PyErr_Format(dSMRangeError, "DSM error: index %d is out of range for dimension %d of \"%s\"", (int)start[i], i, name);
+	return NULL;
+      }
+      step[i] = 1;
+      count[i] = 1;
+    }
+    nGathered *= count[i];
+  }
+  buf = pydsmMalloc(descriptor->size);
+  gathered = pydsmMalloc((nGathered > 0) ? nGathered*descriptor->elementSize : 1);
+  if ((buf == NULL) || (gathered == NULL)) {
+    pydsmFree(buf);
+    pydsmFree(gathered);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  status = readRawWithin(partner, name, buf, descriptor->size, &timestamp, deadline);
+  if (status != DSM_SUCCESS) {
+    pydsmFree(buf);
+    pydsmFree(gathered);
+    raiseDSMError(status, "dsm_read() for index");
+    return NULL;
+  }
+  /* Walk the selection odometer-style, copying runs along the last dimension */
+  out = gathered;
+  if (descriptor->nDim == 0) {
+    bcopy(buf, out, descriptor->size);
+  } else if (nGathered > 0) {
+    int last = descriptor->nDim-1;
+
+    for (i = 0; i < descriptor->nDim; i++)
+      position[i] = 0;
+    run = (step[last] == 1) ? count[last] : 1;
+    for (element = 0; element < nGathered; element += run) {
+      offset = 0;
+      for (i = 0; i < descriptor->nDim; i++)
+	offset += (start[i] + position[i]*step[i])*stride[i];
+      bcopy(&buf[offset*descriptor->elementSize], out, run*descriptor->elementSize);
+      out += run*descriptor->elementSize;
+      position[last] += run;
+      for (i = last; (i > 0) && (position[i] >= count[i]); i--) {
+	position[i] = 0;
+	position[i-1]++;
+      }
+    }
+  }
+  pydsmFree(buf);
+  if (nSelected == 0)
+    value = elementObject(descriptor->type, descriptor->elementSize, gathered);
+  else
+    value = arrayToTuples(gathered, descriptor->type, descriptor->elementSize, nSelected, selectedDims);
+  pydsmFree(gathered);
+  if (value == NULL)
+    return NULL;
+  return Py_BuildValue("(Nl)", value, (long)timestamp);
+}
+
+/*
+  METH_FASTCALL entry points.   The arguments arrive as a C array, with
+  keyword names in kwNames, and unpackArguments sorts them into parameter
+  order.   The parameter names are interned when the module is loaded,
+  and so are the keyword names the interpreter passes, so they nearly
+  always match on the pointer alone.   Each entry point then does the
+  same as its METH_VARARGS twin, which Python 2 (and 3.6) still use.
+*/
+enum {KEY_PARTNER, KEY_NAME, KEY_INDEX, KEY_TIMEOUT, KEY_DATA, KEY_NOTIFY, KEY_PARTNERS, KEY_MAX_PARALLEL,
+      KEY_MAX_EVENTS, N_KEYS};
+
+static char *keyText[N_KEYS] = {"partner", "name", "index", "timeout", "data", "notify", "partners", "max_parallel",
+				"max_events"};
+static PyObject *parameterNames[N_KEYS];
+
+int internKeys(void)
+{
+  int i;
+
+  for (i = 0; i < N_KEYS; i++)
+    if ((parameterNames[i] = PyString_InternFromString(keyText[i])) == NULL)
+      return DSM_ERROR;
+  return DSM_SUCCESS;
+}
+
+#ifdef PYDSM_FASTCALL
+/* Fills values with borrowed references to the arguments for each of parameters, or NULL for those not given */
+int unpackArguments(char *function, PyObject *const *args, Py_ssize_t nArgs, PyObject *kwNames, int nRequired,
+		    int nParameters, int *parameters, PyObject **values)
+{
+  int i, j, nKeyWords;
+  PyObject *keyWord;
+
+  if (nArgs > nParameters) {
+    PyErr_Format(PyExc_TypeError, "%s() takes at most %d arguments (%d given)", function, nParameters, (int)nArgs);
+    return FALSE;
+  }
+  for (j = 0; j < nParameters; j++)
+    values[j] = (j < nArgs) ? args[j] : NULL;
+  nKeyWords = (kwNames == NULL) ? 0 : (int)PyTuple_GET_SIZE(kwNames);
+  for (i = 0; i < nKeyWords; i++) {
+    keyWord = PyTuple_GET_ITEM(kwNames, i);
+    for (j = 0; (j < nParameters) && (keyWord != parameterNames[parameters[j]]); j++);
+    if (j == nParameters)
+      for (j = 0; (j < nParameters) && PyUnicode_Compare(keyWord, parameterNames[parameters[j]]); j++);
+    if (j == nParameters) {
+      PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'", function, keyWord);
+      return FALSE;
+    }
+    if (values[j] != NULL) {
+      PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%U'", function, keyWord);
+      return FALSE;
+    }
+    values[j] = args[nArgs+i];
+  }
+  for (j = 0; j < nRequired; j++)
+    if (values[j] == NULL) {
+      PyErr_Format(PyExc_TypeError, "%s() missing required argument '%U'", function, parameterNames[parameters[j]]);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* The value of an optional argument, or defaultValue if it wasn't given */
+#define ARGUMENT(value, defaultValue) (((value) != NULL) ? (value) : (defaultValue))
+#endif
+
+PyObject *readVariable(char *partner, char *name, PyObject *indexObject, PyObject *timeoutObject)
+{
+  double deadline;
+
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  if ((deadline = deadlineFor(timeoutObject)) < 0.0)
+    return NULL;
+  if (name[0] == (char)0) {
+    PyErr_SetString(dSMIllegalName, "DSM error: Illegal Name");
+    return NULL;
+  }
+  if (indexObject != Py_None)
+    return readSelection(partner, name, indexObject, deadline);
+  else if (name[strlen(name)-1] == 'X')
+    return handleStructure(partner, name, deadline);
+  else
+    return readPyObject(partner, name, deadline);
+}
+
+#ifndef PYDSM_FASTCALL
+static PyObject *pydsm_read(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  static char *keyWordList[] = {"partner", "name", "index", "timeout", NULL};
+  PyObject *indexObject = Py_None, *timeoutObject = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "O&O&|OO", keyWordList, partnerConverter, partner,
+				   nameConverter, name, &indexObject, &timeoutObject))
+    return NULL;
+  return readVariable(partner, name, indexObject, timeoutObject);
+}
+#else
+static PyObject *pydsm_read_fast(PyObject *self, PyObject *const *args, Py_ssize_t nArgs, PyObject *kwNames)
+{
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  static int parameters[] = {KEY_PARTNER, KEY_NAME, KEY_INDEX, KEY_TIMEOUT};
+  PyObject *values[4];
+
+  if (!unpackArguments("read", args, nArgs, kwNames, 2, 4, parameters, values) ||
+      !partnerConverter(values[0], partner) || !nameConverter(values[1], name))
+    return NULL;
+  return readVariable(partner, name, ARGUMENT(values[2], Py_None), ARGUMENT(values[3], Py_None));
+}
+#endif
+
+/*
+  Calls to several partners at once.   runParallel hands the jobs out to
+  up to maxParallel threads, the calling thread included, and returns when
+  they have all been done.   It must be called without the GIL, and the
+  work function must not touch any Python object.   This relies on libdsm
+  allowing calls from several threads at once, which it does since each
+  call makes its own RPC.
+*/
+#define MAX_PARALLEL     (64)
+#define DEFAULT_PARALLEL (16)
+
+typedef void (*parallelWork)(void *job);
+
+typedef struct {
+  parallelWork work;
+  char *jobs;
+  size_t jobSize;
+  int nJobs;
+  int nextJob;
+} parallelBatch;
+
+void *parallelWorker(void *arg)
+{
+  int i;
+  parallelBatch *batch = (parallelBatch *)arg;
+
+  while ((i = __sync_fetch_and_add(&batch->nextJob, 1)) < batch->nJobs)
+    batch->work(&batch->jobs[(size_t)i*batch->jobSize]);
+  return NULL;
+}
+
+void runParallel(parallelWork work, void *jobs, size_t jobSize, int nJobs, int maxParallel)
+{
+  int i, nThreads = 0;
+  pthread_t threads[MAX_PARALLEL];
+  parallelBatch batch;
+
+  batch.work = work;
+  batch.jobs = (char *)jobs;
+  batch.jobSize = jobSize;
+  batch.nJobs = nJobs;
+  batch.nextJob = 0;
+  if (maxParallel > MAX_PARALLEL)
+    maxParallel = MAX_PARALLEL;
+  /* If a thread can't be started, the ones which did (or just this one) do its share */
+  for (i = 1; (i < maxParallel) && (i < nJobs); i++)
+    if (pthread_create(&threads[nThreads], NULL, parallelWorker, &batch) == 0)
+      nThreads++;
+  parallelWorker(&batch);
+  for (i = 0; i < nThreads; i++)
+    pthread_join(threads[i], NULL);
+}
+
+/* Takes the pending Python exception, and returns it as an exception instance */
+PyObject *fetchException(void)
+{
+  PyObject *type, *value, *traceback;
+
+  PyErr_Fetch(&type, &value, &traceback);
+  PyErr_NormalizeException(&type, &value, &traceback);
+  Py_XDECREF(type);
+  Py_XDECREF(traceback);
+  if (value == NULL) {
+    Py_INCREF(Py_None);
+    value = Py_None;
+  }
+  return value;
+}
+
+/* The exception instance raiseDSMError would raise, without raising it */
+PyObject *dsmErrorObject(int status, char *message)
+{
+  raiseDSMError(status, message);
+  return fetchException();
+}
+
+/* Copies and case-fixes a partner name, returning DSM_ERROR if it's too long */
+int copyPartner(char *dest, char *partner)
+{
+  int i;
+
+  if (strlen(partner) >= DSM_NAME_LENGTH) {
+    PyErr_SetString(dSMIllegalName, "DSM error: partner name is too long");
+    return DSM_ERROR;
+  }
+  for (i = 0; partner[i]; i++)
+    dest[i] = tolower(partner[i]);
+  dest[i] = (char)0;
+  return DSM_SUCCESS;
+}
+
+/* A list of the hosts whose allocation list includes "name" (or members of it, for a structure) */
+PyObject *hostsWithAllocation(char *name)
+{
+  int i, j, length = strlen(name);
+  int nhosts;
+  char *entry;
+  struct dsm_allocation_list *alp;
+  PyObject *hosts, *host;
+
+  getAllocationList(&nhosts, &alp);
+  if ((hosts = PyList_New(0)) == NULL)
+    return NULL;
+  for (i = 0; i < nhosts; i++)
+    for (j = 0; j < alp[i].n_entries; j++) {
+      entry = alp[i].alloc_list[j];
+      if (!strncmp(entry, name, length) && ((entry[length] == (char)0) || (name[length-1] == 'X'))) {
+	host = PyString_FromString(alp[i].host_name);
+	if ((host == NULL) || (PyList_Append(hosts, host) != 0)) {
+	  Py_XDECREF(host);
+	  Py_DECREF(hosts);
+	  return NULL;
+	}
+	Py_DECREF(host);
+	break;
+      }
+    }
+  return hosts;
+}
+
+typedef struct {
+  char partner[DSM_NAME_LENGTH];
+  char *name;
+  int size;
+  int isStructure;
+  int ready;  /* FALSE if setting up the job failed, and status says why */
+  char *buf;
+  dsm_structure structure;
+  int status;
+  time_t timestamp;
+  double deadline;  /* Shared by every job, 0 for none */
+} readJob;
+
+void readJobWork(void *arg)
+{
+  readJob *job = (readJob *)arg;
+
+  if (!job->ready)
+    return;
+  if (job->isStructure) {
+    job->status = remoteCallWithin(REMOTE_READ, job->partner, job->name, &job->structure, 0, TRUE,
+				   &job->timestamp, job->deadline);
+    if (job->status == DSM_TIMED_OUT)
+      job->ready = FALSE; /* The late read still owns the structure */
+  } else
+    job->status = readRawWithin(job->partner, job->name, job->buf, job->size, &job->timestamp, job->deadline);
+}
+
+PyObject *readAll(char *name, PyObject *partnersObject, int maxParallel, PyObject *timeoutObject)
+{
+  int i, nJobs, size = 0;
+  int isStructure;
+  double deadline;
+  char *partner;
+  PyObject *partnerSequence, *partnerObject, *resultDict, *value;
+  readJob *jobs;
+
+  if ((deadline = deadlineFor(timeoutObject)) < 0.0)
+    return NULL;
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  if (name[0] == (char)0) {
+    PyErr_SetString(dSMIllegalName, "DSM error: Illegal Name");
+    return NULL;
+  }
+  isStructure = (name[strlen(name)-1] == 'X');
+  if (!isStructure && ((size = objectSize(name)) < 0))
+    return NULL;
+  if (partnersObject == Py_None)
+    partnerSequence = hostsWithAllocation(name);
+  else
+    partnerSequence = PySequence_Fast(partnersObject, "partners must be a sequence of host names");
+  if (partnerSequence == NULL)
+    return NULL;
+  nJobs = (int)PySequence_Fast_GET_SIZE(partnerSequence);
+  jobs = (readJob *)pydsmMalloc((nJobs > 0 ? nJobs : 1)*sizeof(readJob));
+  if (jobs == NULL) {
+    Py_DECREF(partnerSequence);
+    return PyErr_NoMemory();
+  }
+  bzero(jobs, (nJobs > 0 ? nJobs : 1)*sizeof(readJob));
+  for (i = 0; i < nJobs; i++) {
+    if (((partner = pyText(PySequence_Fast_GET_ITEM(partnerSequence, i))) == NULL) ||
+	(copyPartner(jobs[i].partner, partner) != DSM_SUCCESS)) {
+      nJobs = i;
+      resultDict = NULL;
+      goto cleanUp;
+    }
+    jobs[i].name = name;
+    jobs[i].size = size;
+    jobs[i].isStructure = isStructure;
+    jobs[i].deadline = deadline;
+    if (isStructure)
+      jobs[i].status = dsm_structure_init(&jobs[i].structure, name);
+    else if ((jobs[i].buf = pydsmMalloc(size)) == NULL)
+      jobs[i].status = DSM_NO_RESOURCE;
+    jobs[i].ready = (jobs[i].status == DSM_SUCCESS);
+  }
+  dprintf("pydsm_read_all: reading \"%s\" from %d partners, %d at a time\n", name, nJobs, maxParallel);
+  Py_BEGIN_ALLOW_THREADS
+  runParallel(readJobWork, jobs, sizeof(readJob), nJobs, maxParallel);
+  Py_END_ALLOW_THREADS
+  resultDict = PyDict_New();
+  for (i = 0; (i < nJobs) && (resultDict != NULL); i++) {
+    if (jobs[i].status != DSM_SUCCESS)
+      value = dsmErrorObject(jobs[i].status, "pydsm_read_all");
+    else {
+      if (isStructure)
+	value = structureToDict(jobs[i].partner, name, &jobs[i].structure, jobs[i].timestamp);
+      else
+	value = makePyObject(jobs[i].partner, NULL, name, jobs[i].buf, jobs[i].timestamp, FALSE);
+      if (value == NULL)
+	value = fetchException();
+    }
+    partnerObject = PySequence_Fast_GET_ITEM(partnerSequence, i);
+    if (PyDict_SetItem(resultDict, partnerObject, value) != 0)
+      Py_CLEAR(resultDict);
+    Py_DECREF(value);
+  }
+ cleanUp:
+  for (i = 0; i < nJobs; i++) {
+    if (isStructure && jobs[i].ready)
+      dsm_structure_destroy(&jobs[i].structure);
+    pydsmFree(jobs[i].buf);
+  }
+  pydsmFree(jobs);
+  Py_DECREF(partnerSequence);
+  return resultDict;
+}
+
+#ifndef PYDSM_FASTCALL
+static PyObject *pydsm_read_all(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  int maxParallel = DEFAULT_PARALLEL;
+  char name[DSM_NAME_LENGTH];
+  static char *keyWordList[] = {"name", "partners", "max_parallel", "timeout", NULL};
+  PyObject *partnersObject = Py_None, *timeoutObject = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "O&|OiO", keyWordList, nameConverter, name, &partnersObject,
+				   &maxParallel, &timeoutObject))
+    return NULL;
+  return readAll(name, partnersObject, maxParallel, timeoutObject);
+}
+#else
+static PyObject *pydsm_read_all_fast(PyObject *self, PyObject *const *args, Py_ssize_t nArgs, PyObject *kwNames)
+{
+  long maxParallel = DEFAULT_PARALLEL;
+  char name[DSM_NAME_LENGTH];
+  static int parameters[] = {KEY_NAME, KEY_PARTNERS, KEY_MAX_PARALLEL, KEY_TIMEOUT};
+  PyObject *values[4];
+
+  if (!unpackArguments("read_all", args, nArgs, kwNames, 1, 4, parameters, values) ||
+      !nameConverter(values[0], name))
+    return NULL;
+  if ((values[2] != NULL) && ((maxParallel = PyLong_AsLong(values[2])) == -1) && PyErr_Occurred())
+    return NULL;
+  return readAll(name, ARGUMENT(values[1], Py_None), (int)maxParallel, ARGUMENT(values[3], Py_None));
+}
+#endif
+
+/*
+  Timestamps.   timestamps([(partner, name), ...]) reads every variable as
+  read_all does, in parallel, but keeps only the timestamps, and returns
+  how old each value is (in seconds) as an array('d'), with NaN for any
+  which couldn't be read.   No Python object is made for any value.   The
+  raw values land in one scratch area, sized from the descriptor cache
+  and kept from call to call.   Structures still have to be read whole,
+  but aren't unpacked.
+*/
+static pthread_mutex_t timestampMutex = PTHREAD_MUTEX_INITIALIZER; /* Protects the scratch area */
+static char *timestampScratch = NULL;
+static size_t timestampScratchSize = 0;
+static PyObject *arrayType = NULL;  /* array.array */
+
+static PyObject *pydsm_timestamps(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  int i, nJobs, maxParallel = DEFAULT_PARALLEL, failed = FALSE;
+  size_t scratchNeeded = 0, offset;
+  double deadline, now, *ages = NULL;
+  char *names = NULL;
+  static char *keyWordList[] = {"variables", "max_parallel", "timeout", NULL};
+  PyObject *pairs, *pairSequence, *timeoutObject = Py_None, *agesObject = NULL, *arrayModule;
+  dsmDescriptor *descriptor;
+  readJob *jobs = NULL;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "O|iO", keyWordList, &pairs, &maxParallel, &timeoutObject))
+    return NULL;
+  if ((deadline = deadlineFor(timeoutObject)) < 0.0)
+    return NULL;
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  if (arrayType == NULL) {
+    if ((arrayModule = PyImport_ImportModule("array")) == NULL)
+      return NULL;
+    arrayType = PyObject_GetAttrString(arrayModule, "array");
+    Py_DECREF(arrayModule);
+    if (arrayType == NULL)
+      return NULL;
+  }
+  if ((pairSequence = PySequence_Fast(pairs, "timestamps needs a sequence of (partner, name) pairs")) == NULL)
+    return NULL;
+  nJobs = (int)PySequence_Fast_GET_SIZE(pairSequence);
+  jobs = (readJob *)pydsmCalloc(nJobs > 0 ? nJobs : 1, sizeof(readJob));
+  names = pydsmMalloc((nJobs > 0 ? nJobs : 1)*DSM_NAME_LENGTH);
+  ages = (double *)pydsmMalloc((nJobs > 0 ? nJobs : 1)*sizeof(double));
+  if ((jobs == NULL) || (names == NULL) || (ages == NULL)) {
+    PyErr_NoMemory();
+    goto cleanUp;
+  }
+  for (i = 0; i < nJobs; i++) {
+    jobs[i].name = &names[i*DSM_NAME_LENGTH];
+    if (!PyTuple_Check(PySequence_Fast_GET_ITEM(pairSequence, i))) {
+      PyErr_SetString(PyExc_TypeError, "timestamps needs (partner, name) pairs");
+      goto cleanUp;
+    }
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(pairSequence, i), "O&O&;timestamps needs (partner, name) pairs",
+			  partnerConverter, jobs[i].partner, nameConverter, jobs[i].name))
+      goto cleanUp;
+    jobs[i].isStructure = (jobs[i].name[strlen(jobs[i].name)-1] == 'X');
+    jobs[i].deadline = deadline;
+    if (!jobs[i].isStructure) {
+      if ((descriptor = lookupDescriptor(jobs[i].name)) == NULL)
+	goto cleanUp;
+      jobs[i].size = descriptor->size;
+      scratchNeeded += descriptor->size;
+    }
+  }
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock(&timestampMutex);
+  if (scratchNeeded > timestampScratchSize) {
+    pydsmFree(timestampScratch);
+    if ((timestampScratch = pydsmMalloc(scratchNeeded)) == NULL)
+      timestampScratchSize = 0;
+    else
+      timestampScratchSize = scratchNeeded;
+  }
+  if (scratchNeeded <= timestampScratchSize) {
+    for (i = 0, offset = 0; i < nJobs; i++) {
+      if (jobs[i].isStructure)
+	jobs[i].status = dsm_structure_init(&jobs[i].structure, jobs[i].name);
+      else {
+	jobs[i].buf = &timestampScratch[offset];
+	offset += jobs[i].size;
+      }
+      jobs[i].ready = (jobs[i].status == DSM_SUCCESS);
+    }
+    runParallel(readJobWork, jobs, sizeof(readJob), nJobs, maxParallel);
+    now = wallClock();
+    for (i = 0; i < nJobs; i++) {
+      ages[i] = (jobs[i].status == DSM_SUCCESS) ? now - (double)jobs[i].timestamp : NAN;
+      if (jobs[i].isStructure && jobs[i].ready)
+	dsm_structure_destroy(&jobs[i].structure);
+      jobs[i].buf = NULL; /* It belongs to the scratch area */
+    }
+  } else
+    failed = TRUE;
+  pthread_mutex_unlock(&timestampMutex);
+  Py_END_ALLOW_THREADS
+  if (failed) {
+    fprintf(stderr, "malloc failure for timestamps scratch area (%d bytes)\n", (int)scratchNeeded);
+    PyErr_NoMemory();
+  } else
+    agesObject = PyObject_CallFunction(arrayType, "sN", "d", PyBytes_FromStringAndSize((char *)ages, nJobs*sizeof(double)));
+ cleanUp:
+  pydsmFree(jobs);
+  pydsmFree(names);
+  pydsmFree(ages);
+  Py_DECREF(pairSequence);
+  return agesObject;
+}
+
+/*
+  Polling.   poll_every() hands a variable to a scheduler thread, which
+  reads it every period seconds, without the GIL, and keeps the value in
+  the subscription table so pydsm.read is served from there.   With
+  events=True every value read is also passed on to read_wait, as though
+  it were a monitor event (through any monitor filters on the variable).
+  At each wake up the scheduler queues every variable which is due for a
+  pool of up to POLL_WORKERS reader threads, so a slow partner only holds
+  up its own variables.   Periods are kept to the original schedule rather
+  than to when the last read finished, so they don't drift.   For
+  poll_stats(), jitter is how late each read started, and an overrun is a
+  period skipped because the variable's last read was still going.
+*/
+#define POLL_WORKERS (16)
+
+typedef struct pollEntry {
+  char partner[DSM_NAME_LENGTH];
+  char name[DSM_NAME_LENGTH];
+  int size;
+  int events;          /* Values read go to read_wait too */
+  int busy;            /* Queued or being read */
+  int removed;         /* Dropped while busy - the worker frees it */
+  double period;
+  double due;          /* When the next read is scheduled */
+  double scheduled;    /* When the read in progress was due */
+  long polls;
+  long errors;
+  long overruns;
+  int lastStatus;
+  double lastPoll;     /* When the last read started */
+  double jitterSum;
+  double jitterMax;
+  char *buf;
+  struct pollEntry *next;
+  struct pollEntry *nextQueued;
+} pollEntry;
+
+static pthread_mutex_t pollMutex = PTHREAD_MUTEX_INITIALIZER; /* Protects everything below */
+static pthread_cond_t pollCond = PTHREAD_COND_INITIALIZER;    /* Wakes the scheduler when the list changes */
+static pthread_cond_t pollWorkCond = PTHREAD_COND_INITIALIZER;
+static pollEntry *pollList = NULL;
+static pollEntry *pollQueueHead = NULL;
+static pollEntry *pollQueueTail = NULL;
+static int nQueuedPolls = 0;
+static int schedulerRunning = FALSE;
+static int pollStopping = FALSE;   /* Tells the scheduler and workers to exit */
+static int nPollWorkers = 0;
+static int idlePollWorkers = 0;
+static pthread_t pollSchedulerThread;
+static pthread_t pollWorkerThreads[POLL_WORKERS];
+
+void *pollWorker(void *arg)
+{
+  int events, status;
+  double started, jitter;
+  time_t timestamp;
+  pollEntry *entry;
+
+  pthread_mutex_lock(&pollMutex);
+  while (TRUE) {
+    while ((pollQueueHead == NULL) && !pollStopping) {
+      idlePollWorkers++;
+      pthread_cond_wait(&pollWorkCond, &pollMutex);
+      idlePollWorkers--;
+    }
+    if (pollStopping)
+      break;
+    entry = pollQueueHead;
+    if ((pollQueueHead = entry->nextQueued) == NULL)
+      pollQueueTail = NULL;
+    nQueuedPolls--;
+    events = entry->events;
+    pthread_mutex_unlock(&pollMutex);
+    /* Straight to the partner - readRaw would answer from the table this fills */
+    started = wallClock();
+    status = remoteCallWithin(REMOTE_READ, entry->partner, entry->name, entry->buf, entry->size, FALSE, &timestamp, 0.0);
+    if (status == DSM_SUCCESS) {
+      monitorEventArrived(entry->partner, entry->name, entry->buf, entry->size, timestamp);
+      if (events)
+	deliverMonitorEvent(entry->partner, entry->name, entry->buf, entry->size, timestamp);
+    }
+    pthread_mutex_lock(&pollMutex);
+    jitter = started - entry->scheduled;
+    entry->polls++;
+    entry->jitterSum += jitter;
+    if (jitter > entry->jitterMax)
+      entry->jitterMax = jitter;
+    entry->lastPoll = started;
+    if ((entry->lastStatus = status) != DSM_SUCCESS)
+      entry->errors++;
+    entry->busy = FALSE;
+    if (entry->removed)
+      pydsmFree(entry);
+  }
+  pthread_mutex_unlock(&pollMutex);
+  return NULL;
+}
+
+/* Must be called with pollMutex held */
+void queuePoll(pollEntry *entry)
+{
+  entry->busy = TRUE;
+  entry->scheduled = entry->due;
+  entry->nextQueued = NULL;
+  if (pollQueueTail == NULL)
+    pollQueueHead = entry;
+  else
+    pollQueueTail->nextQueued = entry;
+  pollQueueTail = entry;
+  if ((++nQueuedPolls > idlePollWorkers) && (nPollWorkers < POLL_WORKERS)) {
+    if (pthread_create(&pollWorkerThreads[nPollWorkers], NULL, pollWorker, NULL) == 0)
+      nPollWorkers++;
+    else if (nPollWorkers == 0)
+      fprintf(stderr, "Could not start a poll worker thread - nothing will be polled\n");
+  }
+  pthread_cond_signal(&pollWorkCond);
+}
+
+void *pollScheduler(void *arg)
+{
+  long missed;
+  double now, earliest;
+  struct timespec until;
+  pollEntry *entry;
+
+  pthread_mutex_lock(&pollMutex);
+  while (!pollStopping) {
+    now = wallClock();
+    earliest = 0.0;
+    for (entry = pollList; entry != NULL; entry = entry->next) {
+      if (entry->due <= now) {
+	if (entry->busy)
+	  entry->overruns++;
+	else
+	  queuePoll(entry);
+	entry->due += entry->period;
+	if (entry->due <= now) {
+	  missed = (long)((now - entry->due)/entry->period) + 1;
+	  entry->overruns += missed;
+	  entry->due += (double)missed*entry->period;
+	}
       }
-      /* It's a single variable */
-      switch (type) {
-      case DSM_BYTE:
-	size = sizeof(char);   break;
-      case DSM_SHORT:
-	size = sizeof(short);  break;
-      case DSM_LONG:
-	size = sizeof(int);    break;
-      case DSM_FLOAT:
-	size = sizeof(float);  break;
-      case DSM_DOUBLE:
-	size = sizeof(double); break;
-      default:
-	fprintf(stderr, "Could not handle type %d\n", type);
+      if ((earliest == 0.0) || (entry->due < earliest))
+	earliest = entry->due;
+    }
+    if (earliest == 0.0)
+      pthread_cond_wait(&pollCond, &pollMutex);
+    else {
+      until.tv_sec = (time_t)earliest;
+      until.tv_nsec = (long)((earliest - (double)until.tv_sec)*1.0e9);
+      pthread_cond_timedwait(&pollCond, &pollMutex, &until);
+    }
+  }
+  pthread_mutex_unlock(&pollMutex);
+  return NULL;
+}
+
+/*
+  Stops the scheduler and workers, waiting for any read in progress to
+  finish, and drops every poll list entry.   Call without the GIL.
+*/
+void stopPolling(void)
+{
+  int i;
+  pollEntry *entry;
+
+  pthread_mutex_lock(&pollMutex);
+  pollStopping = TRUE;
+  pthread_cond_broadcast(&pollCond);
+  pthread_cond_broadcast(&pollWorkCond);
+  pthread_mutex_unlock(&pollMutex);
+  if (schedulerRunning)
+    pthread_join(pollSchedulerThread, NULL);
+  for (i = 0; i < nPollWorkers; i++)
+    pthread_join(pollWorkerThreads[i], NULL);
+  pthread_mutex_lock(&pollMutex);
+  while ((entry = pollQueueHead) != NULL) { /* Entries dropped while queued are no longer in pollList */
+    pollQueueHead = entry->nextQueued;
+    if (entry->removed)
+      pydsmFree(entry);
+  }
+  while ((entry = pollList) != NULL) {
+    pollList = entry->next;
+    setSubscription(entry->partner, entry->name, 0, CACHE_POLLED);
+    pydsmFree(entry);
+  }
+  pollQueueTail = NULL;
+  nQueuedPolls = nPollWorkers = idlePollWorkers = 0;
+  schedulerRunning = pollStopping = FALSE;
+  pthread_mutex_unlock(&pollMutex);
+}
+
+/* Adds, changes or with period 0 removes a poll list entry.   Returns DSM_ERROR, with an exception set, on failure */
+int setPoll(char *partner, char *name, int size, double period, int events)
+{
+  pollEntry *entry, **link;
+
+  pthread_mutex_lock(&pollMutex);
+  for (link = &pollList; (entry = *link) != NULL; link = &entry->next)
+    if (!strcmp(entry->name, name) && !strcmp(entry->partner, partner))
+      break;
+  if (period <= 0.0) {
+    if (entry != NULL) {
+      *link = entry->next;
+      if (entry->busy)
+	entry->removed = TRUE;
+      else
+	pydsmFree(entry);
+    }
+    pthread_mutex_unlock(&pollMutex);
+    return DSM_SUCCESS;
+  }
+  if (!schedulerRunning) {
+    if (pthread_create(&pollSchedulerThread, NULL, pollScheduler, NULL) != 0) {
+      pthread_mutex_unlock(&pollMutex);
+      PyErr_SetString(dSMInternalError, "DSM error: could not start the poll scheduler thread");
+      return DSM_ERROR;
+    }
+    schedulerRunning = TRUE;
+  }
+  if (entry == NULL) {
+    if ((entry = (pollEntry *)pydsmCalloc(1, sizeof(pollEntry) + size)) == NULL) {
+      pthread_mutex_unlock(&pollMutex);
+      fprintf(stderr, "malloc failure for poll entry of \"%s\" (%d bytes)\n", name, size);
+      PyErr_NoMemory();
+      return DSM_ERROR;
+    }
+    strcpy(entry->partner, partner);
+    strcpy(entry->name, name);
+    entry->size = size;
+    entry->buf = (char *)(entry+1);
+    entry->next = pollList;
+    pollList = entry;
+  }
+  entry->period = period;
+  entry->events = events;
+  entry->due = wallClock(); /* Read it at once, and every period from then */
+  pthread_cond_signal(&pollCond);
+  pthread_mutex_unlock(&pollMutex);
+  return DSM_SUCCESS;
+}
+
+static PyObject *pydsm_poll_every(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  int events = FALSE;
+  double period;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  static char *keyWordList[] = {"partner", "name", "period", "events", NULL};
+  dsmDescriptor *descriptor;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "O&O&d|i", keyWordList, partnerConverter, partner, nameConverter, name,
+				   &period, &events))
+    return NULL;
+  if (period < 0.0) {
+    PyErr_SetString(PyExc_ValueError, "period must not be negative");
+    return NULL;
+  }
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  dprintf("pydsm_poll_every: \"%s\" on \"%s\" every %f seconds\n", name, partner, period);
+  if (period == 0.0) {
+    setPoll(partner, name, 0, 0.0, FALSE);
+    setSubscription(partner, name, 0, CACHE_POLLED);
+    Py_RETURN_NONE;
+  }
+  if (toupper(name[strlen(name)-1]) == 'X') {
+    PyErr_SetString(dSMNotImplemented, "DSM error: Polling structures not yet implemented in the pydsm module");
+    return NULL;
+  }
+  if ((descriptor = lookupDescriptor(name)) == NULL)
+    return NULL;
+  if (events) {
+    /* read_wait must take its events from the queue, which the reader thread's presence arranges */
+    if (startMonitorReader() != DSM_SUCCESS)
+      return NULL;
+    if (descriptor->size > monitorMaxSize)
+      monitorMaxSize = descriptor->size;
+  }
+  if (setSubscription(partner, name, descriptor->size, CACHE_POLLED) != DSM_SUCCESS)
+    return NULL;
+  if (setPoll(partner, name, descriptor->size, period, events) != DSM_SUCCESS) {
+    setSubscription(partner, name, 0, CACHE_POLLED);
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/*
+  Returns {(partner, name): {'period': s, 'polls': n, 'errors': n,
+  'overruns': n, 'jitter_mean': s, 'jitter_max': s, 'last_status': n,
+  'last_poll': t}} for everything polled.
+*/
+static PyObject *pydsm_poll_stats(PyObject *self)
+{
+  PyObject *statsDict, *key, *counts;
+  pollEntry *entry;
+
+  if ((statsDict = PyDict_New()) == NULL)
+    return NULL;
+  pthread_mutex_lock(&pollMutex);
+  for (entry = pollList; (entry != NULL) && (statsDict != NULL); entry = entry->next) {
+    key = Py_BuildValue("(ss)", entry->partner, entry->name);
+    counts = Py_BuildValue("{s:d,s:l,s:l,s:l,s:d,s:d,s:i,s:d}", "period", entry->period, "polls", entry->polls,
+			   "errors", entry->errors, "overruns", entry->overruns,
+			   "jitter_mean", (entry->polls > 0) ? entry->jitterSum/(double)entry->polls : 0.0,
+			   "jitter_max", entry->jitterMax, "last_status", entry->lastStatus, "last_poll", entry->lastPoll);
+    if ((key == NULL) || (counts == NULL) || (PyDict_SetItem(statsDict, key, counts) != 0))
+      Py_CLEAR(statsDict);
+    Py_XDECREF(key);
+    Py_XDECREF(counts);
+  }
+  pthread_mutex_unlock(&pollMutex);
+  return statsDict;
+}
+
+/*
+  Closing.   Background threads must be out of libdsm before dsm_close, so
+  close() stops polling and the monitor pacer, and waits for the breaker
+  prober and abandoned deadline calls, which all leave within libdsm's own
+  RPC timeout.   The monitor reader can only stop when dsm_read_wait
+  returns, so close() gives it up to CLOSE_WAIT seconds to see an event,
+  and if none comes raises, leaving DSM (and monitoring) as it was.
+*/
+#define CLOSE_WAIT (2.0)
+
+/* Returns DSM_SUCCESS, or DSM_ERROR with an exception set if the monitor reader wouldn't stop */
+int close_dsm(void)
+{
+  int stopped;
+
+  if (!dSMOpen)
+    return DSM_SUCCESS;
+  Py_BEGIN_ALLOW_THREADS
+  stopped = stopMonitorThreads(CLOSE_WAIT);
+  Py_END_ALLOW_THREADS
+  if (!stopped) {
+    startMonitorReader(); /* Lets the reader carry on, and restarts the pacer */
+    PyErr_SetString(dSMInternalError, "DSM error: the monitor reader is still waiting in dsm_read_wait - close() again after an event");
+    return DSM_ERROR;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  stopPolling();
+  stopPartnerThreads();
+  Py_END_ALLOW_THREADS
+  dsm_close();
+  dSMOpen = FALSE;
+  return DSM_SUCCESS;
+}
+
+static PyObject *pydsm_close(PyObject *self)
+{
+  if (dSMOpen) {
+    dprintf("Closing dsm\n");
+    if (close_dsm() != DSM_SUCCESS)
+      return NULL;
+  }
+  return Py_BuildValue("i", DSM_SUCCESS);
+}
+
+/*
+  Snapshots.   snapshot_spec() compiles a list of (partner, name) pairs into
+  a header which says where each value will go, and snapshot(spec) copies
+  that header and reads every variable straight into the data area behind
+  it, giving one contiguous block with no Python objects made per variable.
+  Structures are expanded into their members, named "STRUCTURE_X:MEMBER".
+  pydsmSnapshot.py decodes a snapshot offline.
+
+  Everything is in the writer's byte order, which byteOrder records.   The
+  data for each variable is a snapshotValue followed by the raw value,
+  padded to a multiple of 8 bytes.
+*/
+#define SNAPSHOT_MAGIC      "PYDSMSNP"
+#define SNAPSHOT_VERSION    (1)
+#define SNAPSHOT_BYTE_ORDER (0x01020304)
+#define SNAPSHOT_ALIGN(n)   (((n) + 7) & ~7)
+
+typedef struct {
+  char magic[8];
+  unsigned int byteOrder;
+  unsigned int version;
+  unsigned int nEntries;
+  unsigned int headerSize;  /* Including the entries, which follow this */
+  unsigned int totalSize;
+  unsigned int spare;
+} snapshotHeader;
+
+typedef struct {
+  unsigned int entrySize;   /* Including the dimensions and names which follow, a multiple of 8 */
+  unsigned int dataOffset;  /* Of this variable's snapshotValue, from the start of the snapshot */
+  unsigned int dataSize;    /* Of the raw value */
+  unsigned int elementSize; /* For strings, their length */
+  char type;                /* The array module type code, or S for strings */
+  unsigned char nDim;       /* Followed by nDim ints of dimensions, then "partner\0name\0" */
+  unsigned char partnerLength;
+  unsigned char nameLength;
+} snapshotEntry;
+
+typedef struct {
+  int status;               /* DSM_SUCCESS, or the error which left the value zeroed */
+  int spare;
+  long long timestamp;
+} snapshotValue;
+
+/* Appends an entry to the spec being built, growing it as needed.   dataOffset is relative to the data area for now */
+int addSnapshotEntry(char **spec, int *specSize, int *specCapacity, unsigned int *dataSize, char *partner, char *name)
+{
+  int entrySize, i;
+  char code[16], *newSpec;
+  dsmDescriptor *descriptor;
+  snapshotEntry *entry;
+
+  if ((descriptor = lookupDescriptor(strchr(name, ':') ? strchr(name, ':')+1 : name)) == NULL)
+    return DSM_ERROR;
+  entrySize = SNAPSHOT_ALIGN(sizeof(snapshotEntry) + descriptor->nDim*sizeof(int) + strlen(partner) + strlen(name) + 2);
+  if (*specSize + entrySize > *specCapacity) {
+    if ((newSpec = pydsmRealloc(*spec, 2*(*specCapacity) + entrySize)) == NULL) {
+      PyErr_NoMemory();
+      return DSM_ERROR;
+    }
+    *spec = newSpec;
+    *specCapacity = 2*(*specCapacity) + entrySize;
+  }
+  entry = (snapshotEntry *)&(*spec)[*specSize];
+  bzero((char *)entry, entrySize);
+  typeCode(descriptor, code);
+  entry->entrySize = entrySize;
+  entry->dataOffset = *dataSize;
+  entry->dataSize = descriptor->size;
+  entry->elementSize = descriptor->elementSize;
+  entry->type = code[0];
+  entry->nDim = descriptor->nDim;
+  entry->partnerLength = strlen(partner);
+  entry->nameLength = strlen(name);
+  for (i = 0; i < descriptor->nDim; i++)
+    ((int *)(entry+1))[i] = descriptor->dimensions[i];
+  strcpy((char *)(entry+1) + descriptor->nDim*sizeof(int), partner);
+  strcpy((char *)(entry+1) + descriptor->nDim*sizeof(int) + entry->partnerLength + 1, name);
+  *specSize += entrySize;
+  *dataSize += SNAPSHOT_ALIGN(sizeof(snapshotValue) + descriptor->size);
+  return DSM_SUCCESS;
+}
+
+/* Adds an entry for each member of a structure, as the partner's allocation list has them */
+int addSnapshotStructure(char **spec, int *specSize, int *specCapacity, unsigned int *dataSize, char *partner, char *name)
+{
+  int i, j, nhosts, nMembers = 0, length = strlen(name);
+  struct dsm_allocation_list *alp;
+
+  getAllocationList(&nhosts, &alp);
+  for (i = 0; i < nhosts; i++)
+    if (!strcmp(partner, alp[i].host_name)) {
+      for (j = 0; j < alp[i].n_entries; j++)
+	if (!strncmp(alp[i].alloc_list[j], name, length) && (alp[i].alloc_list[j][length] == ':')) {
+	  if (addSnapshotEntry(spec, specSize, specCapacity, dataSize, partner, alp[i].alloc_list[j]) != DSM_SUCCESS)
+	    return DSM_ERROR;
+	  nMembers++;
+	}
+      break;
+    }
+  if (nMembers == 0) {
+    raiseDSMError((i < nhosts) ? DSM_NAME_INVALID : DSM_TARGET_INVALID, "pydsm.snapshot_spec()");
+    return DSM_ERROR;
+  }
+  return DSM_SUCCESS;
+}
+
+static PyObject *pydsm_snapshot_spec(PyObject *self, PyObject *args)
+{
+  int i, j, specSize, specCapacity = 4096;
+  unsigned int dataSize = 0, nEntries = 0, offset;
+  char *spec, *partnerArg, *nameArg, partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  PyObject *pairs, *pairSequence, *specObject;
+  snapshotHeader *header;
+  snapshotEntry *entry;
+
+  if (!PyArg_ParseTuple(args, "O", &pairs))
+    return NULL;
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  if ((pairSequence = PySequence_Fast(pairs, "snapshot_spec needs a sequence of (partner, name) pairs")) == NULL)
+    return NULL;
+  if ((spec = pydsmMalloc(specCapacity)) == NULL) {
+    Py_DECREF(pairSequence);
+    return PyErr_NoMemory();
+  }
+  specSize = sizeof(snapshotHeader);
+  for (i = 0; i < PySequence_Fast_GET_SIZE(pairSequence); i++) {
+    if (!PyTuple_Check(PySequence_Fast_GET_ITEM(pairSequence, i))) {
+      PyErr_SetString(PyExc_TypeError, "snapshot_spec needs (partner, name) pairs");
+      goto error;
+    }
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(pairSequence, i), "ss;snapshot_spec needs (partner, name) pairs",
+			  &partnerArg, &nameArg) ||
+	(copyPartner(partner, partnerArg) != DSM_SUCCESS))
+      goto error;
+    if ((strlen(nameArg) < 2) || (strlen(nameArg) >= DSM_NAME_LENGTH)) {
+      PyErr_SetString(dSMIllegalName, "DSM error: Illegal Name");
+      goto error;
+    }
+    for (j = 0; nameArg[j]; j++)
+      name[j] = toupper(nameArg[j]);
+    name[j] = (char)0;
+    if (name[j-1] == 'X') {
+      if (addSnapshotStructure(&spec, &specSize, &specCapacity, &dataSize, partner, name) != DSM_SUCCESS)
+	goto error;
+    } else if (addSnapshotEntry(&spec, &specSize, &specCapacity, &dataSize, partner, name) != DSM_SUCCESS)
+      goto error;
+  }
+  /* Now the header size is known, the data offsets can be made absolute */
+  for (offset = sizeof(snapshotHeader); offset < specSize; offset += entry->entrySize) {
+    entry = (snapshotEntry *)&spec[offset];
+    entry->dataOffset += specSize;
+    nEntries++;
+  }
+  header = (snapshotHeader *)spec;
+  bzero((char *)header, sizeof(snapshotHeader));
+  bcopy(SNAPSHOT_MAGIC, header->magic, sizeof(header->magic));
+  header->byteOrder = SNAPSHOT_BYTE_ORDER;
+  header->version = SNAPSHOT_VERSION;
+  header->nEntries = nEntries;
+  header->headerSize = specSize;
+  header->totalSize = specSize + dataSize;
+  dprintf("pydsm_snapshot_spec: %d entries, %d header bytes, %d in all\n", nEntries, specSize, header->totalSize);
+  specObject = PyBytes_FromStringAndSize(spec, specSize);
+  pydsmFree(spec);
+  Py_DECREF(pairSequence);
+  return specObject;
+ error:
+  pydsmFree(spec);
+  Py_DECREF(pairSequence);
+  return NULL;
+}
+
+/*
+  Checks that a spec passed to snapshot() is one snapshot_spec() made, so
+  it can be walked safely: every entry lies inside it, its names are
+  terminated where their lengths say and fit a DSM name, and its data area
+  still matches what the descriptor cache says about the variable now.
+  Specs are plain bytes which may have been saved and reloaded after an
+  allocation changed, and takeSnapshot trusts all of this.
+*/
+snapshotHeader *checkSnapshotSpec(char *spec, int length)
+{
+  int j;
+  unsigned int i, offset, minimum;
+  char code[16], *partner, *name, *member;
+  snapshotHeader *header = (snapshotHeader *)spec;
+  snapshotEntry *entry;
+  dsmDescriptor *descriptor;
+
+  if ((length < sizeof(snapshotHeader)) || strncmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+      (header->byteOrder != SNAPSHOT_BYTE_ORDER) || (header->version != SNAPSHOT_VERSION) ||
+      (header->headerSize != length) || (header->totalSize < length))
+    goto bad;
+  for (i = 0, offset = sizeof(snapshotHeader); i < header->nEntries; i++, offset += entry->entrySize) {
+    if ((size_t)offset + sizeof(snapshotEntry) > length)
+      goto bad;
+    entry = (snapshotEntry *)&spec[offset];
+    minimum = sizeof(snapshotEntry) + entry->nDim*sizeof(int) + entry->partnerLength + entry->nameLength + 2;
+    if ((entry->entrySize < minimum) || ((size_t)offset + entry->entrySize > length) || (entry->dataOffset < length) ||
+	((size_t)entry->dataOffset + sizeof(snapshotValue) + (size_t)entry->dataSize > header->totalSize) ||
+	(entry->partnerLength >= DSM_NAME_LENGTH) || (entry->nameLength >= DSM_NAME_LENGTH))
+      goto bad;
+    partner = (char *)(entry+1) + entry->nDim*sizeof(int);
+    name = partner + entry->partnerLength + 1;
+    if ((strnlen(partner, entry->partnerLength+1) != entry->partnerLength) ||
+	(strnlen(name, entry->nameLength+1) != entry->nameLength))
+      goto bad;
+    member = strchr(name, ':');
+    if ((descriptor = lookupDescriptor((member != NULL) ? member+1 : name)) == NULL) {
+      PyErr_Clear();
+      goto stale;
+    }
+    if (descriptor->type == DSM_STRUCTURE) /* snapshot_spec lists their members instead */
+      goto bad;
+    typeCode(descriptor, code);
+    if ((descriptor->size != entry->dataSize) || (descriptor->elementSize != entry->elementSize) ||
+	(code[0] != entry->type) || (descriptor->nDim != entry->nDim))
+      goto stale;
+    for (j = 0; j < descriptor->nDim; j++)
+      if (((int *)(entry+1))[j] != descriptor->dimensions[j])
+	goto stale;
+  }
+  if (offset != length)
+    goto bad;
+  return header;
+ bad:
+  PyErr_SetString(PyExc_ValueError, "not a snapshot spec made by pydsm.snapshot_spec");
+  return NULL;
+ stale:
+  PyErr_Format(PyExc_ValueError, "snapshot spec entry for \"%s\" on \"%s\" no longer matches its allocation - "
+	       "make the spec again", name, partner);
+  return NULL;
+}
+
+/* Reads every variable in the spec into the snapshot at out, which must be totalSize bytes.   Called without the GIL */
+void takeSnapshot(char *spec, char *out)
+{
+  unsigned int i, offset;
+  int loaded = FALSE, structureStatus = DSM_SUCCESS, nameLength = 0;
+  char *partner, *name, *member, *raw, loadedPartner[DSM_NAME_LENGTH], structureName[DSM_NAME_LENGTH];
+  time_t timestamp = 0, structureTime = 0;
+  dsm_structure structure;
+  snapshotHeader *header = (snapshotHeader *)spec;
+  snapshotEntry *entry;
+  snapshotValue *value;
+
+  bcopy(spec, out, header->headerSize);
+  bzero(&out[header->headerSize], header->totalSize - header->headerSize);
+  for (i = 0, offset = sizeof(snapshotHeader); i < header->nEntries; i++, offset += entry->entrySize) {
+    entry = (snapshotEntry *)&spec[offset];
+    partner = (char *)(entry+1) + entry->nDim*sizeof(int);
+    name = partner + entry->partnerLength + 1;
+    value = (snapshotValue *)&out[entry->dataOffset];
+    raw = (char *)(value+1);
+    if ((member = strchr(name, ':')) == NULL) {
+      value->status = readRaw(partner, name, raw, entry->dataSize, &timestamp);
+      value->timestamp = (long long)timestamp;
+      continue;
+    }
+    /* A structure's members are together, so it's read once for all of them */
+    if (!loaded || strcmp(partner, loadedPartner) || (member-name != nameLength) || strncmp(name, structureName, nameLength)) {
+      if (loaded)
+	dsm_structure_destroy(&structure);
+      nameLength = member-name;
+      strncpy(structureName, name, nameLength);
+      structureName[nameLength] = (char)0;
+      strcpy(loadedPartner, partner);
+      loaded = ((structureStatus = dsm_structure_init(&structure, structureName)) == DSM_SUCCESS);
+      if (loaded)
+	structureStatus = remoteCallWithin(REMOTE_READ, partner, structureName, &structure, 0, TRUE, &structureTime, 0.0);
+    }
+    if ((value->status = structureStatus) == DSM_SUCCESS) {
+      value->status = dsm_structure_get_element(&structure, member+1, raw);
+      value->timestamp = (long long)structureTime;
+    }
+  }
+  if (loaded)
+    dsm_structure_destroy(&structure);
+}
+
+static PyObject *pydsm_snapshot(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  char *spec;
+  Py_ssize_t specLength;
+  static char *keyWordList[] = {"spec", "buffer", NULL};
+  PyObject *bufferObject = Py_None, *snapshotObject;
+  Py_buffer view;
+  snapshotHeader *header;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "s#|O", keyWordList, &spec, &specLength, &bufferObject))
+    return NULL;
+  if ((open_dsm() != DSM_SUCCESS) || ((header = checkSnapshotSpec(spec, (int)specLength)) == NULL))
+    return NULL;
+  if (bufferObject == Py_None) {
+    if ((snapshotObject = PyBytes_FromStringAndSize(NULL, header->totalSize)) == NULL)
+      return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    takeSnapshot(spec, PyBytes_AS_STRING(snapshotObject));
+    Py_END_ALLOW_THREADS
+    return snapshotObject;
+  }
+  if (PyObject_GetBuffer(bufferObject, &view, PyBUF_WRITABLE) != 0)
+    return NULL;
+  if (view.len < header->totalSize) {
+    PyBuffer_Release(&view);
+    PyErr_Format(PyExc_ValueError, "snapshot buffer must hold at least %u bytes", header->totalSize);
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  takeSnapshot(spec, (char *)view.buf);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&view);
+  return PyInt_FromLong((long)header->totalSize);
+}
+
+/* Builds the (partner, name, (value, timestamp)) tuple returned for a monitor event */
+PyObject *monitorEventTuple(char *partner, char *allocName, char *buf, time_t theTime)
+{
+  PyObject *valueObj;
+
+  valueObj = makePyObject(partner, NULL, allocName, buf, theTime, FALSE);
+  if (valueObj == NULL)
+    return NULL;
+  return Py_BuildValue("(NNN)", internedName(partner), internedName(allocName), valueObj);
+}
+
+/*
+  Replay of a recorded log through read_wait and read_wait_many.   With
+  speed 0 events are handed out as fast as they're asked for, otherwise
+  the recorded spacing between events is kept, divided by speed.
+*/
+static FILE *replayFile = NULL;
+static int replayFlags = 0;
+static double replaySpeed = 0.0;
+static char *replayBlock = NULL;
+static size_t replayLength = 0;
+static size_t replayOffset = 0;
+static char **replayPartners = NULL;
+static char **replayNames = NULL;
+static unsigned int replayNNames = 0;
+static long long replayFirstNs = 0;
+static double replayStart = 0.0;
+
+void sleepSeconds(double seconds)
+{
+  struct timespec delay;
+
+  delay.tv_sec = (time_t)seconds;
+  delay.tv_nsec = (long)((seconds - (double)delay.tv_sec)*1.0e9);
+  nanosleep(&delay, NULL);
+}
+
+void stopReplay(void)
+{
+  unsigned int i;
+
+  if (replayFile != NULL) {
+    fclose(replayFile);
+    replayFile = NULL;
+  }
+  for (i = 0; i < replayNNames; i++) {
+    pydsmFree(replayPartners[i]);
+    pydsmFree(replayNames[i]);
+  }
+  pydsmFree(replayPartners);
+  pydsmFree(replayNames);
+  pydsmFree(replayBlock);
+  replayPartners = replayNames = NULL;
+  replayBlock = NULL;
+  replayNNames = 0;
+  replayLength = replayOffset = 0;
+}
+
+int startReplay(char *path, double speed)
+{
+  char magic[8];
+  unsigned int header[2];
+
+  stopReplay();
+  replayFile = fopen(path, "rb");
+  if (replayFile == NULL) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    return DSM_ERROR;
+  }
+  if ((fread(magic, 8, 1, replayFile) != 1) || strncmp(magic, RECORD_MAGIC, 8) ||
+      (fread(header, sizeof(header), 1, replayFile) != 1) || (header[0] != RECORD_VERSION)) {
+    stopReplay();
+    PyErr_SetString(dSMDecodeError, "DSM error: not a pydsm recording");
+    return DSM_ERROR;
+  }
+  replayFlags = header[1];
+  replaySpeed = speed;
+  replayFirstNs = 0;
+  return DSM_SUCCESS;
+}
+
+/* Returns FALSE at the end of the log, or on error (with a Python exception set) */
+int loadReplayBlock(void)
+{
+  unsigned int lengths[2];
+  uLongf rawLength;
+  char *block, *stored;
+
+  if (fread(lengths, sizeof(lengths), 1, replayFile) != 1)
+    return FALSE;
+  /* The writer never queues an empty block, or one bigger than RECORD_QUEUE_LIMIT */
+  if ((lengths[0] < sizeof(recordHeader)) || (lengths[0] > RECORD_QUEUE_LIMIT) ||
+      ((replayFlags & RECORD_COMPRESSED) ? (lengths[1] > compressBound(lengths[0])) : (lengths[1] != lengths[0]))) {
+    PyErr_SetString(dSMDecodeError, "DSM error: bad block length in pydsm recording");
+    return FALSE;
+  }
+  if ((block = pydsmRealloc(replayBlock, lengths[0])) == NULL) {
+    PyErr_NoMemory();
+    return FALSE;
+  }
+  replayBlock = block;
+  replayLength = replayOffset = 0;
+  stored = (replayFlags & RECORD_COMPRESSED) ? pydsmMalloc(lengths[1]) : replayBlock;
+  if (stored == NULL) {
+    PyErr_NoMemory();
+    return FALSE;
+  }
+  if (fread(stored, lengths[1], 1, replayFile) != 1) {
+    if (stored != replayBlock)
+      pydsmFree(stored);
+    PyErr_SetString(dSMDecodeError, "DSM error: truncated pydsm recording");
+    return FALSE;
+  }
+  if (stored != replayBlock) {
+    rawLength = lengths[0];
+    if ((uncompress((Bytef *)replayBlock, &rawLength, (Bytef *)stored, lengths[1]) != Z_OK) || (rawLength != lengths[0])) {
+      pydsmFree(stored);
+      PyErr_SetString(dSMDecodeError, "DSM error: corrupt block in pydsm recording");
+      return FALSE;
+    }
+    pydsmFree(stored);
+  }
+  replayLength = lengths[0];
+  replayOffset = 0;
+  return TRUE;
+}
+
+/* Finds the next event in the log, without consuming it.   Returns NULL at the end */
+char *peekReplayEvent(recordHeader *header)
+{
+  int size;
+  char *payload, *partnerEnd, *nameEnd, **partners, **names;
+
+  while (TRUE) {
+    if (replayOffset + sizeof(recordHeader) > replayLength)
+      if (!loadReplayBlock())
 	return NULL;
-      }
-      value = (char *)PyMem_Malloc(size);
-      if (value == NULL) {
-	fprintf(stderr, "value PyMem_Malloc");
-	PyErr_NoMemory();
+    bcopy(&replayBlock[replayOffset], (char *)header, sizeof(recordHeader));
+    payload = &replayBlock[replayOffset + sizeof(recordHeader)];
+    if (replayOffset + sizeof(recordHeader) + header->size > replayLength) {
+      PyErr_SetString(dSMDecodeError, "DSM error: corrupt record in pydsm recording");
+      return NULL;
+    }
+    if (header->type == RECORD_EVENT) {
+      if ((header->id >= replayNNames) || (replayNames[header->id] == NULL)) {
+	PyErr_SetString(dSMDecodeError, "DSM error: event for an unknown name in pydsm recording");
 	return NULL;
       }
-      if (buf != NULL) {
-	bcopy(buf, value, size);
-	status = DSM_SUCCESS;
-      } else if (structure != NULL)
-	status = dsm_structure_get_element(structure, name, &value[0]);
-      else
-	status = dsm_read(partner, name, &value[0], &timestamp);
-      if (status != DSM_SUCCESS) {
-	PyMem_Free(value);	
-	raiseDSMError(status, "read or get_element");
+      if ((size = objectSize(replayNames[header->id])) < 0)
+	return NULL;
+      if ((unsigned int)size != header->size) {
+	PyErr_SetString(dSMDecodeError, "DSM error: event of the wrong size in pydsm recording");
 	return NULL;
       }
-      dprintf("dsm_read completed successfully, with a timestamp of %d\n", (int)timestamp);
-      makePyObjectTuple = PyTuple_New(2);
-      readTime = PyInt_FromLong((long)timestamp);
-      PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)1, readTime);
-      switch (type) {
-      case DSM_BYTE:
-	retInt = value[0];
-	PyMem_Free(value);
-	dprintf("Got the byte 0x%x\n", retInt);
-	retIntObject = PyInt_FromLong((long)retInt);
-	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retIntObject);
-	return makePyObjectTuple;
-      case DSM_SHORT:
-	retInt = ((short *)value)[0];
-	PyMem_Free(value);
-	dprintf("Got the short %d\n", retInt);
-	retIntObject = PyInt_FromLong((long)retInt);
-	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retIntObject);
-	return makePyObjectTuple;
-      case DSM_LONG:
-	retInt = ((int *)value)[0];
-	PyMem_Free(value);
-	dprintf("Got the long %d\n", retInt);
-	retIntObject = PyInt_FromLong((long)retInt);
-	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retIntObject);
-	return makePyObjectTuple;
-      case DSM_FLOAT:
-	retDouble = ((float *)value)[0];
-	PyMem_Free(value);
-	dprintf("Got the float %f\n", retDouble);
-	retDoubleObject = PyFloat_FromDouble(retDouble);
-	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retDoubleObject);
-	return makePyObjectTuple;
-      case DSM_DOUBLE:
-	retDouble = ((double *)value)[0];
-	PyMem_Free(value);
-	dprintf("Got the double %f\n", retDouble);
-	retDoubleObject = PyFloat_FromDouble(retDouble);
-	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retDoubleObject);
-	return makePyObjectTuple;
+      return payload;
+    }
+    if (header->type == RECORD_NAME) {
+      /* Ids are handed out in order, so a name record either redefines one or adds the next */
+      partnerEnd = memchr(payload, '\0', header->size);
+      nameEnd = (partnerEnd == NULL) ? NULL : memchr(partnerEnd+1, '\0', header->size - (partnerEnd+1 - payload));
+      if ((header->id > replayNNames) || (nameEnd == NULL)) {
+	PyErr_SetString(dSMDecodeError, "DSM error: corrupt name record in pydsm recording");
+	return NULL;
       }
-    } else {
-      /* Oh crap, it's an array */
-      if ((type == DSM_STRING) && (nDim == 1)) {
-	char *value;
-	PyObject *retStringObject;
-	
-	/* OK, this is the easiest case: a simple string of length dimensions[0] */
-	value = PyMem_Malloc(dimensions[0]*sizeof(char));
-	PyMem_Free(dimensions);
-	if (value == NULL) {
-	  fprintf(stderr,"PyMem_Malloc for string type");
-	  PyErr_NoMemory();
-	  return NULL;
-	}
-	if (buf != NULL) {
-	  bcopy(buf, value, dimensions[0]*sizeof(char));
-	} else if (structure != NULL)
-	  status = dsm_structure_get_element(structure, name, &value[0]);
-	else
-	  status = dsm_read(partner, name, &value[0], &timestamp);
-	if (status != DSM_SUCCESS) {
-	  PyMem_Free(value);	
-	  if (dimensions != NULL)
-	    PyMem_Free(dimensions);
-	  raiseDSMError(status, "string DSM read or get_element");
-	  return NULL;
-	}
-	dprintf("dsm_read of string (%s) completed successfully, with a timestamp of %d\n", value, (int)timestamp);
-	makePyObjectTuple = PyTuple_New(2);
-	readTime = PyInt_FromLong((long)timestamp);
-	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)1, readTime);
-	retStringObject = PyString_FromString(value);
-	PyMem_Free(value);
-	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, retStringObject);
-	return makePyObjectTuple;
-      } else {
-	int i, arraySize, baseSize;
-	int nContainerTuples;
-	int stringSize = 0;
-	int j, offset;
-	char *arrayBase = NULL;
-	PyObject *myTuple;
-	
-	/* Here we handle nontrivial arrays - arrays other than simple character strings */
-	if (type == DSM_STRING) {
-	  stringSize = dimensions[0];
-	  for (i = 0; i < nDim-1; i++)
-	    dimensions[i] = dimensions[i+1];
-	  nDim -= 1;
-	}
-	dprintf("Nontrivial array of %d dimensions\n", nDim);
-	arraySize = 1;
-	for (i = 0; i < nDim; i++)
-	  arraySize *= dimensions[i];
-	dprintf("Full array size: %d\n", arraySize);
-	switch (type) {
-	case (DSM_BYTE):
-	  baseSize = 1; break;
-	case DSM_SHORT:
-	  baseSize = 2; break;
-	case DSM_LONG:
-	case DSM_FLOAT:
-	  baseSize = 4; break;
-	case DSM_STRING:
-	  baseSize = stringSize; break;
-	default:
-	  baseSize = 8;
-	}
-	arrayBase = PyMem_Malloc(arraySize * baseSize);
-	if (arrayBase == NULL) {
-	  fprintf(stderr, "PyMem_Malloc of arrayBase");
+      if (header->id == replayNNames) {
+	if ((partners = pydsmRealloc(replayPartners, (replayNNames+1)*sizeof(char *))) != NULL)
+	  replayPartners = partners;
+	if ((names = pydsmRealloc(replayNames, (replayNNames+1)*sizeof(char *))) != NULL)
+	  replayNames = names;
+	if ((partners == NULL) || (names == NULL)) {
 	  PyErr_NoMemory();
 	  return NULL;
 	}
-	if (buf != NULL)
-	  bcopy(buf, &arrayBase[0], arraySize * baseSize);
-	else if (structure != NULL)
-	  status = dsm_structure_get_element(structure, name, &arrayBase[0]);
-	else
-	  status = dsm_read(partner, name, &arrayBase[0], &timestamp);
-	if (status != DSM_SUCCESS) {
-	  if (dimensions != NULL)
-	    PyMem_Free(dimensions);
-	  raiseDSMError(status, "array DSM read or get_element");
-	  return NULL;
-	}
-	dprintf("dsm_read of array completed successfully, with a timestamp of %d\n", (int)timestamp);
-	makePyObjectTuple = PyTuple_New(2);
-	readTime = PyInt_FromLong((long)timestamp);
-	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)1, readTime);
+	replayPartners[replayNNames] = replayNames[replayNNames] = NULL;
+	replayNNames++;
+      }
+      pydsmFree(replayPartners[header->id]);
+      pydsmFree(replayNames[header->id]);
+      replayPartners[header->id] = pydsmStrdup(payload);
+      replayNames[header->id] = pydsmStrdup(partnerEnd+1);
+      if ((replayPartners[header->id] == NULL) || (replayNames[header->id] == NULL)) {
+	pydsmFree(replayPartners[header->id]);
+	pydsmFree(replayNames[header->id]);
+	replayPartners[header->id] = replayNames[header->id] = NULL;
+	PyErr_NoMemory();
+	return NULL;
+      }
+    }
+    replayOffset += sizeof(recordHeader) + header->size;
+  }
+}
 
-	/* More than one dimension, so we need container tuples to contain the data tuples */
-	nContainerTuples = 0;
-	for (i = 0; i < nDim-1; i++) {
-	  offset = 1;
-	  for (j = 0; j < nDim - i - 1; j++)
-	    offset *= dimensions[j];
-	  nContainerTuples += offset;
+/*
+  Returns a list of up to maxEvents (all in the current block, if maxEvents <= 0)
+  replayed events, waiting up to timeout seconds (forever if timeout < 0) for
+  the first to become due.   Raises EOFError, and ends the replay, when the log
+  is exhausted.
+*/
+PyObject *replayEventList(int maxEvents, double timeout)
+{
+  int nEvents = 0;
+  double due, wait;
+  char *payload;
+  recordHeader header;
+  PyObject *eventList, *eventTuple;
+
+  eventList = PyList_New(0);
+  if (eventList == NULL)
+    return NULL;
+  while ((maxEvents <= 0) || (nEvents < maxEvents)) {
+    if ((payload = peekReplayEvent(&header)) == NULL) {
+      if (!PyErr_Occurred() && (nEvents == 0))
+	PyErr_SetString(PyExc_EOFError, "end of pydsm recording");
+      if (PyErr_Occurred()) {
+	stopReplay();
+	Py_DECREF(eventList);
+	return NULL;
+      }
+      break;
+    }
+    if (replaySpeed > 0.0) {
+      if (replayFirstNs == 0) {
+	replayFirstNs = header.nanoseconds;
+	replayStart = wallClock();
+      }
+      due = replayStart + 1.0e-9*(double)(header.nanoseconds - replayFirstNs)/replaySpeed;
+      wait = due - wallClock();
+      if (wait > 0.0) {
+	if (nEvents > 0)
+	  break;
+	if ((timeout >= 0.0) && (wait > timeout)) {
+	  Py_BEGIN_ALLOW_THREADS
+	  sleepSeconds(timeout);
+	  Py_END_ALLOW_THREADS
+	  break;
 	}
-	nContainerTuples++;
-	dprintf("I will need %d container tuples\n", nContainerTuples);
-	containerTupleBase = (PyObject **)PyMem_Malloc(nContainerTuples*sizeof(PyObject *));
-	if (containerTupleBase == NULL) {
-	  fprintf(stderr, "PyMem_Malloc of container tuples");
-	  PyErr_NoMemory();
-	  return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	sleepSeconds(wait);
+	Py_END_ALLOW_THREADS
+      }
+    }
+    eventTuple = monitorEventTuple(replayPartners[header.id], replayNames[header.id], payload,
+				   (time_t)(header.nanoseconds/1000000000LL));
+    replayOffset += sizeof(recordHeader) + header.size;
+    if ((eventTuple == NULL) || (PyList_Append(eventList, eventTuple) != 0)) {
+      Py_XDECREF(eventTuple);
+      Py_DECREF(eventList);
+      return NULL;
+    }
+    Py_DECREF(eventTuple);
+    nEvents++;
+    if ((maxEvents <= 0) && (replayOffset + sizeof(recordHeader) > replayLength))
+      break;
+  }
+  return eventList;
+}
+
+static PyObject *pydsm_read_wait(PyObject *self)
+{
+  PyObject *readWaitTuple = NULL;
+  PyObject *replayList;
+  int status;
+
+  if (replayFile != NULL) {
+    if ((replayList = replayEventList(1, -1.0)) == NULL)
+      return NULL;
+    readWaitTuple = PyList_GetItem(replayList, 0);
+    Py_INCREF(readWaitTuple);
+    Py_DECREF(replayList);
+    return readWaitTuple;
+  }
+  if (monitorMaxSize <= 0) {
+    PyErr_SetString(dSMNothingMonitored, "DSM error: read_wait called with nothing monitored.");
+    return NULL;
+  }
+  status = open_dsm();
+  if (status == DSM_SUCCESS) {
+    if (readerRunning) {
+      monitorEvent *event;
+
+      /* The reader thread owns dsm_read_wait now, so take its next queued event */
+      Py_BEGIN_ALLOW_THREADS
+      event = takeMonitorEvents(1, -1.0);
+      Py_END_ALLOW_THREADS
+      readWaitTuple = monitorEventTuple(event->partner, event->name, event->data, event->timestamp);
+      pydsmFree(event);
+      return readWaitTuple;
+    } else {
+      int size;
+      char partner[DSM_NAME_LENGTH], allocName[DSM_NAME_LENGTH], *buf;
+
+      buf = pydsmMalloc(monitorMaxSize);
+      if (buf == NULL) {
+	fprintf(stderr, "pydsmMalloc failure for read_wait buffer\n");
+	PyErr_NoMemory();
+	return NULL;
+      }
+      do {
+	dprintf("Calling dsm_read_wait\n");
+	status = dsm_read_wait(partner, allocName, buf);
+	dprintf("Returned from read_wait - host = \"%s\", alloc = \"%s\"\n", partner, allocName);
+	if (status == DSM_SUCCESS) {
+	  if ((size = objectSize(allocName)) >= 0)
+	    monitorEventArrived(partner, allocName, buf, size, time(NULL));
+	  else
+	    PyErr_Clear();
 	}
-	myTuple = buildTuples(containerTupleBase, 0, nDim, dimensions, type, baseSize, arrayBase);
-	PyMem_Free(dimensions);
-	PyMem_Free(arrayBase);
-	PyMem_Free(containerTupleBase);
-	PyTuple_SetItem(makePyObjectTuple, (Py_ssize_t)0, myTuple);
-	return makePyObjectTuple;
+      } while ((status == DSM_SUCCESS) && !monitorFilter(partner, allocName, buf));
+      if (status == DSM_SUCCESS) {
+	readWaitTuple = monitorEventTuple(partner, allocName, buf, time(NULL));
+	pydsmFree(buf);
+	return readWaitTuple;
+      } else {
+	pydsmFree(buf);
+	raiseDSMError(status, "dsm_read_wait()");
+	return NULL;
       }
     }
+  } else
+    return NULL;
+}
+
+PyObject *readWaitMany(int maxEvents, PyObject *timeoutObject)
+{
+  double timeout = -1.0;
+  PyObject *eventList, *eventTuple;
+  monitorEvent *events, *event;
+
+  if ((timeoutObject != NULL) && (timeoutObject != Py_None)) {
+    timeout = PyFloat_AsDouble(timeoutObject);
+    if (PyErr_Occurred())
+      return NULL;
+    if (timeout < 0.0)
+      timeout = 0.0;
   }
-  return NULL;
+  if (replayFile != NULL)
+    return replayEventList(maxEvents, timeout);
+  if ((monitorMaxSize <= 0) && (timeout < 0.0)) {
+    PyErr_SetString(dSMNothingMonitored, "DSM error: read_wait_many called with nothing monitored and no timeout.");
+    return NULL;
+  }
+  if ((open_dsm() != DSM_SUCCESS) || (startMonitorReader() != DSM_SUCCESS))
+    return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  events = takeMonitorEvents(maxEvents, timeout);
+  Py_END_ALLOW_THREADS
+  eventList = PyList_New(0);
+  while ((event = events) != NULL) {
+    events = event->next;
+    if (eventList != NULL) {
+      eventTuple = monitorEventTuple(event->partner, event->name, event->data, event->timestamp);
+      if ((eventTuple == NULL) || (PyList_Append(eventList, eventTuple) != 0))
+	Py_CLEAR(eventList);
+      Py_XDECREF(eventTuple);
+    }
+    pydsmFree(event);
+  }
+  return eventList;
 }
 
-PyObject *handleStructure(char *partner, char *name)
+#ifndef PYDSM_FASTCALL
+static PyObject *pydsm_read_wait_many(PyObject *self, PyObject *args, PyObject *keyWords)
 {
-  static int firstCall = TRUE;
-  int status, i;
-  static int nhosts;
-  char *member = NULL;
-  dsm_structure structure;
-  static struct dsm_allocation_list *alp;
-  PyObject *item, *readTime;
-  PyObject *handleStructureDict;
-  time_t timestamp;
+  int maxEvents = 0;
+  static char *keyWordList[] = {"max_events", "timeout", NULL};
+  PyObject *timeoutObject = NULL;
 
-  dprintf("in handleStructure(%s, %s)\n", partner, name);
-  if (firstCall) {
-    dprintf("Reading DSM allocation list\n");
-    dsm_get_allocation_list(&nhosts, &alp);
-    firstCall = FALSE;
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "|iO", keyWordList, &maxEvents, &timeoutObject))
+    return NULL;
+  return readWaitMany(maxEvents, timeoutObject);
+}
+#else
+static PyObject *pydsm_read_wait_many_fast(PyObject *self, PyObject *const *args, Py_ssize_t nArgs, PyObject *kwNames)
+{
+  long maxEvents = 0;
+  static int parameters[] = {KEY_MAX_EVENTS, KEY_TIMEOUT};
+  PyObject *values[2];
+
+  if (!unpackArguments("read_wait_many", args, nArgs, kwNames, 0, 2, parameters, values))
+    return NULL;
+  if ((values[0] != NULL) && ((maxEvents = PyLong_AsLong(values[0])) == -1) && PyErr_Occurred())
+    return NULL;
+  return readWaitMany((int)maxEvents, values[1]);
+}
+#endif
+
+static PyObject *pydsm_monitor_fd(PyObject *self)
+{
+  if ((open_dsm() != DSM_SUCCESS) || (startMonitorReader() != DSM_SUCCESS))
+    return NULL;
+  return PyInt_FromLong((long)monitorPipe[0]);
+}
+
+/*
+  Returns {(partner, name): {'delivered': n, 'deadband': n, 'interval': n,
+  'dropped': n, 'coalesced': n}} for everything monitored.   dropped counts
+  events lost from a full queue, coalesced those overwritten in a rate
+  limited slot before read_wait took them.
+*/
+static PyObject *pydsm_monitor_stats(PyObject *self)
+{
+  PyObject *statsDict, *key, *counts;
+  monitorEntry *entry;
+
+  if ((statsDict = PyDict_New()) == NULL)
+    return NULL;
+  pthread_mutex_lock(&monitorMutex);
+  for (entry = monitorList; (entry != NULL) && (statsDict != NULL); entry = entry->next) {
+    key = Py_BuildValue("(ss)", entry->partner, entry->name);
+    counts = Py_BuildValue("{s:l,s:l,s:l,s:l,s:l}", "delivered", entry->delivered, "deadband", entry->deadbandDropped,
+			   "interval", entry->intervalDropped, "dropped", entry->queueDropped, "coalesced", entry->coalesced);
+    if ((key == NULL) || (counts == NULL) || (PyDict_SetItem(statsDict, key, counts) != 0))
+      Py_CLEAR(statsDict);
+    Py_XDECREF(key);
+    Py_XDECREF(counts);
   }
+  pthread_mutex_unlock(&monitorMutex);
+  return statsDict;
+}
 
-  status = dsm_structure_init(&structure, name);
-  if (status != DSM_SUCCESS) {
-    raiseDSMError(status, "init of structure");
+static PyObject *pydsm_memory_stats(PyObject *self)
+{
+  return Py_BuildValue("{s:l,s:l,s:l,s:l}", "live_bytes", liveBytes, "peak_bytes", peakBytes, "live_blocks", liveBlocks,
+		       "allocations", totalAllocations);
+}
+
+static PyObject *pydsm_record(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  char *path;
+  static char *keyWordList[] = {"path", "compress", NULL};
+  PyObject *compressObject = NULL;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "s|O", keyWordList, &path, &compressObject))
+    return NULL;
+  dprintf("Recording monitor events to \"%s\"\n", path);
+  if (startRecording(path, (compressObject != NULL) && PyObject_IsTrue(compressObject)) != DSM_SUCCESS)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *pydsm_record_stop(PyObject *self)
+{
+  stopRecording();
+  return Py_BuildValue("{s:l,s:l,s:L}", "events", recordedEvents, "dropped", recordDropped, "bytes", recordWrittenBytes);
+}
+
+static PyObject *pydsm_replay(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  char *path;
+  double speed = 0.0;
+  static char *keyWordList[] = {"path", "speed", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "z|d", keyWordList, &path, &speed))
     return NULL;
+  if (path == NULL) {
+    stopReplay();
+    Py_RETURN_NONE;
   }
-  status = dsm_read(partner, name, &structure, &timestamp);
-  if (status != DSM_SUCCESS) {
-    raiseDSMError(status, "Read of structure");
+  if (speed < 0.0) {
+    PyErr_SetString(dSMRangeError, "DSM error: replay speed can't be negative");
     return NULL;
   }
-  handleStructureDict = PyDict_New();
-  dprintf("nhosts = %d\n", nhosts);
-  for (i = 0; i < nhosts; i++) {
-    if (!strcmp(partner, alp[i].host_name)) {
-      int nEntries, j;
+  dprintf("Replaying monitor events from \"%s\", speed %f\n", path, speed);
+  if (startReplay(path, speed) != DSM_SUCCESS)
+    return NULL;
+  Py_RETURN_NONE;
+}
 
-      nEntries = alp[i].n_entries;
-      dprintf("Found my partner, with %d entries\n", nEntries);
-      for (j = 0; j < nEntries; j++) {
-	if (strstr(alp[i].alloc_list[j], name) == alp[i].alloc_list[j]) {
-	  member = &alp[i].alloc_list[j][strlen(name)+1];
-	  dprintf("Found member \"%s\"\n", member);
-	  if ((item = makePyObject(partner, &structure, member, NULL, (time_t)0, FALSE)) == NULL)
-	    return NULL;
-	  else {
-	    readTime = PyInt_FromLong((long)timestamp);
-	    PyTuple_SetItem(item, (Py_ssize_t)1, readTime);
-	    PyDict_SetItemString(handleStructureDict, member, item);
-	    Py_DECREF(item);
-	  }
-	}
+static PyObject *pydsm_reduce(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  int status, i, op, axis = -1, nRemaining = 0;
+  int ops = 0;
+  int remaining[16];
+  long o, k, outer, length, inner, nResults;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH], *buf, *opName;
+  double *values;
+  long *nanCounts;
+  time_t timestamp;
+  static char *keyWordList[] = {"partner", "name", "ops", "axis", NULL};
+  static char *opNames[] = {"min", "max", "sum", "mean", "std", "nan_count", NULL};
+  static int opBits[] = {REDUCE_MIN, REDUCE_MAX, REDUCE_SUM, REDUCE_MEAN, REDUCE_STD, REDUCE_NAN_COUNT};
+  PyObject *opsObject = NULL, *axisObject = Py_None, *opSequence, *resultDict, *value;
+  dsmDescriptor *descriptor;
+  reduction *results;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "O&O&|OO", keyWordList, partnerConverter, partner, nameConverter, name, &opsObject, &axisObject))
+    return NULL;
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  if ((descriptor = lookupDescriptor(name)) == NULL)
+    return NULL;
+  if ((descriptor->type == DSM_STRUCTURE) || (descriptor->type == DSM_STRING)) {
+    PyErr_SetString(dSMWrongType, "DSM error: pydsm.reduce needs a numeric variable");
+    return NULL;
+  }
+  if (opsObject == NULL)
+    ops = REDUCE_MIN | REDUCE_MAX | REDUCE_SUM | REDUCE_MEAN | REDUCE_STD | REDUCE_NAN_COUNT;
+  else {
+    if ((opSequence = PySequence_Fast(opsObject, "ops must be a sequence of strings")) == NULL)
+      return NULL;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(opSequence); i++) {
+      if ((opName = pyText(PySequence_Fast_GET_ITEM(opSequence, i))) == NULL) {
+	Py_DECREF(opSequence);
+	return NULL;
       }
-      break;
+      for (op = 0; (opNames[op] != NULL) && strcmp(opNames[op], opName); op++)
+	;
+      if (opNames[op] == NULL) {
+	Py_DECREF(opSequence);
+	PyErr_Format(dSMNotImplemented, "DSM error: unknown reduction \"%s\"", opName);
+	return NULL;
+      }
+      ops |= opBits[op];
+    }
+    Py_DECREF(opSequence);
+  }
+  /* The array is treated as outer blocks of length rows of inner elements, reduced over the rows */
+  outer = inner = 1;
+  length = descriptor->nElements;
+  if ((axisObject != Py_None) && (descriptor->nDim > 0)) {
+    axis = (int)PyInt_AsLong(axisObject);
+    if (PyErr_Occurred())
+      return NULL;
+    if (axis < 0)
+      axis += descriptor->nDim;
+    if ((axis < 0) || (axis >= descriptor->nDim) || (descriptor->nDim > 16)) {
+      PyErr_SetString(dSMRangeError, "DSM error: reduction axis is out of range");
+      return NULL;
+    }
+    length = descriptor->dimensions[axis];
+    for (i = 0; i < descriptor->nDim; i++)
+      if (i != axis) {
+	remaining[nRemaining++] = descriptor->dimensions[i];
+	if (i < axis)
+	  outer *= descriptor->dimensions[i];
+	else
+	  inner *= descriptor->dimensions[i];
+      }
+  }
+  nResults = outer*inner;
+  buf = pydsmMalloc(descriptor->size);
+  results = (reduction *)pydsmMalloc(nResults*sizeof(reduction));
+  values = (double *)pydsmMalloc(5*nResults*sizeof(double)); /* Also the column kernel's scratch space */
+  nanCounts = (long *)pydsmMalloc(nResults*sizeof(long));
+  if ((buf == NULL) || (results == NULL) || (values == NULL) || (nanCounts == NULL)) {
+    pydsmFree(buf);
+    pydsmFree(results);
+    pydsmFree(values);
+    pydsmFree(nanCounts);
+    PyErr_NoMemory();
+    return NULL;
+  }
+  status = readRaw(partner, name, buf, descriptor->size, &timestamp);
+  if (status != DSM_SUCCESS) {
+    pydsmFree(buf);
+    pydsmFree(results);
+    pydsmFree(values);
+    pydsmFree(nanCounts);
+    raiseDSMError(status, "pydsm.reduce dsm_read()");
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  for (o = 0; o < outer; o++)
+    if (inner == 1)
+      reduceContiguous(descriptor->type, &buf[o*length*descriptor->elementSize], length, &results[o]);
+    else
+      reduceColumns(descriptor->type, &buf[o*length*inner*descriptor->elementSize], length, inner,
+		    &results[o*inner], values, nanCounts);
+  Py_END_ALLOW_THREADS
+  pydsmFree(buf);
+  pydsmFree(nanCounts);
+  resultDict = PyDict_New();
+  for (op = 0; (opNames[op] != NULL) && (resultDict != NULL); op++) {
+    if (!(ops & opBits[op]))
+      continue;
+    if (nRemaining == 0) {
+      if (opBits[op] == REDUCE_NAN_COUNT)
+	value = PyInt_FromLong(results[0].nNaN);
+      else
+	value = PyFloat_FromDouble(reductionValue(&results[0], opBits[op]));
+    } else if (opBits[op] == REDUCE_NAN_COUNT) {
+      for (k = 0; k < nResults; k++)
+	((int *)values)[k] = (int)results[k].nNaN;
+      value = arrayToTuples((char *)values, DSM_LONG, 0, nRemaining, remaining);
+    } else {
+      for (k = 0; k < nResults; k++)
+	values[k] = reductionValue(&results[k], opBits[op]);
+      value = arrayToTuples((char *)values, DSM_DOUBLE, 0, nRemaining, remaining);
     }
+    if ((value == NULL) || (PyDict_SetItemString(resultDict, opNames[op], value) != 0))
+      Py_CLEAR(resultDict);
+    Py_XDECREF(value);
+  }
+  pydsmFree(results);
+  pydsmFree(values);
+  if (resultDict == NULL)
+    return NULL;
+  return Py_BuildValue("(Nl)", resultDict, (long)timestamp);
+}
+
+static PyObject *pydsm_shm_open(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  char *path = SHM_DEFAULT_PATH;
+  int nSlots = 1024;
+  int slotSize = 4096;
+  double maxAge = 1.0;
+  static char *keyWordList[] = {"path", "writer", "max_age", "slots", "slot_size", NULL};
+  PyObject *writerObject = NULL;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "|sOdii", keyWordList, &path, &writerObject, &maxAge, &nSlots, &slotSize))
+    return NULL;
+  if ((nSlots <= 0) || (slotSize <= 0)) {
+    PyErr_SetString(dSMRangeError, "DSM error: slots and slot_size must be positive");
+    return NULL;
+  }
+  dprintf("Mapping snapshot region \"%s\"\n", path);
+  if (shmMap(path, (writerObject != NULL) && PyObject_IsTrue(writerObject), nSlots, slotSize) != DSM_SUCCESS)
+    return NULL;
+  shmMaxAge = maxAge;
+  Py_RETURN_NONE;
+}
+
+static PyObject *pydsm_shm_close(PyObject *self)
+{
+  shmUnmap();
+  Py_RETURN_NONE;
+}
+
+/* Reads a variable in the writer process, which also stores it in its snapshot slot */
+int shmRefresh(char *partner, char *name)
+{
+  int status, size;
+  char *buf;
+  time_t timestamp;
+
+  if ((size = objectSize(name)) < 0)
+    return DSM_ERROR;
+  buf = pydsmMalloc(size);
+  if (buf == NULL) {
+    fprintf(stderr, "pydsmMalloc failure for snapshot buffer of \"%s\"\n", name);
+    PyErr_NoMemory();
+    return DSM_ERROR;
   }
-  dsm_structure_destroy(&structure);
-  return handleStructureDict;
+  status = readRaw(partner, name, buf, size, &timestamp);
+  pydsmFree(buf);
+  if (status != DSM_SUCCESS)
+    raiseDSMError(status, "snapshot dsm_read()");
+  return status;
 }
 
-static PyObject *pydsm_read(PyObject *self, PyObject *args)
+static PyObject *pydsm_shm_publish(PyObject *self, PyObject *args)
 {
-  int status;
-  static char *name = NULL;
-  static char *partner = NULL;
-  PyObject *readTuple = NULL;
-  PyObject *retObject = NULL;
+  int size;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
 
-  status = open_dsm();
-  if (status == DSM_SUCCESS) {
-    if (!PyArg_ParseTuple(args, "ss", &partner, &name))
-      return NULL;
-    fixNames(partner, name);
-    /* printf("pydsm_read: read request for \"%s\" on \"%s\"\n", name, partner); */
-    /* printf("\"%s\"\n", name); */
-    if (toupper(name[strlen(name)-1]) == 'X')
-      readTuple = handleStructure(partner, name);
-    else {
-      readTuple = makePyObject(partner, NULL, name, NULL, (time_t)0, FALSE);
-    }
-    if (readTuple == NULL)
-      return NULL;
-    else {
-      retObject = Py_BuildValue("O", readTuple);
-      Py_DECREF(readTuple);
-      return retObject;
-    }
-  } else
+  if ((shmRegion == NULL) || !shmWriter) {
+    PyErr_SetString(dSMNoResource, "DSM error: shm_publish needs a snapshot region opened with writer=True");
+    return NULL;
+  }
+  if (!PyArg_ParseTuple(args, "O&O&", partnerConverter, partner, nameConverter, name))
+    return NULL;
+  if (toupper(name[strlen(name)-1]) == 'X') {
+    PyErr_SetString(dSMNotImplemented, "DSM error: Structures can't be kept in the snapshot region");
+    return NULL;
+  }
+  if ((size = objectSize(name)) < 0)
+    return NULL;
+  if (size > ((shmHeader *)shmRegion)->slotSize) {
+    PyErr_SetString(dSMRangeError, "DSM error: variable is too large for a snapshot slot");
+    return NULL;
+  }
+  if (shmFindSlot(partner, name, TRUE) == NULL) {
+    PyErr_SetString(dSMNoResource, "DSM error: snapshot region is full");
+    return NULL;
+  }
+  if ((open_dsm() != DSM_SUCCESS) || (shmRefresh(partner, name) != DSM_SUCCESS))
     return NULL;
+  Py_RETURN_NONE;
 }
 
-static PyObject *pydsm_read_wait(PyObject *self)
+/* Re-reads every published variable - for writers whose variables aren't all monitored */
+static PyObject *pydsm_shm_refresh(PyObject *self)
 {
-  PyObject *readWaitTuple = NULL;
-  PyObject *returnTuple;
-  int status;
+  int i, nRefreshed = 0;
+  shmSlot *slot;
 
-  if (monitorMaxSize <= 0) {
-    PyErr_SetString(dSMNothingMonitored, "DSM error: read_wait called with nothing monitored.");
+  if ((shmRegion == NULL) || !shmWriter) {
+    PyErr_SetString(dSMNoResource, "DSM error: shm_refresh needs a snapshot region opened with writer=True");
     return NULL;
   }
-  status = open_dsm();
-  if (status == DSM_SUCCESS) {
-    char partner[DSM_NAME_LENGTH], allocName[DSM_NAME_LENGTH], *buf;
-
-    buf = PyMem_Malloc(monitorMaxSize);
-    if (buf == NULL) {
-      fprintf(stderr, "PyMem_Malloc failure for read_wait buffer\n");
-      PyErr_NoMemory();
-      return NULL;
-    }
-    dprintf("Calling dsm_read_wait\n");
-    status = dsm_read_wait(partner, allocName, buf);
-    dprintf("Returned from read_wait - host = \"%s\", alloc = \"%s\"\n", partner, allocName);
-    if (status == DSM_SUCCESS) {
-      PyObject *partnerObj, *allocNameObj;
-      time_t theTime;
-
-      readWaitTuple = PyTuple_New(3);
-      partnerObj = PyString_FromString(partner);
-      PyTuple_SetItem(readWaitTuple, (Py_ssize_t)0, partnerObj);
-      allocNameObj = PyString_FromString(allocName);
-      PyTuple_SetItem(readWaitTuple, (Py_ssize_t)1, allocNameObj);
-      theTime = time(NULL);
-      PyTuple_SetItem(readWaitTuple, (Py_ssize_t)2, makePyObject(partner, NULL, allocName, buf, theTime, FALSE));
-      PyMem_Free(buf);
-      returnTuple = Py_BuildValue("O", readWaitTuple);
-      Py_DECREF(readWaitTuple);
-      return returnTuple;
-    } else {
-      PyMem_Free(buf);
-      return NULL;
-    }
-  } else
+  if (open_dsm() != DSM_SUCCESS)
     return NULL;
-  Py_RETURN_NONE; /* This statement can't be reached.   It's here to prevent a compiler warning */
+  for (i = 0; i < ((shmHeader *)shmRegion)->nSlots; i++) {
+    slot = shmSlotAt(i);
+    if (slot->inUse) {
+      if (shmRefresh(slot->partner, slot->name) == DSM_SUCCESS)
+	nRefreshed++;
+      else
+	PyErr_Clear();
+    }
+  }
+  return PyInt_FromLong((long)nRefreshed);
 }
 
 int getElement(PyObject *data, int nDim, int *indices, int type, char *buffer, int size)
@@ -761,7 +5729,8 @@ int getElement(PyObject *data, int nDim, int *indices, int type, char *buffer, i
   }
   if (error)
     return DSM_ERROR;
-  item = PySequence_GetItem(item, indices[nDim-1]);
+  if ((item = PySequence_GetItem(item, indices[nDim-1])) == NULL)
+    return DSM_ERROR;
   switch (type) {
   case DSM_BYTE:
     tLong = PyLong_AsLong(item);
@@ -769,6 +5738,7 @@ int getElement(PyObject *data, int nDim, int *indices, int type, char *buffer, i
     if ((SCHAR_MIN > tLong) || (tLong > SCHAR_MAX)) {
       fprintf(stderr, "%ld is out-of-range for a signed byte integer", tLong);
       PyErr_SetString(dSMRangeError, "DSM error: Value to be written is out of range");
+      Py_DECREF(item);
       return DSM_ERROR;
     }
     tByte = (char)tLong;
@@ -780,6 +5750,7 @@ int getElement(PyObject *data, int nDim, int *indices, int type, char *buffer, i
     if ((SHRT_MIN > tLong) || (tLong > SHRT_MAX)) {
       fprintf(stderr, "%ld is out-of-range for a signed short integer", tLong);
       PyErr_SetString(dSMRangeError, "DSM error: Value to be written is out of range");
+      Py_DECREF(item);
       return DSM_ERROR;
     }
     tShort = (short)tLong;
@@ -801,20 +5772,24 @@ int getElement(PyObject *data, int nDim, int *indices, int type, char *buffer, i
     *((double *)buffer) = tDouble;
     break;
   case DSM_STRING:
-    tString = PyString_AsString(item);
+    if ((tString = pyText(item)) == NULL) {
+      Py_DECREF(item);
+      return DSM_ERROR;
+    }
     dprintf("Got back a string of \"%s\"\n", tString);
     if (strlen(tString) > (size-1)) {
       PyErr_SetString(dSMRangeError, "DSM error: Sring passes to pydsm.write() is too large for target variable");
+      Py_DECREF(item);
       return DSM_ERROR;
     } else
       strncpy(buffer, tString, size);
     break;
   default:
     PyErr_SetString(dSMNotImplemented, "DSM error: Unrecognized scalar type");
+    Py_DECREF(item);
     return DSM_ERROR;
   }
-  if (item != data)
-    Py_XDECREF(item);
+  Py_DECREF(item);
   return DSM_SUCCESS;
 }
 
@@ -845,9 +5820,9 @@ int buildArray(PyObject *data, int nDim, int *dimensions, int type, char **bigAr
     fprintf(stderr, "buildArray: Unrecognized type (%d)\n", type);
     return DSM_ERROR;
   }
-  indices = PyMem_Malloc(nDim*sizeof(int));
+  indices = pydsmMalloc(nDim*sizeof(int));
   if (indices == NULL) {
-    fprintf(stderr, "PyMem_Malloc of indices");
+    fprintf(stderr, "pydsmMalloc of indices");
     PyErr_NoMemory();
     return DSM_ERROR;
   }
@@ -856,9 +5831,10 @@ int buildArray(PyObject *data, int nDim, int *dimensions, int type, char **bigAr
     indices[i] = 0;
     nElements *= dimensions[i];
   }
-  *bigArray = PyMem_Malloc(nElements * size);
+  *bigArray = pydsmMalloc(nElements * size);
   if (*bigArray == NULL) {
-    fprintf(stderr, "PyMem_Malloc of bigArray");
+    fprintf(stderr, "pydsmMalloc of bigArray");
+    pydsmFree(indices);
     PyErr_NoMemory();
     return DSM_ERROR;
   }
@@ -869,7 +5845,7 @@ int buildArray(PyObject *data, int nDim, int *dimensions, int type, char **bigAr
     dprintf(": ");
     status = getElement(data, nDim, indices, type, &((*bigArray)[el*size]), size);
     if (status != DSM_SUCCESS) {
-      PyMem_Free(indices);
+      pydsmFree(indices);
       return DSM_ERROR;
     }
     indices[nDim-1]++;
@@ -880,166 +5856,147 @@ int buildArray(PyObject *data, int nDim, int *dimensions, int type, char **bigAr
 	  indices[i-1]++;
       }
   }
-  PyMem_Free(indices);
+  pydsmFree(indices);
   return DSM_SUCCESS;
 }
 
-int writeObject(char *partner, char *name, PyObject *data, int notify, dsm_structure *structure)
+/*
+  Converts data to the raw form of the (non-structure) variable "name", in
+  a pydsmMalloc buffer which the caller must free.   Returns DSM_SUCCESS, or
+  DECODE_ERROR with a Python exception set.
+*/
+int encodeObject(char *name, PyObject *data, char **raw, int *rawSize)
 {
-  char tByte;
-  short tShort;
-  int status = DSM_SUCCESS;
   int type, nDim;
   int *dimensions = NULL;
   long tLong;
-  float tFloat;
-  double tDouble;
+  char *string;
+  dsmDescriptor *descriptor;
 
-  if ((status = decodeObject(name, &type, &nDim, &dimensions)) != DSM_SUCCESS) {
-    fprintf(stderr, "Error %d returned by decodeObject *%s)\n", status, name);
-    if (dimensions != NULL)
-      PyMem_Free(dimensions);
-    return DSM_ERROR;
+  *raw = NULL;
+  if ((descriptor = lookupDescriptor(name)) == NULL)
+    return DECODE_ERROR;
+  if (descriptor->type == DSM_STRUCTURE) {
+    PyErr_SetString(dSMWrongType, "DSM error: A structure can't be encoded as a single value");
+    return DECODE_ERROR;
   }
-  if (nDim == 0) {
+  *rawSize = descriptor->size;
+  if ((descriptor->nDim == 0) && (descriptor->type != DSM_STRING)) {
     /* Easiest case: just a single value */
-
-    if (dimensions != NULL)
-      PyMem_Free(dimensions);
     dprintf("Handling a simple scalar (%s)\n", name);
-    switch (type) {
+    *raw = pydsmMalloc(descriptor->size);
+    if (*raw == NULL) {
+      PyErr_NoMemory();
+      return DECODE_ERROR;
+    }
+    switch (descriptor->type) {
     case DSM_BYTE:
+    case DSM_SHORT:
+    case DSM_LONG:
       tLong = PyLong_AsLong(data);
       dprintf("Got a value of %d decoded\n", (int)tLong);
-      if ((SCHAR_MIN > tLong) || (tLong > SCHAR_MAX)) {
+      if (PyErr_Occurred())
+	break;
+      if ((descriptor->type == DSM_BYTE) && ((SCHAR_MIN > tLong) || (tLong > SCHAR_MAX))) {
 	fprintf(stderr, "%ld is out-of-range for a signed byte integer (%s)", tLong, name);
 	PyErr_SetString(dSMRangeError, "DSM error: Value to be written is out of range");
-	return DSM_ERROR;
-      }
-      tByte = (char)tLong;
-      if (structure == NULL) {
-	if (notify)
-	  status = dsm_write_notify(partner, name, &tByte);
-	else
-	  status = dsm_write(partner, name, &tByte);
-      } else
-	status = dsm_structure_set_element(structure, name, &tByte);
-      break;
-    case DSM_SHORT:
-      tLong = PyLong_AsLong(data);
-      dprintf("Got a value of %d decoded\n", (int)tLong);
-      if ((SHRT_MIN > tLong) || (tLong > SHRT_MAX)) {
+      } else if ((descriptor->type == DSM_SHORT) && ((SHRT_MIN > tLong) || (tLong > SHRT_MAX))) {
 	fprintf(stderr, "%ld is out-of-range for a signed short integer (%s)", tLong, name);
 	PyErr_SetString(dSMRangeError, "DSM error: Value to be written is out of range");
-	return DSM_ERROR;
-      }
-      tShort = (short)tLong;
-      if (structure == NULL) {
-	if (notify)
-	  status = dsm_write_notify(partner, name, &tShort);
-	else
-	  status = dsm_write(partner, name, &tShort);
-      } else
-	status = dsm_structure_set_element(structure, name, &tShort);
-      break;
-    case DSM_LONG:
-      tLong = PyLong_AsLong(data);
-      dprintf("Got a value of %d decoded\n", (int)tLong);
-      if (structure == NULL) {
-	if (notify)
-	  status = dsm_write_notify(partner, name, &tLong);
-	else
-	  status = dsm_write(partner, name, &tLong);
-      } else
-	status = dsm_structure_set_element(structure, name, &tLong);
+      } else if (descriptor->type == DSM_BYTE)
+	*((char *)*raw) = (char)tLong;
+      else if (descriptor->type == DSM_SHORT)
+	*((short *)*raw) = (short)tLong;
+      else
+	*((int *)*raw) = (int)tLong;
       break;
     case DSM_FLOAT:
-      tFloat = (float)PyFloat_AsDouble(data);
-      dprintf("Data decoded to %f\n", tFloat);
-      if (structure == NULL) {
-	if (notify)
-	  status = dsm_write_notify(partner, name, &tFloat);
-	else
-	  status = dsm_write(partner, name, &tFloat);
-      } else
-	status = dsm_structure_set_element(structure, name, &tFloat);
-      break;
-    case DSM_DOUBLE:
-      tDouble = PyFloat_AsDouble(data);
-      dprintf("Data decoded to %f\n", tDouble);
-      if (structure == NULL) {
-	if (notify)
-	  status = dsm_write_notify(partner, name, &tDouble);
-	else
-	  status = dsm_write(partner, name, &tDouble);
-      } else
-	status = dsm_structure_set_element(structure, name, &tDouble);
+      *((float *)*raw) = (float)PyFloat_AsDouble(data);
+      dprintf("Data decoded to %f\n", *((float *)*raw));
       break;
     default:
-      PyErr_SetString(dSMNotImplemented, "DSM error: Unrecognized scalar type");
-      return DSM_ERROR;
+      *((double *)*raw) = PyFloat_AsDouble(data);
+      dprintf("Data decoded to %f\n", *((double *)*raw));
     }
-  } else if ((nDim == 1) && (type == DSM_STRING)) {
-    char *string;
-
+  } else if ((descriptor->nDim == 0) && (descriptor->type == DSM_STRING)) {
     /* Second easiest case - a single string */
-    if (dimensions != NULL)
-      PyMem_Free(dimensions);
-    string = PyString_AsString(data);
-    if (string == NULL)
-      return DSM_ERROR;
+    if ((string = pyText(data)) == NULL)
+      return DECODE_ERROR;
     dprintf("Writing a simple string \"%s\"\n", string);
-    if (structure == NULL) {
-      if (notify)
-	status = dsm_write_notify(partner, name, string);
-      else
-	status = dsm_write(partner, name, string);
-    } else
-      status = dsm_structure_set_element(structure, name, string);
+    if (strlen(string) > (descriptor->size-1)) {
+      PyErr_SetString(dSMRangeError, "DSM error: String passed to pydsm.write() is too large for target variable");
+      return DECODE_ERROR;
+    }
+    *raw = pydsmMalloc(descriptor->size);
+    if (*raw == NULL) {
+      PyErr_NoMemory();
+      return DECODE_ERROR;
+    }
+    bzero(*raw, descriptor->size);
+    strcpy(*raw, string);
   } else {
-    char *writeArray;
-
-    dprintf("Handling an array of dimension %d\n", nDim);
-    buildArray(data, nDim, dimensions, type, &writeArray);
-    if (dimensions != NULL)
-      PyMem_Free(dimensions);
-    if (PyErr_Occurred()) {
-	PyErr_SetString(dSMDecodeError, "DSM error: Could not decode all elements in tuple/list passed to pydsm.write().   This probably indicates a dimensionality problem or data type error.");
-      PyMem_Free(writeArray);
+    dprintf("Handling an array of dimension %d\n", descriptor->nDim);
+    if (decodeObject(name, &type, &nDim, &dimensions) != DSM_SUCCESS) {
+      if (dimensions != NULL)
+	pydsmFree(dimensions);
       return DECODE_ERROR;
-    } else {
-      if (structure == NULL) {
-	if (notify)
-	  status = dsm_write_notify(partner, name, writeArray);
-	else
-	  status = dsm_write(partner, name, writeArray);
-      } else
-	status = dsm_structure_set_element(structure, name, writeArray);
-      PyMem_Free(writeArray);
     }
+    buildArray(data, nDim, dimensions, type, raw);
+    pydsmFree(dimensions);
+    if (PyErr_Occurred())
+      PyErr_SetString(dSMDecodeError, "DSM error: Could not decode all elements in tuple/list passed to pydsm.write().   This probably indicates a dimensionality problem or data type error.");
   }
+  if (PyErr_Occurred()) {
+    pydsmFree(*raw);
+    *raw = NULL;
+    return DECODE_ERROR;
+  }
+  return DSM_SUCCESS;
+}
+
+int writeRaw(char *partner, char *name, char *raw, int size, int notify, dsm_structure *structure, double deadline)
+{
+  if (structure != NULL)
+    return dsm_structure_set_element(structure, name, raw);
+  cacheUpdate(partner, name, NULL, 0, 0); /* A subscribed value must be fetched again, unless notify brings it back */
+  return remoteCallWithin(notify ? REMOTE_NOTIFY : REMOTE_WRITE, partner, name, raw, size, FALSE, NULL, deadline);
+}
+
+/* After DSM_TIMED_OUT the late write owns the structure, so the caller mustn't destroy it */
+int writeStructure(char *partner, char *name, dsm_structure *structure, int notify, double deadline)
+{
+  cacheUpdate(partner, name, NULL, 0, 0);
+  return remoteCallWithin(notify ? REMOTE_NOTIFY : REMOTE_WRITE, partner, name, structure, 0, TRUE, NULL, deadline);
+}
+
+int writeObject(char *partner, char *name, PyObject *data, int notify, dsm_structure *structure, double deadline)
+{
+  int status, size;
+  char *raw;
+
+  if ((status = encodeObject(name, data, &raw, &size)) != DSM_SUCCESS)
+    return status;
+  status = writeRaw(partner, name, raw, size, notify, structure, deadline);
+  pydsmFree(raw);
   return status;
 }
 
-static PyObject *pydsm_write(PyObject *self, PyObject *args, PyObject *keyWords)
+PyObject *writeVariable(char *partner, char *name, PyObject *data, PyObject *notifyObject, PyObject *timeoutObject)
 {
-  char *partner, *name;
   int status;
   int notify = FALSE;
+  double deadline;
   time_t timestamp;
-  static char *keyWordList[] = {"partner", "name", "data", "notify", NULL};
-  PyObject *notifyObject = NULL;
-  PyObject *data;
 
   status = open_dsm();
   if (status == DSM_SUCCESS) {
-    if (!PyArg_ParseTupleAndKeywords(args, keyWords, "ssO|O", keyWordList, &partner, &name, &data, &notifyObject))
+    if ((deadline = deadlineFor(timeoutObject)) < 0.0)
       return NULL;
-    fixNames(partner, name);
     if (notifyObject != NULL)
       notify = PyObject_IsTrue(notifyObject);
     dprintf("pydsm_write: write request for \"%s\" on \"%s\" notify = %d\n", name, partner, notify);
     if (strlen(name) < 2) {
+      PyErr_SetString(dSMIllegalName, "DSM error: Illegal Name");
       return NULL;
     } else if (name[strlen(name)-1] == 'X') {
       int i, nKeys;
@@ -1057,42 +6014,48 @@ static PyObject *pydsm_write(PyObject *self, PyObject *args, PyObject *keyWords)
 	raiseDSMError(status, "init of structure");
 	return NULL;
       }
-      status = dsm_read(partner, name, &structure, &timestamp);
+      status = remoteCallWithin(REMOTE_READ, partner, name, &structure, 0, TRUE, &timestamp, deadline);
       if (status != DSM_SUCCESS) {
+	if (status != DSM_TIMED_OUT)
+	  dsm_structure_destroy(&structure);
 	raiseDSMError(status, "pydsm.write() Read of structure");
 	return NULL;
       }
       keys = PyDict_Keys(data);
-      if (keys == NULL)
+      if (keys == NULL) {
+	dsm_structure_destroy(&structure);
 	return NULL;
+      }
       nKeys = PyList_Size(keys);
       dprintf("There are %d keys\n", nKeys);
       for (i = 0; i < nKeys; i++) {
 	item = PyList_GetItem(keys, i);
-	key = PyString_AsString(item);
+	if ((key = pyText(item)) == NULL) {
+	  status = DECODE_ERROR; /* Not a string, and the exception is already set */
+	  break;
+	}
 	dprintf("Processing key %d: \"%s\"\n", i, key);
-	item = PyDict_GetItemString(data, key);
-	if (item == NULL)
-	  return NULL; /* Should be impossible */
-	status = writeObject(partner, key, item, notify, &structure);
+	item = PyDict_GetItem(data, PyList_GET_ITEM(keys, i));
+	status = writeObject(partner, key, item, notify, &structure, 0.0);
 	if (status != DSM_SUCCESS) {
 	  if (status != DECODE_ERROR)
 	    raiseDSMError(status, "pydsm_write");
-	  return NULL;
+	  break;
 	}	
       }
-      Py_XDECREF(keys);
-      if (notify)
-	status = dsm_write(partner, name, &structure);
-      else
-	status = dsm_write_notify(partner, name, &structure);
-      if (status != DSM_SUCCESS) {
-	raiseDSMError(status, "pydsm.write() Write of structure");
-	return NULL;
+      Py_DECREF(keys);
+      if (status == DSM_SUCCESS) {
+	/* pydsm.write has always notified structure writes only when notify is False */
+	status = writeStructure(partner, name, &structure, !notify, deadline);
+	if (status != DSM_SUCCESS)
+	  raiseDSMError(status, "pydsm.write() Write of structure");
       }
-      dsm_structure_destroy(&structure);
+      if (status != DSM_TIMED_OUT)
+	dsm_structure_destroy(&structure);
+      if (status != DSM_SUCCESS)
+	return NULL;
     } else {
-      status = writeObject(partner, name, data, notify, NULL);
+      status = writeObject(partner, name, data, notify, NULL, deadline);
       if (status != DSM_SUCCESS) {
 	if (status != DECODE_ERROR)
 	  raiseDSMError(status, "pydsm_write");
@@ -1104,25 +6067,444 @@ static PyObject *pydsm_write(PyObject *self, PyObject *args, PyObject *keyWords)
   Py_RETURN_NONE;
 }
 
+#ifndef PYDSM_FASTCALL
+static PyObject *pydsm_write(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  static char *keyWordList[] = {"partner", "name", "data", "notify", "timeout", NULL};
+  PyObject *data, *notifyObject = NULL, *timeoutObject = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "O&O&O|OO", keyWordList, partnerConverter, partner,
+				   nameConverter, name, &data, &notifyObject, &timeoutObject))
+    return NULL;
+  return writeVariable(partner, name, data, notifyObject, timeoutObject);
+}
+#else
+static PyObject *pydsm_write_fast(PyObject *self, PyObject *const *args, Py_ssize_t nArgs, PyObject *kwNames)
+{
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  static int parameters[] = {KEY_PARTNER, KEY_NAME, KEY_DATA, KEY_NOTIFY, KEY_TIMEOUT};
+  PyObject *values[5];
+
+  if (!unpackArguments("write", args, nArgs, kwNames, 3, 5, parameters, values) ||
+      !partnerConverter(values[0], partner) || !nameConverter(values[1], name))
+    return NULL;
+  return writeVariable(partner, name, values[2], values[3], ARGUMENT(values[4], Py_None));
+}
+#endif
+
+typedef struct {
+  char partner[DSM_NAME_LENGTH];
+  char *name;
+  char *raw;           /* Shared by every job */
+  int size;
+  int nMembers;        /* For structures, the members to set, also shared */
+  char **memberNames;
+  char **memberRaw;
+  int isStructure;
+  int notify;
+  int status;
+  double deadline;     /* Shared by every job, 0 for none */
+  double latency;
+} writeJob;
+
+void writeJobWork(void *arg)
+{
+  int i, initialized = FALSE;
+  double start;
+  time_t timestamp;
+  dsm_structure structure;
+  writeJob *job = (writeJob *)arg;
+
+  start = wallClock();
+  if (job->isStructure) {
+    /* Members not being written keep the values this partner already has */
+    job->status = dsm_structure_init(&structure, job->name);
+    initialized = (job->status == DSM_SUCCESS);
+    if (job->status == DSM_SUCCESS)
+      job->status = remoteCallWithin(REMOTE_READ, job->partner, job->name, &structure, 0, TRUE, &timestamp, job->deadline);
+    for (i = 0; (i < job->nMembers) && (job->status == DSM_SUCCESS); i++)
+      job->status = dsm_structure_set_element(&structure, job->memberNames[i], job->memberRaw[i]);
+    if (job->status == DSM_SUCCESS)
+      job->status = writeStructure(job->partner, job->name, &structure, job->notify, job->deadline);
+    if (initialized && (job->status != DSM_TIMED_OUT))
+      dsm_structure_destroy(&structure);
+  } else
+    job->status = writeRaw(job->partner, job->name, job->raw, job->size, job->notify, NULL, job->deadline);
+  job->latency = wallClock() - start;
+}
+
+PyObject *writeAll(char *name, PyObject *data, PyObject *partnersObject, PyObject *notifyObject, int maxParallel,
+		   PyObject *timeoutObject)
+{
+  int i, nJobs, nMembers = 0, size = 0;
+  int isStructure, notify = FALSE;
+  double deadline;
+  char *partner, *key;
+  char *raw = NULL, **memberNames = NULL, **memberRaw = NULL;
+  Py_ssize_t position = 0;
+  PyObject *partnerSequence = NULL, *resultDict = NULL, *status, *keyObject, *item;
+  writeJob *jobs = NULL;
+
+  if ((deadline = deadlineFor(timeoutObject)) < 0.0)
+    return NULL;
+  if (open_dsm() != DSM_SUCCESS)
+    return NULL;
+  if (name[0] == (char)0) {
+    PyErr_SetString(dSMIllegalName, "DSM error: Illegal Name");
+    return NULL;
+  }
+  if (notifyObject != NULL)
+    notify = PyObject_IsTrue(notifyObject);
+  isStructure = (name[strlen(name)-1] == 'X');
+  /* Encode the value once, whatever the number of partners */
+  if (isStructure) {
+    if (!PyDict_Check(data)) {
+      PyErr_SetString(dSMWrongType, "DSM error: Wrong type of data object passed to pydsm.write_all - must be a dictionary.");
+      return NULL;
+    }
+    memberNames = (char **)pydsmMalloc((PyDict_Size(data)+1)*sizeof(char *));
+    memberRaw = (char **)pydsmMalloc((PyDict_Size(data)+1)*sizeof(char *));
+    if ((memberNames == NULL) || (memberRaw == NULL)) {
+      PyErr_NoMemory();
+      goto cleanUp;
+    }
+    while (PyDict_Next(data, &position, &keyObject, &item)) {
+      if ((key = pyText(keyObject)) == NULL)
+	goto cleanUp;
+      /* A copy, as the pool threads use it without the GIL, while data could change */
+      if ((memberNames[nMembers] = pydsmStrdup(key)) == NULL) {
+	PyErr_NoMemory();
+	goto cleanUp;
+      }
+      memberRaw[nMembers++] = NULL;
+      if (encodeObject(key, item, &memberRaw[nMembers-1], &size) != DSM_SUCCESS)
+	goto cleanUp;
+    }
+  } else if (encodeObject(name, data, &raw, &size) != DSM_SUCCESS)
+    return NULL;
+  if (partnersObject == Py_None)
+    partnerSequence = hostsWithAllocation(name);
+  else
+    partnerSequence = PySequence_Fast(partnersObject, "partners must be a sequence of host names");
+  if (partnerSequence == NULL)
+    goto cleanUp;
+  nJobs = (int)PySequence_Fast_GET_SIZE(partnerSequence);
+  jobs = (writeJob *)pydsmMalloc((nJobs > 0 ? nJobs : 1)*sizeof(writeJob));
+  if (jobs == NULL) {
+    PyErr_NoMemory();
+    goto cleanUp;
+  }
+  for (i = 0; i < nJobs; i++) {
+    if (((partner = pyText(PySequence_Fast_GET_ITEM(partnerSequence, i))) == NULL) ||
+	(copyPartner(jobs[i].partner, partner) != DSM_SUCCESS))
+      goto cleanUp;
+    jobs[i].name = name;
+    jobs[i].raw = raw;
+    jobs[i].size = size;
+    jobs[i].deadline = deadline;
+    jobs[i].nMembers = nMembers;
+    jobs[i].memberNames = memberNames;
+    jobs[i].memberRaw = memberRaw;
+    jobs[i].isStructure = isStructure;
+    jobs[i].notify = notify;
+  }
+  dprintf("pydsm_write_all: writing \"%s\" to %d partners, %d at a time\n", name, nJobs, maxParallel);
+  Py_BEGIN_ALLOW_THREADS
+  runParallel(writeJobWork, jobs, sizeof(writeJob), nJobs, maxParallel);
+  Py_END_ALLOW_THREADS
+  resultDict = PyDict_New();
+  for (i = 0; (i < nJobs) && (resultDict != NULL); i++) {
+    if (jobs[i].status == DSM_SUCCESS) {
+      Py_INCREF(Py_None);
+      status = Py_None;
+    } else
+      status = dsmErrorObject(jobs[i].status, "pydsm_write_all");
+    item = Py_BuildValue("(Nd)", status, jobs[i].latency);
+    if ((item == NULL) || (PyDict_SetItem(resultDict, PySequence_Fast_GET_ITEM(partnerSequence, i), item) != 0))
+      Py_CLEAR(resultDict);
+    Py_XDECREF(item);
+  }
+ cleanUp:
+  for (i = 0; i < nMembers; i++) {
+    pydsmFree(memberNames[i]);
+    pydsmFree(memberRaw[i]);
+  }
+  pydsmFree(memberNames);
+  pydsmFree(memberRaw);
+  pydsmFree(raw);
+  pydsmFree(jobs);
+  Py_XDECREF(partnerSequence);
+  return resultDict;
+}
+
+#ifndef PYDSM_FASTCALL
+static PyObject *pydsm_write_all(PyObject *self, PyObject *args, PyObject *keyWords)
+{
+  int maxParallel = DEFAULT_PARALLEL;
+  char name[DSM_NAME_LENGTH];
+  static char *keyWordList[] = {"name", "data", "partners", "notify", "max_parallel", "timeout", NULL};
+  PyObject *data, *partnersObject = Py_None, *notifyObject = NULL, *timeoutObject = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, keyWords, "O&O|OOiO", keyWordList, nameConverter, name, &data,
+				   &partnersObject, &notifyObject, &maxParallel, &timeoutObject))
+    return NULL;
+  return writeAll(name, data, partnersObject, notifyObject, maxParallel, timeoutObject);
+}
+#else
+static PyObject *pydsm_write_all_fast(PyObject *self, PyObject *const *args, Py_ssize_t nArgs, PyObject *kwNames)
+{
+  long maxParallel = DEFAULT_PARALLEL;
+  char name[DSM_NAME_LENGTH];
+  static int parameters[] = {KEY_NAME, KEY_DATA, KEY_PARTNERS, KEY_NOTIFY, KEY_MAX_PARALLEL, KEY_TIMEOUT};
+  PyObject *values[6];
+
+  if (!unpackArguments("write_all", args, nArgs, kwNames, 2, 6, parameters, values) ||
+      !nameConverter(values[0], name))
+    return NULL;
+  if ((values[4] != NULL) && ((maxParallel = PyLong_AsLong(values[4])) == -1) && PyErr_Occurred())
+    return NULL;
+  return writeAll(name, values[1], ARGUMENT(values[2], Py_None), values[3], (int)maxParallel,
+		  ARGUMENT(values[5], Py_None));
+}
+#endif
+
+/*
+  The C API in pydsm_capi.h, exported as the capsule pydsm._C_API.   It
+  goes through the same paths as read, write and read_wait_many, minus
+  the Python objects.
+*/
+int capiNames(const char *partnerArg, const char *nameArg, char *partner, char *name, dsmDescriptor **descriptor)
+{
+  int i;
+
+  if ((strlen(partnerArg) >= DSM_NAME_LENGTH) || (strlen(nameArg) >= DSM_NAME_LENGTH) || (nameArg[0] == (char)0))
+    return DSM_NAME_INVALID;
+  for (i = 0; partnerArg[i]; i++)
+    partner[i] = tolower(partnerArg[i]);
+  partner[i] = (char)0;
+  for (i = 0; nameArg[i]; i++)
+    name[i] = toupper(nameArg[i]);
+  name[i] = (char)0;
+  if (open_dsm() != DSM_SUCCESS) {
+    PyErr_Clear();
+    return DSM_NO_RESOURCE;
+  }
+  if ((*descriptor = lookupDescriptor(name)) == NULL) {
+    PyErr_Clear();
+    return DSM_NAME_INVALID;
+  }
+  if ((*descriptor)->type == DSM_STRUCTURE)
+    return DSM_NAME_INVALID;
+  return DSM_SUCCESS;
+}
+
+int capiDescribe(const char *nameArg, pydsmDescription *description)
+{
+  int status;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  dsmDescriptor *descriptor;
+
+  if ((status = capiNames("", nameArg, partner, name, &descriptor)) != DSM_SUCCESS)
+    return status;
+  description->type = descriptor->type;
+  description->nDim = descriptor->nDim;
+  description->dimensions = descriptor->dimensions;
+  description->elementSize = descriptor->elementSize;
+  description->nElements = descriptor->nElements;
+  description->size = descriptor->size;
+  return DSM_SUCCESS;
+}
+
+int capiRead(const char *partnerArg, const char *nameArg, void *buf, int size, time_t *timestamp, double timeout)
+{
+  int status;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  double deadline;
+  dsmDescriptor *descriptor;
+
+  if ((status = capiNames(partnerArg, nameArg, partner, name, &descriptor)) != DSM_SUCCESS)
+    return status;
+  if (size < descriptor->size)
+    return DSM_ALLOC_VERS;
+  deadline = (timeout > 0.0) ? wallClock() + timeout : 0.0;
+  Py_BEGIN_ALLOW_THREADS
+  status = readRawWithin(partner, name, (char *)buf, descriptor->size, timestamp, deadline);
+  Py_END_ALLOW_THREADS
+  return status;
+}
+
+int capiWrite(const char *partnerArg, const char *nameArg, const void *buf, int size, int notify, double timeout)
+{
+  int status;
+  char partner[DSM_NAME_LENGTH], name[DSM_NAME_LENGTH];
+  double deadline;
+  dsmDescriptor *descriptor;
+
+  if ((status = capiNames(partnerArg, nameArg, partner, name, &descriptor)) != DSM_SUCCESS)
+    return status;
+  if (size != descriptor->size)
+    return DSM_ALLOC_VERS;
+  deadline = (timeout > 0.0) ? wallClock() + timeout : 0.0;
+  Py_BEGIN_ALLOW_THREADS
+  status = writeRaw(partner, name, (char *)buf, size, notify, NULL, deadline);
+  Py_END_ALLOW_THREADS
+  return status;
+}
+
+int capiTakeEvents(pydsmEvent *events, int maxEvents, double timeout)
+{
+  int nEvents = 0;
+  monitorEvent *taken, *event;
+
+  if (maxEvents < 1)
+    return 0;
+  if ((monitorMaxSize <= 0) && (timeout < 0.0))
+    return -DSM_ERROR; /* It would wait for ever */
+  if ((open_dsm() != DSM_SUCCESS) || (startMonitorReader() != DSM_SUCCESS)) {
+    PyErr_Clear();
+    return -DSM_NO_RESOURCE;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  taken = takeMonitorEvents(maxEvents, timeout);
+  Py_END_ALLOW_THREADS
+  for (event = taken; event != NULL; event = event->next, nEvents++) {
+    strcpy(events[nEvents].partner, event->partner);
+    strcpy(events[nEvents].name, event->name);
+    events[nEvents].timestamp = event->timestamp;
+    events[nEvents].size = event->size;
+    events[nEvents].data = event->data;
+    events[nEvents].handle = event;
+  }
+  return nEvents;
+}
+
+void capiReleaseEvents(pydsmEvent *events, int nEvents)
+{
+  int i;
+
+  for (i = 0; i < nEvents; i++) {
+    pydsmFree(events[i].handle);
+    events[i].handle = NULL;
+    events[i].data = NULL;
+  }
+}
+
+void capiSetError(int status)
+{
+  raiseDSMError(status, "pydsm C API");
+}
+
+/* For generated code which checked the names and size when it was imported, so nothing is case-fixed or looked up */
+int capiReadExact(const char *partner, const char *name, void *buf, int size, time_t *timestamp, double timeout)
+{
+  int status;
+  double deadline;
+
+  if (open_dsm() != DSM_SUCCESS) {
+    PyErr_Clear();
+    return DSM_NO_RESOURCE;
+  }
+  deadline = (timeout > 0.0) ? wallClock() + timeout : 0.0;
+  Py_BEGIN_ALLOW_THREADS
+  status = readRawWithin((char *)partner, (char *)name, (char *)buf, size, timestamp, deadline);
+  Py_END_ALLOW_THREADS
+  return status;
+}
+
+int capiWriteExact(const char *partner, const char *name, const void *buf, int size, int notify, double timeout)
+{
+  int status;
+  double deadline;
+
+  if (open_dsm() != DSM_SUCCESS) {
+    PyErr_Clear();
+    return DSM_NO_RESOURCE;
+  }
+  deadline = (timeout > 0.0) ? wallClock() + timeout : 0.0;
+  Py_BEGIN_ALLOW_THREADS
+  status = writeRaw((char *)partner, (char *)name, (char *)buf, size, notify, NULL, deadline);
+  Py_END_ALLOW_THREADS
+  return status;
+}
+
+static pydsmCAPI capi = {PYDSM_CAPI_VERSION, capiDescribe, capiRead, capiWrite, capiTakeEvents, capiReleaseEvents,
+			 capiSetError, capiReadExact, capiWriteExact};
+
+#ifdef PYDSM_FASTCALL
+#define FASTCALL(function) (PyCFunction)(void (*)(void))function##_fast
+#define FASTCALL_FLAGS     (METH_FASTCALL | METH_KEYWORDS)
+#else
+#define FASTCALL(function) (PyCFunction)function
+#define FASTCALL_FLAGS     (METH_VARARGS | METH_KEYWORDS)
+#endif
+
 static PyMethodDef pydsmMethods[] = {
+  {"allocations",   (PyCFunction)pydsm_allocations,   METH_NOARGS,                  "Return {partner: (name, ...)} from the DSM allocation list"},
+  {"breaker",       (PyCFunction)pydsm_breaker,       METH_VARARGS | METH_KEYWORDS, "Set the failures in a row which make calls to a partner fail fast (0 for never), and how often it is probed"},
+  {"cache_stats",   (PyCFunction)pydsm_cache_stats,   METH_NOARGS,                  "Return counts of reads served from and fetched into the subscription table, per subscription"},
   {"clear_monitor", (PyCFunction)pydsm_clear_monitor, METH_NOARGS,                  "Clear the monitor list"},
   {"close",         (PyCFunction)pydsm_close,         METH_NOARGS,                  "Close DSM, release resources"},
-  {"monitor",                    pydsm_monitor,       METH_VARARGS,                 "Add a variable to the monitor list"},
+  {"describe",                   pydsm_describe,      METH_VARARGS,                 "Return (type code, shape, size in bytes) for a variable name"},
+  {"history",                    pydsm_history,       METH_VARARGS,                 "Keep the last depth samples of a variable (depth 0 stops)"},
+  {"history_get",                pydsm_history_get,   METH_VARARGS,                 "Return (samples, timestamps, type code, shape) for a variable's history"},
+  {"memory_stats",  (PyCFunction)pydsm_memory_stats,  METH_NOARGS,                  "Return the bytes and blocks pydsm itself has allocated, and the high-water mark"},
+  {"monitor",       (PyCFunction)pydsm_monitor,       METH_VARARGS | METH_KEYWORDS, "Add a variable to the monitor list, optionally with a deadband, min_interval (seconds) or max_rate (per second) for its events"},
+  {"monitor_fd",    (PyCFunction)pydsm_monitor_fd,    METH_NOARGS,                  "Return a file descriptor which is readable while monitor events are queued"},
+  {"monitor_stats", (PyCFunction)pydsm_monitor_stats, METH_NOARGS,                  "Return counts of delivered, filtered, dropped and coalesced events for each monitored variable"},
   {"no_monitor",                 pydsm_no_monitor,    METH_VARARGS,                 "Remove a variable from the monitor list"},
   {"open",                       pydsm_open,          METH_VARARGS,                 "Initialize DSM"},
-  {"read",                       pydsm_read,          METH_VARARGS,                 "Read a DSM variable"},
+  {"partner_health", (PyCFunction)pydsm_partner_health, METH_NOARGS,                "Return the circuit breaker state, failure and probe counts for each partner"},
+  {"partner_stats", (PyCFunction)pydsm_partner_stats, METH_NOARGS,                  "Return call, error and timeout counts and p50/p99/p999/max latencies for reads and writes, per partner"},
+  {"poll_every",    (PyCFunction)pydsm_poll_every,    METH_VARARGS | METH_KEYWORDS, "Read a variable every period seconds into the local table (and with events=True, to read_wait); period 0 stops"},
+  {"poll_stats",    (PyCFunction)pydsm_poll_stats,    METH_NOARGS,                  "Return poll, error and overrun counts and start jitter for each polled variable"},
+  {"read",          FASTCALL(pydsm_read),             FASTCALL_FLAGS, "Read a DSM variable, or the elements of it selected by index, giving up after timeout seconds"},
+  {"read_all",      FASTCALL(pydsm_read_all),         FASTCALL_FLAGS, "Read a variable from many partners at once, returning {partner: result or exception}"},
+  {"read_changes",  (PyCFunction)pydsm_read_changes,  METH_VARARGS | METH_KEYWORDS, "Read a structure, returning {member: (value, timestamp)} for only the members changed since the last read_changes"},
   {"read_wait",     (PyCFunction)pydsm_read_wait,     METH_NOARGS,                  "Wait for and read a monitored DSM variable"},
-  {"write",         (PyCFunction)pydsm_write,         METH_VARARGS | METH_KEYWORDS, "Write a DSM variable"},
+  {"read_wait_many", FASTCALL(pydsm_read_wait_many), FASTCALL_FLAGS, "Return a list of queued monitor events, waiting up to timeout seconds for the first"},
+  {"record",        (PyCFunction)pydsm_record,        METH_VARARGS | METH_KEYWORDS, "Start recording monitor events to a binary log"},
+  {"record_stop",   (PyCFunction)pydsm_record_stop,   METH_NOARGS,                  "Flush and close the monitor event log"},
+  {"reduce",        (PyCFunction)pydsm_reduce,        METH_VARARGS | METH_KEYWORDS, "Return ({op: value}, timestamp) for min, max, sum, mean, std, nan_count of an array"},
+  {"replay",        (PyCFunction)pydsm_replay,        METH_VARARGS | METH_KEYWORDS, "Feed a recorded log through read_wait, or stop doing so if path is None"},
+  {"shm_close",     (PyCFunction)pydsm_shm_close,     METH_NOARGS,                  "Unmap the host-local snapshot region"},
+  {"shm_open",      (PyCFunction)pydsm_shm_open,      METH_VARARGS | METH_KEYWORDS, "Map the host-local snapshot region, as its writer or as a reader"},
+  {"shm_publish",                pydsm_shm_publish,   METH_VARARGS,                 "Keep a variable in the snapshot region (writer only)"},
+  {"shm_refresh",   (PyCFunction)pydsm_shm_refresh,   METH_NOARGS,                  "Re-read every variable kept in the snapshot region (writer only)"},
+  {"snapshot",      (PyCFunction)pydsm_snapshot,      METH_VARARGS | METH_KEYWORDS, "Read every variable in a spec into one self-describing block, returned or put in buffer"},
+  {"snapshot_spec",              pydsm_snapshot_spec, METH_VARARGS,                 "Compile a list of (partner, name) pairs into a spec for snapshot"},
+  {"subscribe",                  pydsm_subscribe,     METH_VARARGS,                 "Keep a variable's latest value locally, from monitor events, and serve reads of it from there"},
+  {"timestamps",    (PyCFunction)pydsm_timestamps,    METH_VARARGS | METH_KEYWORDS, "Return an array('d') of the ages in seconds of many (partner, name) variables, NaN where unreadable, without fetching their values into Python"},
+  {"unsubscribe",                pydsm_unsubscribe,   METH_VARARGS,                 "Stop keeping a variable's value locally"},
+  {"write",         FASTCALL(pydsm_write),            FASTCALL_FLAGS, "Write a DSM variable, giving up after timeout seconds"},
+  {"write_all",     FASTCALL(pydsm_write_all),        FASTCALL_FLAGS, "Write a value to many partners at once, returning {partner: (None or exception, seconds)}"},
   {NULL, NULL, 0, NULL}
 };
 
-PyMODINIT_FUNC initpydsm(void)
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef pydsmModule = {
+  PyModuleDef_HEAD_INIT, "pydsm", "Python API for the SMA DSM system", -1, pydsmMethods
+};
+#endif
+
+/* Creates the module and its exceptions, for either version's init function */
+PyObject *makeModule(void)
 {
   PyObject *m;
   
+#if PY_MAJOR_VERSION >= 3
+  m = PyModule_Create(&pydsmModule);
+#else
   m = Py_InitModule3("pydsm", pydsmMethods, "Python API for the SMA DSM system");
-  if (m == NULL)
-    return;
+#endif
+  if ((m == NULL) || (internKeys() != DSM_SUCCESS))
+    return NULL;
+  if (PyModule_AddObject(m, "_C_API", PyCapsule_New(&capi, PYDSM_CAPSULE_NAME, NULL)) != 0)
+    return NULL;
+#if PY_VERSION_HEX < 0x03070000
+  PyEval_InitThreads(); /* The monitor reader thread runs alongside the interpreter */
+#endif
+  Py_AtExit(finishRecording);
   dSMNoShare = PyErr_NewException("pydsm.DSM_NoShare", NULL, NULL);
   Py_INCREF(dSMNoShare);
   PyModule_AddObject(m, "DSM_NoShare", dSMNoShare);
@@ -1156,10 +6538,26 @@ PyMODINIT_FUNC initpydsm(void)
   dSMNothingMonitored = PyErr_NewException("pydsm.DSM_NothingMonitored", NULL, NULL);
   Py_INCREF(dSMNothingMonitored);
   PyModule_AddObject(m, "DSM_NothingMonitored", dSMNothingMonitored);
+  dSMTimeout = PyErr_NewException("pydsm.DSM_Timeout", NULL, NULL);
+  Py_INCREF(dSMTimeout);
+  PyModule_AddObject(m, "DSM_Timeout", dSMTimeout);
   dSMRPCFailure = PyErr_NewException("pydsm.DSM_RPCFailure", NULL, NULL);
   Py_INCREF(dSMRPCFailure);
   PyModule_AddObject(m, "DSM_RPCFailure", dSMRPCFailure);
   dSMInternalError = PyErr_NewException("pydsm.DSM_InternalError", NULL, NULL);
   Py_INCREF(dSMInternalError);
   PyModule_AddObject(m, "DSM_InternalError", dSMInternalError);
+  return m;
+}
+
+#if PY_MAJOR_VERSION >= 3
+PyMODINIT_FUNC PyInit_pydsm(void)
+{
+  return makeModule();
+}
+#else
+PyMODINIT_FUNC initpydsm(void)
+{
+  makeModule();
 }
+#endif
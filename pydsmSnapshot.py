@@ -0,0 +1,107 @@
+#!/usr/bin/env python
+# Decodes the blocks made by pydsm.snapshot, without needing pydsm or DSM.
+#
+#   import pydsmSnapshot
+#   values = pydsmSnapshot.decode(block)              # like pydsm.read results
+#   values = pydsmSnapshot.decode(block, arrays=True) # numpy arrays instead of tuples
+#
+# decode returns {(partner, name): (value, timestamp)}, with structures
+# gathered into {member: (value, timestamp)} dictionaries as pydsm.read
+# returns them.   A variable which could not be read maps to a
+# SnapshotError holding the DSM status instead.
+import struct, sys
+
+MAGIC = b'PYDSMSNP'
+HEADER = 'IIIIII'       # byteOrder, version, nEntries, headerSize, totalSize, spare
+ENTRY = 'IIIIcBBB'      # entrySize, dataOffset, dataSize, elementSize, type, nDim, partnerLength, nameLength
+VALUE = 'iiq'           # status, spare, timestamp
+sizes = {'b': 1, 'h': 2, 'i': 4, 'f': 4, 'd': 8}
+
+class SnapshotError(Exception):
+  def __init__(self, status):
+    Exception.__init__(self, 'DSM status %d' % (status))
+    self.status = status
+
+def text(raw):
+  raw = raw.split(b'\0', 1)[0]
+  if sys.version_info[0] >= 3:
+    return raw.decode('latin-1')
+  return raw
+
+def entries(block):
+  """Returns a list of dictionaries describing each variable in a snapshot"""
+  block = memoryview(block).tobytes()
+  if block[:8] != MAGIC:
+    raise ValueError('not a pydsm snapshot')
+  order = '<'
+  if struct.unpack('<I', block[8:12])[0] != 0x01020304:
+    order = '>'
+  (byteOrder, version, nEntries, headerSize, totalSize, spare) = struct.unpack(order + HEADER, block[8:32])
+  if version != 1:
+    raise ValueError('snapshot version %d is not supported' % (version))
+  if len(block) < totalSize:
+    raise ValueError('snapshot is truncated')
+  result = []
+  offset = 32
+  entrySize = struct.calcsize(order + ENTRY)
+  valueSize = struct.calcsize(order + VALUE)
+  for i in range(nEntries):
+    (size, dataOffset, dataSize, elementSize, code, nDim, partnerLength, nameLength) = \
+      struct.unpack(order + ENTRY, block[offset:offset+entrySize])
+    position = offset + entrySize
+    shape = struct.unpack(order + '%di' % (nDim), block[position:position+4*nDim])
+    position += 4*nDim
+    partner = text(block[position:position+partnerLength])
+    position += partnerLength + 1
+    name = text(block[position:position+nameLength])
+    (status, spare, timestamp) = struct.unpack(order + VALUE, block[dataOffset:dataOffset+valueSize])
+    result.append({'partner': partner, 'name': name, 'type': text(code), 'shape': shape,
+                   'elementSize': elementSize, 'status': status, 'timestamp': timestamp,
+                   'raw': block[dataOffset+valueSize:dataOffset+valueSize+dataSize], 'order': order})
+    offset += size
+  return result
+
+def nest(flat, shape):
+  if len(shape) <= 1:
+    return tuple(flat)
+  step = len(flat)//shape[0]
+  return tuple(nest(flat[i*step:(i+1)*step], shape[1:]) for i in range(shape[0]))
+
+def value(entry, arrays=False):
+  """Converts one entry's raw bytes to what pydsm.read would give (or a numpy array)"""
+  raw, shape, code = entry['raw'], entry['shape'], entry['type']
+  if code == 'S':
+    size = entry['elementSize']
+    strings = [text(raw[i:i+size]) for i in range(0, len(raw), size)]
+    if arrays and shape:
+      import numpy
+      return numpy.array(strings).reshape(shape)
+    return strings[0] if not shape else nest(strings, shape)
+  if arrays and shape:
+    import numpy
+    return numpy.frombuffer(raw, dtype=numpy.dtype(code).newbyteorder(entry['order'])).reshape(shape)
+  flat = struct.unpack(entry['order'] + '%d%s' % (len(raw)//sizes[code], code), raw)
+  return flat[0] if not shape else nest(flat, shape)
+
+def decode(block, arrays=False):
+  """Returns {(partner, name): (value, timestamp) or SnapshotError} for a snapshot"""
+  result = {}
+  for entry in entries(block):
+    (structure, colon, member) = entry['name'].partition(':')
+    key = (entry['partner'], structure)
+    if entry['status'] != 0:
+      result[key] = SnapshotError(entry['status'])
+      continue
+    item = (value(entry, arrays), entry['timestamp'])
+    if not colon:
+      result[key] = item
+    elif not isinstance(result.get(key), SnapshotError):
+      result.setdefault(key, {})[member] = item
+  return result
+
+if __name__ == '__main__':
+  # Prints each snapshot file named on the command line
+  for path in sys.argv[1:]:
+    values = decode(open(path, 'rb').read())
+    for key in sorted(values):
+      print('%s %s %s' % (key[0], key[1], values[key]))
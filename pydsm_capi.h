@@ -0,0 +1,107 @@
+/*
+  C API exported by pydsm, for other extension modules which need DSM
+  values in their own loops without going through Python objects.   They
+  share pydsm's DSM connection, descriptor cache, subscription table,
+  snapshot region, history, latency statistics and circuit breakers.
+
+    #include "pydsm_capi.h"
+
+    static pydsmCAPI *dsmAPI;
+    ...
+    if ((dsmAPI = pydsmImportCAPI()) == NULL)      (in the module's init function)
+      return NULL;
+    ...
+    status = dsmAPI->read("hcn", "DSM_AS_SCANS_REMAINING_L", &value, sizeof(value), &timestamp, 0.0);
+    if (status != DSM_SUCCESS) {
+      dsmAPI->setError(status);                      (raises the matching pydsm exception)
+      return NULL;
+    }
+
+  Every function must be called with the GIL held, and gives it up while
+  waiting on the network or for events.   They return a DSM status, and
+  never leave a Python exception set.   Names are case-fixed as the Python
+  API does.   A timeout of 0 means none, otherwise the call gives up after
+  that many seconds with DSM_TIMED_OUT.   Structures can't be read or
+  written through this interface.
+*/
+#ifndef PYDSM_CAPI_H
+#define PYDSM_CAPI_H
+
+#include "Python.h"  /* Before any system header */
+#include <time.h>
+#include "dsm.h"
+
+#define PYDSM_CAPI_VERSION  (2)
+#define PYDSM_CAPSULE_NAME  "pydsm._C_API"
+
+/* Variable types, as decoded from the last character of their names */
+#define DSM_BYTE      (1)
+#define DSM_SHORT     (2)
+#define DSM_LONG      (3)
+#define DSM_FLOAT     (4)
+#define DSM_DOUBLE    (5)
+#define DSM_STRING    (6)
+#define DSM_STRUCTURE (7)
+
+#define DSM_TIMED_OUT (101)  /* pydsm's own status, for calls given up on at their deadline */
+
+typedef struct {
+  int type;
+  int nDim;               /* Not counting a string's length */
+  const int *dimensions;  /* Belongs to pydsm, and lasts as long as it is loaded */
+  int elementSize;        /* For strings, their length */
+  int nElements;
+  int size;               /* The bytes a raw read or write of the variable takes */
+} pydsmDescription;
+
+typedef struct {
+  char partner[DSM_NAME_LENGTH];
+  char name[DSM_NAME_LENGTH];
+  time_t timestamp;
+  int size;
+  const char *data;       /* Valid until the event is released */
+  void *handle;
+} pydsmEvent;
+
+typedef struct {
+  int version;
+  int (*describe)(const char *name, pydsmDescription *description);
+  /* size must be at least the variable's size */
+  int (*read)(const char *partner, const char *name, void *buf, int size, time_t *timestamp, double timeout);
+  /* size must be exactly the variable's size */
+  int (*write)(const char *partner, const char *name, const void *buf, int size, int notify, double timeout);
+  /*
+    Takes up to maxEvents live (not replayed) monitor events, waiting up to
+    timeout seconds (-1 for ever) for the first.   Returns how many it
+    took, or minus a DSM status.
+  */
+  int (*takeEvents)(pydsmEvent *events, int maxEvents, double timeout);
+  void (*releaseEvents)(pydsmEvent *events, int nEvents);
+  void (*setError)(int status);
+  /*
+    Version 2.   As read and write, for callers which already hold the
+    names in their canonical case and the variable's exact size, as
+    checked against describe - typically when a module is imported.
+    Nothing is looked up or checked per call.
+  */
+  int (*readExact)(const char *partner, const char *name, void *buf, int size, time_t *timestamp, double timeout);
+  int (*writeExact)(const char *partner, const char *name, const void *buf, int size, int notify, double timeout);
+} pydsmCAPI;
+
+#ifndef PYDSM_MODULE
+/* Returns the table, or NULL with ImportError set */
+static pydsmCAPI *pydsmImportCAPI(void)
+{
+  pydsmCAPI *api;
+
+  if ((api = (pydsmCAPI *)PyCapsule_Import(PYDSM_CAPSULE_NAME, 0)) == NULL)
+    return NULL;
+  if (api->version < PYDSM_CAPI_VERSION) {
+    PyErr_SetString(PyExc_ImportError, "pydsm's C API is older than pydsm_capi.h");
+    return NULL;
+  }
+  return api;
+}
+#endif
+
+#endif
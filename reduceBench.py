@@ -0,0 +1,39 @@
+#!/usr/bin/env python
+# Compares pydsm.reduce with reading an array as tuples and reducing it in Python,
+# and fails if their min, max, mean or std differ by more than rounding
+import pydsm, time, math, sys
+partner = 'hcn'
+name = 'DSM_SPECTRUM_V16_V4096_F'
+nLoops = 200
+if len(sys.argv) > 2:
+  partner = sys.argv[1]
+  name = sys.argv[2]
+
+start = time.time()
+for i in xrange(nLoops):
+  d = pydsm.read(partner, name)[0]
+  flat = [x for row in d for x in row] if isinstance(d[0], tuple) else list(d)
+  nans = sum(1 for x in flat if x != x)
+  good = [x for x in flat if x == x]
+  mean = sum(good)/len(good)
+  tupleStats = (min(good), max(good), mean, math.sqrt(sum((x-mean)**2 for x in good)/len(good)), nans)
+tupleTime = (time.time()-start)/nLoops
+
+start = time.time()
+for i in xrange(nLoops):
+  r = pydsm.reduce(partner, name, ops=['min', 'max', 'mean', 'std', 'nan_count'])[0]
+reduceTime = (time.time()-start)/nLoops
+
+print 'tuple path  %9.1f us per call ' % (tupleTime*1.0e6), tupleStats
+print 'reduce      %9.1f us per call ' % (reduceTime*1.0e6), (r['min'], r['max'], r['mean'], r['std'], r['nan_count'])
+print 'speedup     %9.1f' % (tupleTime/reduceTime)
+
+# Sums are taken in a different order, so allow for rounding, scaled by the values' spread
+tolerance = 1.0e-6*(abs(tupleStats[2]) + (tupleStats[1]-tupleStats[0])) + 1.0e-12
+for (op, expected, got) in zip(['min', 'max', 'mean', 'std'], tupleStats, (r['min'], r['max'], r['mean'], r['std'])):
+  if abs(expected-got) > tolerance:
+    print 'MISMATCH    %s: tuple path %r, reduce %r' % (op, expected, got)
+    sys.exit(1)
+if r['nan_count'] != tupleStats[4]:
+  print 'MISMATCH    nan_count: tuple path %d, reduce %d' % (tupleStats[4], r['nan_count'])
+  sys.exit(1)
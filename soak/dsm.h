@@ -0,0 +1,46 @@
+/* Stand-in for /global/dsm/dsm.h: just enough of the libdsm API for pydsm, used by "make soak" */
+#ifndef DSM_H
+#define DSM_H
+
+#include <time.h>
+
+#define DSM_NAME_LENGTH     (256)
+
+#define DSM_SUCCESS         (0)
+#define DSM_ERROR           (1)
+#define DSM_RPC_ERROR       (2)
+#define DSM_TARGET_INVALID  (3)
+#define DSM_NAME_INVALID    (4)
+#define DSM_ALLOC_VERS      (5)
+#define DSM_INTERNAL_ERROR  (6)
+#define DSM_NO_RESOURCE     (7)
+
+typedef struct {
+  char name[DSM_NAME_LENGTH];
+  int size;
+  char *data;
+} dsm_structure;
+
+struct dsm_allocation_list {
+  char host_name[DSM_NAME_LENGTH];
+  int n_entries;
+  char **alloc_list;
+};
+
+int dsm_open(void);
+int dsm_close(void);
+int dsm_read(char *host, char *name, void *value, time_t *timestamp);
+int dsm_write(char *host, char *name, void *value);
+int dsm_write_notify(char *host, char *name, void *value);
+int dsm_read_wait(char *host, char *name, void *value);
+int dsm_monitor(char *host, char *name);
+int dsm_no_monitor(char *host, char *name);
+int dsm_clear_monitor(void);
+int dsm_structure_init(dsm_structure *structure, char *name);
+void dsm_structure_destroy(dsm_structure *structure);
+int dsm_structure_get_element(dsm_structure *structure, char *name, void *value);
+int dsm_structure_set_element(dsm_structure *structure, char *name, void *value);
+int dsm_get_allocation_list(int *nhosts, struct dsm_allocation_list **alp);
+void dsm_error_message(int status, char *message);
+
+#endif
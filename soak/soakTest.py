@@ -0,0 +1,108 @@
+#!/usr/bin/env python
+# Runs millions of mixed pydsm operations, many of them failing on purpose,
+# and fails if resident memory or pydsm's own allocations keep growing.
+# Build with "make soak", which links pydsm against the stand-in libdsm
+# and sets STUBDSM_FAIL_RATE so reads and writes also fail at random.
+# It runs under Python 2 or 3.
+from __future__ import print_function
+import pydsm, random, sys, os, resource
+
+nOps = 2000000
+if len(sys.argv) > 1:
+  nOps = int(sys.argv[1])
+warmUp = nOps//10
+rssSlack = 1 << 20      # bytes of resident growth tolerated after warm up
+liveSlack = 64 << 10    # bytes of growth in pydsm.memory_stats() tolerated after warm up
+
+def residentBytes():
+  return int(open('/proc/self/statm').read().split()[1])*resource.getpagesize()
+
+crates = ['crate%d' % (i) for i in range(1, 13)]
+
+def readScalar():       pydsm.read('hcn', 'DSM_AS_SCANS_REMAINING_L')
+def readString():       pydsm.read('hcn', 'DSM_SOURCE_C24')
+def readStrings():      pydsm.read('hcn', 'DSM_NAMES_V4_C12')
+def readArray():        pydsm.read('hcn', 'DSM_CHAN_V8_V4_S')
+def readStructure():    pydsm.read(random.choice(crates), 'CRATE_TO_HAL_X')
+def readIndex():        pydsm.read('hcn', 'DSM_CHAN_V8_V4_S', index=(slice(1, 6, 2), -1))
+def readBadName():      pydsm.read('hcn', 'DSM_NOT_THERE_L')
+def readBadType():      pydsm.read('hcn', 'DSM_BAD_TYPE_Q')
+def readBadIndex():     pydsm.read('hcn', 'DSM_POWER_V128_F', index=500)
+def readDeadHost():     pydsm.read('deadhost', 'DSM_TEST_SHORT_S')
+def writeScalar():      pydsm.write('hcn', 'DSM_TEST_SHORT_S', random.randint(-100, 100), notify=True)
+def writeFloat():       pydsm.write('hcn', 'DSM_TEST_FLOAT_F', random.random(), notify=True)
+def writeArray():       pydsm.write('hcn', 'DSM_DELAY_V4_D', [random.random() for i in range(4)])
+def writeString():      pydsm.write('hcn', 'DSM_SOURCE_C24', 'source%d' % (random.randint(0, 99)))
+def writeLongString():  pydsm.write('hcn', 'DSM_SOURCE_C24', 'x'*40)
+def writeOutOfRange():  pydsm.write('hcn', 'DSM_TEST_BYTE_B', 1000)
+def writeArrayOutOfRange(): pydsm.write('hcn', 'DSM_CHAN_V8_V4_S', [[1, 2, 3, 4]]*7 + [[1, 2, 40000, 4]])
+def writeLongStrings(): pydsm.write('hcn', 'DSM_NAMES_V4_C12', ['a', 'b', 'x'*20, 'd'])
+def writeWrongType():   pydsm.write('hcn', 'DSM_DELAY_V4_D', 'not a list')
+def writeStructure():   pydsm.write(random.choice(crates), 'CRATE_TO_HAL_X', {'SCAN_NO_L': 1, 'CHAN_V4_F': [1, 2, 3, 4]})
+def writeBadMember():   pydsm.write('crate1', 'CRATE_TO_HAL_X', {'SCAN_NO_L': 'oops'})
+def writeBadKey():      pydsm.write('crate1', 'CRATE_TO_HAL_X', {1: 2})
+def readAll():          pydsm.read_all('DSM_TEST_DOUBLE_D', partners=crates + ['deadhost'], max_parallel=4)
+def writeAll():         pydsm.write_all('CRATE_TO_HAL_X', {'STATUS_S': 3}, partners=crates[:4] + ['deadhost'])
+def reduce():           pydsm.reduce('hcn', 'DSM_POWER_V128_F', ops=['min', 'max', 'mean', 'std', 'nan_count'])
+def history():          pydsm.history_get('hcn', 'DSM_TEST_SHORT_S')
+def events():           pydsm.read_wait_many(timeout=0)
+def snapshot():         pydsm.snapshot(snapshotSpec)
+def stats():            pydsm.monitor_stats(); pydsm.memory_stats(); pydsm.partner_stats(); pydsm.partner_health(); pydsm.poll_stats()
+def readTimeout():      pydsm.read('slowhost', random.choice(['DSM_CHAN_V8_V4_S', 'CRATE_TO_HAL_X']), timeout=0.001)
+def writeTimeout():     pydsm.write('slowhost', 'DSM_DELAY_V4_D', [1, 2, 3, 4], timeout=0.001)
+def structureTimeout(): # Mostly refused at once, with MAX_LATE_CALLS already waiting on slowhost
+  if random.random() < 0.5:
+    pydsm.read('slowhost', 'CRATE_TO_HAL_X', timeout=0.001)
+  else:
+    pydsm.write('slowhost', 'CRATE_TO_HAL_X', {'SCAN_NO_L': 2}, timeout=0.001)
+def readAllTimeout():   pydsm.read_all('CRATE_TO_HAL_X', partners=crates[:2] + ['slowhost'], timeout=0.001)
+def poll():             pydsm.poll_every(random.choice(crates), 'DSM_TEST_DOUBLE_D', random.choice([0, 0.001, 0.01]),
+                                         events=random.random() < 0.5)
+def readChanges():      pydsm.read_changes(random.choice(crates + ['slowhost', 'deadhost']), 'CRATE_TO_HAL_X', timeout=0.001)
+def timestamps():       pydsm.timestamps([(random.choice(crates), 'CRATE_TO_HAL_X'), ('hcn', 'DSM_POWER_V128_F'),
+                                          ('deadhost', 'DSM_TEST_SHORT_S'), ('slowhost', 'DSM_DELAY_V4_D')], timeout=0.001)
+
+# Weighted so that the expensive parallel calls don't dominate the run time
+operations = [(readScalar, 10), (readString, 5), (readStrings, 5), (readArray, 5), (readStructure, 5),
+              (readIndex, 5), (readBadName, 3), (readBadType, 3), (readBadIndex, 3), (readDeadHost, 3),
+              (writeScalar, 10), (writeFloat, 10), (writeArray, 5), (writeString, 5), (writeLongString, 2),
+              (writeOutOfRange, 2), (writeArrayOutOfRange, 2), (writeLongStrings, 2),
+              (writeWrongType, 2), (writeStructure, 5), (writeBadMember, 2),
+              (writeBadKey, 2), (readAll, 1), (writeAll, 1), (reduce, 3), (history, 3), (events, 10), (snapshot, 2),
+              (stats, 1), (readTimeout, 1), (writeTimeout, 1), (readAllTimeout, 1), (structureTimeout, 10),
+              (poll, 2), (timestamps, 2), (readChanges, 3)]
+schedule = []
+for (operation, weight) in operations:
+  schedule += [operation]*weight
+
+snapshotSpec = pydsm.snapshot_spec([('hcn', 'DSM_CHAN_V8_V4_S'), ('hcn', 'DSM_NAMES_V4_C12'), ('crate1', 'CRATE_TO_HAL_X'),
+                                    ('deadhost', 'CSO_METEOROLOGY_X')])
+pydsm.history('hcn', 'DSM_TEST_SHORT_S', 64)
+pydsm.monitor('hcn', 'DSM_TEST_SHORT_S')
+pydsm.monitor('hcn', 'DSM_TEST_FLOAT_F', deadband=0.1, max_rate=1000)
+pydsm.monitor_fd()
+pydsm.subscribe('hcn', 'DSM_TEST_SHORT_S')
+pydsm.subscribe('hcn', 'DSM_CHAN_V8_V4_S')
+stderr = os.dup(2)
+os.dup2(os.open(os.devnull, os.O_WRONLY), 2)  # pydsm complains on stderr about each bad value
+failures = 0
+for i in range(nOps):
+  if i == warmUp:
+    startRSS = residentBytes()
+    startLive = pydsm.memory_stats()['live_bytes']
+  try:
+    random.choice(schedule)()
+  except Exception:
+    failures += 1
+  if (i % 200000) == 0:
+    os.write(stderr, ('%8d ops, %8d failed, rss %6d kB, pydsm live %s\n' %
+                      (i, failures, residentBytes()//1024, pydsm.memory_stats()['live_bytes'])).encode())
+os.dup2(stderr, 2)
+rssGrowth = residentBytes() - startRSS
+liveGrowth = pydsm.memory_stats()['live_bytes'] - startLive
+print('%d ops (%d failed): resident memory grew %d bytes, pydsm live bytes grew %d' % (nOps, failures, rssGrowth, liveGrowth))
+print(pydsm.memory_stats())
+if (rssGrowth > rssSlack) or (liveGrowth > liveSlack):
+  print('FAILED: memory is growing')
+  sys.exit(1)
+print('PASSED')
@@ -0,0 +1,431 @@
+/*
+  Stand-in libdsm.  Keeps every allocation for a fixed set of hosts in
+  process memory, so pydsm can be built and exercised without the real
+  shared memory and RPC machinery.   "make soak" builds pydsm against it
+  and runs soakTest.py.
+
+  Environment variables:
+    STUBDSM_FAIL_RATE  fraction (0..1) of reads/writes that fail with DSM_RPC_ERROR
+    STUBDSM_DELAY_US   microseconds each read/write sleeps, to mimic an RPC
+  Writes to a host called "deadhost" always fail with DSM_RPC_ERROR.
+  Reads and writes of "slowhost" take an extra 20 ms, for timeouts.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "dsm.h"
+
+#define N_HOSTS (16)
+#define MAX_EVENTS (4096)
+
+static char *hostNames[N_HOSTS] = {"hcn", "colossus", "deadhost", "slowhost",
+				   "crate1", "crate2", "crate3", "crate4", "crate5", "crate6",
+				   "crate7", "crate8", "crate9", "crate10", "crate11", "crate12"};
+
+static char *allocNames[] = {
+  "DSM_AS_SCANS_REMAINING_L",
+  "DSM_TEST_BYTE_B",
+  "DSM_TEST_SHORT_S",
+  "DSM_TEST_FLOAT_F",
+  "DSM_TEST_DOUBLE_D",
+  "DSM_SOURCE_C24",
+  "DSM_NAMES_V4_C12",
+  "DSM_POWER_V128_F",
+  "DSM_CHAN_V8_V4_S",
+  "DSM_DELAY_V4_D",
+  "DSM_SPECTRUM_V16_V4096_F",
+  "CSO_METEOROLOGY_X:TEMP_F",
+  "CSO_METEOROLOGY_X:HUMIDITY_F",
+  "CSO_METEOROLOGY_X:WIND_DIR_F",
+  "CSO_METEOROLOGY_X:TIME_L",
+  "CSO_METEOROLOGY_X:STATION_C16",
+  "CRATE_TO_HAL_X:SCAN_NO_L",
+  "CRATE_TO_HAL_X:STATUS_S",
+  "CRATE_TO_HAL_X:INT_TIME_D",
+  "CRATE_TO_HAL_X:CHAN_V4_F",
+  NULL
+};
+
+typedef struct {
+  char name[DSM_NAME_LENGTH];
+  int size;
+  int offset; /* Offset within the parent structure, for members */
+  int parent; /* Index of the parent structure, or -1 */
+  int isStructure;
+  int monitored;
+  char *data;
+  time_t timestamp;
+} stubAlloc;
+
+typedef struct {
+  char host[DSM_NAME_LENGTH];
+  char name[DSM_NAME_LENGTH];
+  char *data;
+} stubEvent;
+
+static stubAlloc *allocs[N_HOSTS];
+static int nAllocs = 0;
+static int isOpen = 0;
+static double failRate = 0.0;
+static int delayUs = 0;
+static struct dsm_allocation_list *allocList = NULL;
+static stubEvent events[MAX_EVENTS];
+static int eventHead = 0;
+static int eventCount = 0;
+static pthread_mutex_t stubMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t eventCond = PTHREAD_COND_INITIALIZER;
+
+static int stubSize(char *name)
+{
+  int len, size, i;
+  char *ptr;
+
+  len = strlen(name);
+  switch (name[len-1]) {
+  case 'B': size = 1; break;
+  case 'S': size = 2; break;
+  case 'L': size = 4; break;
+  case 'F': size = 4; break;
+  case 'D': size = 8; break;
+  default:
+    i = len-2;
+    while ((i > 0) && (name[i] != 'C'))
+      i--;
+    size = atoi(&name[i+1]);
+  }
+  ptr = name;
+  while ((ptr = strstr(ptr, "_V")) != NULL) {
+    if (isdigit(ptr[2]))
+      size *= atoi(&ptr[2]);
+    ptr++;
+  }
+  return size;
+}
+
+static void buildCatalogue(void)
+{
+  int h, i, j;
+
+  for (i = 0; allocNames[i] != NULL; i++)
+    ;
+  /* Room for the members plus one entry per structure */
+  for (h = 0; h < N_HOSTS; h++)
+    allocs[h] = calloc(2*i, sizeof(stubAlloc));
+  for (h = 0; h < N_HOSTS; h++) {
+    int n = 0;
+
+    for (i = 0; allocNames[i] != NULL; i++) {
+      char *colon = strchr(allocNames[i], ':');
+
+      if (colon != NULL) {
+	int parent = -1;
+	stubAlloc *member;
+
+	for (j = 0; j < n; j++)
+	  if (allocs[h][j].isStructure && !strncmp(allocs[h][j].name, allocNames[i], colon-allocNames[i])
+	      && (strlen(allocs[h][j].name) == (size_t)(colon-allocNames[i])))
+	    parent = j;
+	if (parent < 0) {
+	  parent = n++;
+	  strncpy(allocs[h][parent].name, allocNames[i], colon-allocNames[i]);
+	  allocs[h][parent].isStructure = 1;
+	  allocs[h][parent].parent = -1;
+	}
+	member = &allocs[h][n++];
+	strcpy(member->name, colon+1);
+	member->size = stubSize(colon+1);
+	member->parent = parent;
+	member->offset = allocs[h][parent].size;
+	allocs[h][parent].size += member->size;
+      } else {
+	strcpy(allocs[h][n].name, allocNames[i]);
+	allocs[h][n].size = stubSize(allocNames[i]);
+	allocs[h][n].parent = -1;
+	n++;
+      }
+    }
+    nAllocs = n;
+    for (j = 0; j < n; j++) {
+      if (allocs[h][j].parent < 0) {
+	allocs[h][j].data = calloc(1, allocs[h][j].size);
+	allocs[h][j].timestamp = time(NULL);
+      }
+    }
+  }
+  allocList = calloc(N_HOSTS, sizeof(struct dsm_allocation_list));
+  for (h = 0; h < N_HOSTS; h++) {
+    int k = 0;
+
+    strcpy(allocList[h].host_name, hostNames[h]);
+    for (i = 0; allocNames[i] != NULL; i++)
+      ;
+    allocList[h].alloc_list = calloc(i, sizeof(char *));
+    for (i = 0; allocNames[i] != NULL; i++) {
+      allocList[h].alloc_list[k] = malloc(DSM_NAME_LENGTH);
+      strcpy(allocList[h].alloc_list[k], allocNames[i]);
+      k++;
+    }
+    allocList[h].n_entries = k;
+  }
+}
+
+static int findHost(char *host)
+{
+  int h;
+
+  for (h = 0; h < N_HOSTS; h++)
+    if (!strcmp(host, hostNames[h]))
+      return h;
+  return -1;
+}
+
+static stubAlloc *findAlloc(int h, char *name)
+{
+  int i;
+
+  for (i = 0; i < nAllocs; i++)
+    if ((allocs[h][i].parent < 0) && !strcmp(allocs[h][i].name, name))
+      return &allocs[h][i];
+  return NULL;
+}
+
+static int mimicRPC(char *host)
+{
+  if (delayUs > 0)
+    usleep(delayUs);
+  if (!strcmp(host, "slowhost"))
+    usleep(20000);
+  if (!strcmp(host, "deadhost"))
+    return DSM_RPC_ERROR;
+  if ((failRate > 0.0) && (drand48() < failRate))
+    return DSM_RPC_ERROR;
+  return DSM_SUCCESS;
+}
+
+int dsm_open(void)
+{
+  char *env;
+
+  pthread_mutex_lock(&stubMutex);
+  if (allocList == NULL) {
+    buildCatalogue();
+    if ((env = getenv("STUBDSM_FAIL_RATE")) != NULL)
+      failRate = atof(env);
+    if ((env = getenv("STUBDSM_DELAY_US")) != NULL)
+      delayUs = atoi(env);
+  }
+  isOpen = 1;
+  pthread_mutex_unlock(&stubMutex);
+  return DSM_SUCCESS;
+}
+
+int dsm_close(void)
+{
+  isOpen = 0;
+  return DSM_SUCCESS;
+}
+
+int dsm_read(char *host, char *name, void *value, time_t *timestamp)
+{
+  int h, status;
+  stubAlloc *a;
+
+  if ((h = findHost(host)) < 0)
+    return DSM_TARGET_INVALID;
+  if ((status = mimicRPC(host)) != DSM_SUCCESS)
+    return status;
+  pthread_mutex_lock(&stubMutex);
+  if ((a = findAlloc(h, name)) == NULL) {
+    pthread_mutex_unlock(&stubMutex);
+    return DSM_NAME_INVALID;
+  }
+  if (a->isStructure) {
+    dsm_structure *s = (dsm_structure *)value;
+
+    if (strcmp(s->name, name) || (s->size != a->size)) {
+      pthread_mutex_unlock(&stubMutex);
+      return DSM_ALLOC_VERS;
+    }
+    memcpy(s->data, a->data, a->size);
+  } else
+    memcpy(value, a->data, a->size);
+  *timestamp = a->timestamp;
+  pthread_mutex_unlock(&stubMutex);
+  return DSM_SUCCESS;
+}
+
+static int doWrite(char *host, char *name, void *value, int notify)
+{
+  int h, status;
+  stubAlloc *a;
+
+  if ((h = findHost(host)) < 0)
+    return DSM_TARGET_INVALID;
+  if ((status = mimicRPC(host)) != DSM_SUCCESS)
+    return status;
+  pthread_mutex_lock(&stubMutex);
+  if ((a = findAlloc(h, name)) == NULL) {
+    pthread_mutex_unlock(&stubMutex);
+    return DSM_NAME_INVALID;
+  }
+  if (a->isStructure)
+    memcpy(a->data, ((dsm_structure *)value)->data, a->size);
+  else
+    memcpy(a->data, value, a->size);
+  a->timestamp = time(NULL);
+  if (notify && a->monitored) {
+    stubEvent *e;
+
+    if (eventCount == MAX_EVENTS) {
+      /* Drop the oldest, as a full libdsm queue would */
+      free(events[eventHead].data);
+      eventHead = (eventHead+1) % MAX_EVENTS;
+      eventCount--;
+    }
+    e = &events[(eventHead+eventCount) % MAX_EVENTS];
+    strcpy(e->host, host);
+    strcpy(e->name, name);
+    e->data = malloc(a->size);
+    memcpy(e->data, a->data, a->size);
+    eventCount++;
+    pthread_cond_signal(&eventCond);
+  }
+  pthread_mutex_unlock(&stubMutex);
+  return DSM_SUCCESS;
+}
+
+int dsm_write(char *host, char *name, void *value)
+{
+  return doWrite(host, name, value, 0);
+}
+
+int dsm_write_notify(char *host, char *name, void *value)
+{
+  return doWrite(host, name, value, 1);
+}
+
+int dsm_read_wait(char *host, char *name, void *value)
+{
+  stubEvent *e;
+  int h;
+  stubAlloc *a;
+
+  pthread_mutex_lock(&stubMutex);
+  while (eventCount == 0)
+    pthread_cond_wait(&eventCond, &stubMutex);
+  e = &events[eventHead];
+  eventHead = (eventHead+1) % MAX_EVENTS;
+  eventCount--;
+  strcpy(host, e->host);
+  strcpy(name, e->name);
+  h = findHost(host);
+  a = findAlloc(h, name);
+  memcpy(value, e->data, a->size);
+  free(e->data);
+  pthread_mutex_unlock(&stubMutex);
+  return DSM_SUCCESS;
+}
+
+static int setMonitor(char *host, char *name, int on)
+{
+  int h;
+  stubAlloc *a;
+
+  if ((h = findHost(host)) < 0)
+    return DSM_TARGET_INVALID;
+  pthread_mutex_lock(&stubMutex);
+  a = findAlloc(h, name);
+  if (a != NULL)
+    a->monitored = on;
+  pthread_mutex_unlock(&stubMutex);
+  return (a == NULL) ? DSM_NAME_INVALID : DSM_SUCCESS;
+}
+
+int dsm_monitor(char *host, char *name)
+{
+  return setMonitor(host, name, 1);
+}
+
+int dsm_no_monitor(char *host, char *name)
+{
+  return setMonitor(host, name, 0);
+}
+
+int dsm_clear_monitor(void)
+{
+  int h, i;
+
+  pthread_mutex_lock(&stubMutex);
+  for (h = 0; h < N_HOSTS; h++)
+    for (i = 0; i < nAllocs; i++)
+      allocs[h][i].monitored = 0;
+  pthread_mutex_unlock(&stubMutex);
+  return DSM_SUCCESS;
+}
+
+int dsm_structure_init(dsm_structure *structure, char *name)
+{
+  stubAlloc *a;
+
+  if ((a = findAlloc(0, name)) == NULL || !a->isStructure)
+    return DSM_NAME_INVALID;
+  strcpy(structure->name, name);
+  structure->size = a->size;
+  structure->data = calloc(1, a->size);
+  return (structure->data == NULL) ? DSM_NO_RESOURCE : DSM_SUCCESS;
+}
+
+void dsm_structure_destroy(dsm_structure *structure)
+{
+  free(structure->data);
+  structure->data = NULL;
+}
+
+static stubAlloc *findMember(dsm_structure *structure, char *name)
+{
+  int i, parent = -1;
+
+  for (i = 0; i < nAllocs; i++)
+    if (allocs[0][i].isStructure && !strcmp(allocs[0][i].name, structure->name))
+      parent = i;
+  for (i = 0; i < nAllocs; i++)
+    if ((allocs[0][i].parent == parent) && (parent >= 0) && !strcmp(allocs[0][i].name, name))
+      return &allocs[0][i];
+  return NULL;
+}
+
+int dsm_structure_get_element(dsm_structure *structure, char *name, void *value)
+{
+  stubAlloc *m;
+
+  if ((m = findMember(structure, name)) == NULL)
+    return DSM_NAME_INVALID;
+  memcpy(value, &structure->data[m->offset], m->size);
+  return DSM_SUCCESS;
+}
+
+int dsm_structure_set_element(dsm_structure *structure, char *name, void *value)
+{
+  stubAlloc *m;
+
+  if ((m = findMember(structure, name)) == NULL)
+    return DSM_NAME_INVALID;
+  memcpy(&structure->data[m->offset], value, m->size);
+  return DSM_SUCCESS;
+}
+
+int dsm_get_allocation_list(int *nhosts, struct dsm_allocation_list **alp)
+{
+  dsm_open();
+  *nhosts = N_HOSTS;
+  *alp = allocList;
+  return DSM_SUCCESS;
+}
+
+void dsm_error_message(int status, char *message)
+{
+  fprintf(stderr, "%s: DSM status %d\n", message, status);
+}